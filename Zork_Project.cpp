@@ -1,24 +1,91 @@
 #include<iostream>
 #include<map>
+#include<set>
 #include<vector>
 #include<string>
 #include<sstream>
 #include<ctime>
+#include<chrono>
+#include<cstring>
+#include<fstream>
+#include<cstdio>
+#include<cerrno>
+#include<unistd.h>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<cstdint>
+#include<cmath>
+#include<charconv>
+#include<unordered_map>
+#include<unordered_set>
+#include<thread>
+#include<mutex>
+#include<shared_mutex>
+#include<atomic>
+#include<memory>
+#include<string_view>
+#include<algorithm>
+#include<type_traits>
+#include<cstdlib>
+#include<new>
+#include<typeinfo>
+#include<cxxabi.h>
+#include<csignal>
+#include<sys/epoll.h>
+#include<sys/timerfd.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<sys/resource.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
 
 using namespace std;
 
-/** Converts strings from UPPERCASE or MiXedCasE to lowercase. */
-string tolower(string &s)
+/** Converts UPPERCASE or MiXedCasE ASCII to lowercase in place, 16 characters at a time
+ *  where SSE2 is available. Bytes outside A-Z (including UTF-8) are left alone. */
+void lowercase(char *s, size_t length)
 {
-    string ns;
-    for (auto c : s) {
-        ns += tolower(c);
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i beforeA = _mm_set1_epi8('A' - 1);
+    const __m128i afterZ  = _mm_set1_epi8('Z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+        // Signed compares: bytes >= 0x80 are negative, so they never look like letters.
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeA), _mm_cmplt_epi8(chunk, afterZ));
+        chunk = _mm_or_si128(chunk, _mm_and_si128(upper, caseBit));
+        _mm_storeu_si128((__m128i *) (s + i), chunk);
+    }
+#endif
+    for (; i < length; i++) {
+        if (s[i] >= 'A' && s[i] <= 'Z') {
+            s[i] += 'a' - 'A';
+        }
     }
-    return ns;
 }
 
+/** Orders names without caring about case, so lookups never have to build a lowercase copy. */
+struct CaseInsensitiveLess
+{
+    // Lets map::find take a string_view directly instead of making a temporary string.
+    using is_transparent = void;
+
+    bool operator()(string_view a, string_view b) const
+    {
+        return lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+            [](unsigned char x, unsigned char y) { return tolower(x) < tolower(y); });
+    }
+};
+
 // EventListener.h
-/** Parent class of all listeners. (It is abstract and can't be instantiated) */
+/** Parent class of all untyped listeners. (It is abstract and can't be instantiated)
+ *  Only kept for old code: new listeners should derive from Listener<Payload> below. */
 class EventListener
 {
 public:
@@ -27,25 +94,559 @@ public:
     virtual void run(void *args) = 0;
 };
 
-// EventManager.h (Implemented as a Singleton)
-/** This class manages the event loop and all the event calls */
+//3) Template */
+/** Parent class of all typed listeners: run() gets exactly the payload its event carries. */
+template <typename Payload>
+class Listener
+{
+public:
+    virtual void run(Payload &payload) = 0;
+};
+
+// Payload of events that carry nothing (victory, defeat, ...).
+struct NoPayload {};
+
+//3) Template */
+/** A view of elements stored somewhere else (a small std::span). It never owns or copies them. */
+template <typename T>
+class Span
+{
+public:
+    Span() : first(nullptr), count(0) {}
+    Span(T *first, size_t count) : first(first), count(count) {}
+
+    size_t size() const  { return count; }
+    bool   empty() const { return count == 0; }
+    T &operator[](size_t i) const { return first[i]; }
+    T *begin() const { return first; }
+    T *end() const   { return first + count; }
+
+private:
+    T     *first;
+    size_t count;
+};
+
+// The words of a typed command, "go north" -> {"go", "north"}.
+// They point into the EventManager's line buffer and are only valid during that turn.
+typedef Span<const string_view> Words;
+
+// Tokenizer.h
+/** Splits a line into lowercase words without copying them. The line and the list of views
+ *  are reused from one line to the next, so a steady stream of commands doesn't allocate. */
+class Tokenizer
+{
+public:
+    // Lowercases "line" in place and splits it on any whitespace. Repeated spaces
+    // don't produce empty words. The result is valid until the next split() or until "line" changes.
+    Words split(string &line);
+
+private:
+    vector<string_view> words;
+};
+
+// Every event name gets a small number once, so triggering is just an array index.
+typedef unsigned int EventId;
+const EventId NO_EVENT = ~0u;
+
+//3) Template */
+/** An event ID that also remembers the payload type its listeners receive. */
+template <typename Payload>
+struct Event
+{
+    EventId id;
+};
+
+// TimerWheel.h
+// A timer's handle. It stops matching once the timer went off (for good) or was cancelled.
+typedef uint64_t TimerId;
+const TimerId NO_TIMER = 0;
+
+/** Timers that post an event after some ticks (turns, milliseconds, whatever the owner counts).
+ *  Four wheels of 64 slots: the first holds what's due in the next 64 ticks, one slot per tick,
+ *  the next what's due in the next 64 * 64 ticks, 64 ticks per slot, and so on. When the first
+ *  wheel comes round, the matching slot of the next one is spread over it. Adding, cancelling
+ *  and every tick are O(1) (amortized), however many timers are waiting. */
+class TimerWheel
+{
+public:
+    typedef uint64_t Tick;
+
+    TimerWheel();
+
+    TimerWheel(TimerWheel const& copy);            // Not Implemented (Copy constructor)
+    TimerWheel& operator=(TimerWheel const& copy); // Not Implemented (Assignment operator)
+
+    // Goes off "delay" ticks from now (at least 1), then every "period" ticks unless that's 0.
+    TimerId add(Tick delay, Tick period, EventId event, uint64_t value);
+
+    // False if the timer already went off for good, or was cancelled before.
+    bool cancel(TimerId timer);
+
+    // Moves time on towards "now", stopping at each timer that goes off: true with its event and
+    // payload, false once time is at "now". Timers can be added or cancelled in between.
+    bool expire(Tick now, EventId &event, uint64_t &value);
+
+    // The first tick something could go off (possibly a little early), or NEVER.
+    static constexpr Tick NEVER = ~(Tick) 0;
+    Tick nextDue() const;
+
+    Tick now() const;
+    size_t pending() const;
+    size_t memoryUsage() const;
+
+    // A timer that hasn't gone off yet: in how many ticks it will, and what it posts then.
+    struct Waiting
+    {
+        Tick     delay;
+        Tick     period;
+        uint64_t value;
+        EventId  event;
+    };
+
+    // Every timer waiting, soonest first (for saving them).
+    void waiting(vector<Waiting> &list) const;
+
+    // Cancels every timer.
+    void clear();
+
+private:
+    static constexpr int      LEVELS    = 4;
+    static constexpr int      SLOT_BITS = 6;
+    static constexpr uint32_t SLOTS     = 1 << SLOT_BITS;
+    static constexpr uint32_t DUE       = LEVELS * SLOTS;   // the list of timers going off now
+    static constexpr uint32_t NONE      = 0xFFFFFFFF;
+
+    struct Timer
+    {
+        Tick     expires;
+        Tick     period;
+        uint64_t value;
+        EventId  event;
+        uint32_t generation;    // part of the TimerId, bumped when the timer is freed
+        uint32_t list;          // level * SLOTS + slot, DUE, or NONE when free
+        uint32_t next;          // in its list, or the free list
+        uint32_t previous;
+    };
+
+    Tick nextStop() const;
+    void insert(uint32_t index);
+    void cascade(int level);
+    void link(uint32_t index, uint32_t list);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+
+    Tick          current;
+    vector<Timer> timers;               // freed ones are reused, so a steady game doesn't allocate
+    uint32_t      freeTimers;
+    size_t        count;
+    vector<uint32_t> heads;             // first-in first-out lists, one per slot and DUE
+    vector<uint32_t> tails;             // (made with the first timer: many wheels never get one)
+    uint64_t      occupied[LEVELS];     // a bit per slot that has timers, to skip empty ones
+};
+
+// Poller.h
+struct EventManager;
+
+/** Who takes the connections a Poller accepts, when they aren't all turns of one game. */
+class SessionHost
+{
+public:
+    // The connection is the host's now: it can add it as an input, or pass it on.
+    virtual void accepted(int fd) = 0;
+
+    // An input of this session's EventManager was closed (hung up, or "exit").
+    virtual void closed(EventManager *session) = 0;
+};
+
+/** Waits on every input at once with epoll: stdin, sockets (TCP on localhost or Unix) and a
+ *  timerfd for the clock's timers. Whole lines go to the EventManager as turns. One thread,
+ *  however many connections. */
+class Poller
+{
+public:
+    Poller();
+    ~Poller();
+
+    Poller(Poller const& copy);            // Not Implemented (Copy constructor)
+    Poller& operator=(Poller const& copy); // Not Implemented (Assignment operator)
+
+    // Lines read from fd are turns of this EventManager, whose screen goes to "output".
+    // With a prompt, "> " is written to the output before every line.
+    bool addInput(int fd, int output, bool prompt, EventManager *manager, string &error);
+
+    // Accepts connections, each one an input that is also its own output. Port 0 picks a free one.
+    bool listenTcp(int port, EventManager *manager, string &error);
+    bool listenUnix(const string &path, EventManager *manager, string &error);
+    int tcpPort() const;
+
+    // Connections go to the host instead of one EventManager, and a stopped session only
+    // closes its own connection.
+    void setHost(SessionHost *host);
+
+    // Reads connections (their fds) that another thread accepted and hands them to the host.
+    bool addHandoff(int fd, string &error);
+
+    // Whose clock timers the timerfd follows. By default the first input's (without a host).
+    void followClock(EventManager *manager);
+
+    // Waits up to "timeout" ms (-1: until something happens) and handles everything ready.
+    // False once there is nothing left to wait for.
+    bool poll(int timeout);
+
+    // Open inputs (not counting listening sockets).
+    size_t inputs() const;
+
+    // Writes to one of its connections without ever blocking: what the connection can't take
+    // yet waits and goes out, in order, when epoll says it can. A connection that falls more
+    // than MAX_UNSENT behind is cut off. Any other fd (a terminal) gets plain writes.
+    void send(int fd, string_view data);
+
+private:
+    // DRAINING: closed as an input, but still sending what it couldn't take before.
+    enum Kind : uint8_t { CLOSED, INPUT, LISTENER, HANDOFF, DRAINING };
+
+    // Indexed by fd (they're small numbers).
+    struct Source
+    {
+        Kind          kind;
+        bool          prompt;
+        int           output;
+        EventManager *manager;
+        string        pending;      // the start of a line that hasn't ended yet
+        string        unsent;       // output the connection couldn't take yet
+    };
+
+    bool open(string &error);
+    bool add(int fd, Kind kind, int output, bool prompt, EventManager *manager, string &error);
+    void close(int fd);
+    void accept(int fd);
+    void takeHandoff(int fd);
+    bool read(int fd);
+    bool writeUnsent(int fd);
+    void watchOutput(int fd, bool input, bool output);
+    void armClock();
+
+    // Longer than this with no end of line isn't a command: the connection gets dropped.
+    static constexpr size_t MAX_LINE = 64 * 1024;
+
+    // A connection that leaves this much output unread can't keep up: it gets dropped.
+    static constexpr size_t MAX_UNSENT = 1024 * 1024;
+
+    int                epollFd;
+    int                clockFd;
+    EventManager      *clockManager;    // whose clock the timerfd follows
+    SessionHost       *host;
+    long long          armedFor;        // ms the timerfd is set to, -1 when it's off
+    vector<Source>     sources;
+    size_t             openInputs;
+    size_t             listeners;
+    int                port;
+    string             unixPath;
+    vector<epoll_event> ready;
+    vector<char>       buffer;
+};
+
+// DispatchProfile.h
+/** Where the time goes in EventManager::dispatch(): how often each event is triggered, how
+ *  long each of its listeners takes (its run(), with everything that triggers in turn), and
+ *  how deep triggers nest. There is one profile for the whole process, so the games on all the
+ *  server's threads add up in it. Recording is only relaxed atomic adds into a table of fixed
+ *  size (and a compare-and-swap when a listener takes longer than ever): no locks, and nothing
+ *  is allocated after the first time an event is seen.
+ *
+ *  It's off unless enable() is called (before games start), and then dispatch() costs one
+ *  test of a bool more than it did. */
+class DispatchProfile
+{
+public:
+    // Nanoseconds, HDR style: a power of two is cut into 8 buckets, so whatever the scale a
+    // bucket is at most 12.5% wide. Everything past 2^41 ns (about 36 minutes) is in the last.
+    // The longest is kept exactly as well.
+    class Histogram
+    {
+    public:
+        void     record(uint64_t nanoseconds);
+        uint64_t count() const;
+        uint64_t longest() const;
+        uint64_t percentile(double fraction) const;     // the top of its bucket, or the longest if less
+    private:
+        static constexpr int SUB_BUCKETS = 8;
+        static constexpr int BUCKETS     = 40 * SUB_BUCKETS;
+        static int      bucketOf(uint64_t value);
+        static uint64_t highestIn(int bucket);
+
+        atomic<uint64_t> counts[BUCKETS];
+        atomic<uint64_t> most;
+    };
+
+    static DispatchProfile &get();
+    static void enable(bool enabled = true);
+    static bool enabled()
+    {
+        return on;
+    }
+
+    // What dispatch() tells it: an event was triggered "depth" triggers deep (1 at the top),
+    // and the listener at "index" of the event (of type "listener") took that long.
+    void triggered(EventId event, int depth);
+    void ran(EventId event, size_t index, const char *listener, uint64_t nanoseconds);
+
+    // A table of every event and listener that ran, for the stats command.
+    string report() const;
+
+    // The same as JSON, written to "path".
+    bool writeJson(const string &path, string &error) const;
+
+private:
+    // Events past MAX_EVENTS aren't profiled. Listeners past MAX_LISTENERS of one event all
+    // count as the last one.
+    static constexpr size_t MAX_EVENTS    = 256;
+    static constexpr size_t MAX_LISTENERS = 8;
+
+    struct ListenerProfile
+    {
+        atomic<const char *> type;      // mangled, as typeid() has it
+        atomic<uint64_t>     total;     // nanoseconds
+        Histogram            latency;
+    };
+
+    struct EventProfile
+    {
+        atomic<uint64_t> calls;
+        ListenerProfile  listeners[MAX_LISTENERS];
+    };
+
+    EventProfile *profileOf(EventId event);
+
+    static bool on;
+
+    // Made the first time an event is triggered, and kept until the process ends.
+    atomic<EventProfile *> events[MAX_EVENTS];
+    atomic<int>            deepest;
+};
+
+// DispatchTrace.h
+/** A timeline of event dispatch for a trace viewer (chrome://tracing or ui.perfetto.dev): a
+ *  span for every trigger and, inside it, one for every listener's run(), so triggers that
+ *  trigger more show up as the tree they are. Each thread records into a ring of its own (the
+ *  oldest spans are overwritten once it's full), which takes no lock and only stores its
+ *  position atomically. Rings outlive their threads, and writeJson() puts all of them in one
+ *  file in Chrome's trace event format.
+ *
+ *  Off unless enable() is called (before games start), like DispatchProfile. */
+class DispatchTrace
+{
+public:
+    static void enable(bool enabled = true);
+    static bool enabled()
+    {
+        return on;
+    }
+
+    // Nanoseconds on the steady clock, which spans are measured in.
+    static uint64_t now();
+
+    // A span of the calling thread: a listener's run() (of type "listener"), or, with a
+    // nullptr listener, the trigger of "event" around its listeners.
+    static void span(EventId event, const char *listener, uint64_t start, uint64_t duration);
+
+    // Every thread's spans, oldest first, to "path".
+    static bool writeJson(const string &path, string &error);
+
+private:
+    // Spans kept per thread: 8 MB of them.
+    static constexpr size_t RING_SIZE = 1 << 18;
+
+    struct Span
+    {
+        uint64_t    start;
+        uint64_t    duration;
+        const char *listener;
+        EventId     event;
+    };
+
+    struct Ring
+    {
+        unique_ptr<Span[]> spans;
+        atomic<uint64_t>   recorded;    // ever: the next one goes at recorded % RING_SIZE
+    };
+
+    // Made the first time a thread records a span, and kept until the process ends.
+    static Ring *addRing();
+    static vector<unique_ptr<Ring> > &rings();
+    static mutex &ringsLock();
+
+    static bool on;
+};
+
+// EventManager.h
+/** This class manages the event loop and all the event calls. Every game has its own, so
+ *  games (sessions of the server) never see each other's events. */
 struct EventManager // Structs in C++ are the same as classes, but default to "public" instead of "private".
 {
+    EventManager();
+
     // static inside a class or struct works exactly like in java
-    // Only one instance per class.
+    // The process's own instance: the one the single player game and the benchmarks use.
     static EventManager &getInstance(); // Gets an instance of the class (an object)
 
     // Making sure I can't have copies of this instance.
     EventManager(EventManager const& copy);            // Not Implemented (Copy constructor)
     EventManager& operator=(EventManager const& copy); // Not Implemented (Assignment operator)
 
-    // Registers an event.
-    void listen(string event_name, EventListener *listener);
+    // Gives an event name its ID, adding it the first time it is seen. Names ignore case.
+    static EventId intern(string_view event_name);
+
+    // Finds the ID of an event name without adding it. Returns NO_EVENT for unknown names.
+    static EventId lookup(string_view event_name);
+
+    // Once every name is in (before the games start), the table is frozen: from then on it's
+    // read without a lock, and intern() only finds names (NO_EVENT for a new one).
+    static void freezeNames();
+
+    // Registers a typed listener. It only compiles if the listener takes this event's payload,
+    // and every typed listener of an event must take the same one (a second type aborts).
+    // L should be final: the call below then goes straight to L::run and can be inlined.
+    template <typename Payload, typename L>
+    void listen(Event<Payload> event, L *listener)
+    {
+        static_assert(is_base_of<Listener<Payload>, L>::value, "Listener does not take this event's payload");
+        add(event.id, Slot{listener, &callTyped<Payload, L>, typeid(L).name()}, payloadType<Payload>());
+    }
+
+    // Registers an untyped listener.
+    void listen(EventId event, EventListener *listener);
+    void listen(string_view event_name, EventListener *listener);
+
+    // Emits a typed event. No casts on the caller's side and nothing is allocated.
+    template <typename Payload>
+    void trigger(Event<Payload> event, Payload &payload)
+    {
+        dispatch(event.id, &payload);
+    }
+
+    void trigger(Event<NoPayload> event)
+    {
+        NoPayload none;
+        dispatch(event.id, &none);
+    }
+
+    // Emits a typed event by name (typed commands). Events whose listeners expect another
+    // payload are ignored, so typing "hurt" can't hand a Words to a Character listener.
+    template <typename Payload>
+    bool trigger(string_view event_name, Payload &payload)
+    {
+        EventId event = lookupTyped<Payload>(event_name);
+        if (event == NO_EVENT) {
+            return false;
+        }
+        dispatch(event, &payload);
+        return true;
+    }
+
+    // Same as trigger(), but in queued mode the event waits in the queue until drain().
+    // Small plain payloads (like a RoomId) are copied into the queue; anything else must
+    // still be alive when the queue is drained.
+    template <typename Payload>
+    void post(Event<Payload> event, Payload &payload)
+    {
+        if constexpr (is_trivially_copyable<Payload>::value && sizeof(Payload) <= sizeof(uint64_t)) {
+            uint64_t value = 0;
+            memcpy(&value, &payload, sizeof(Payload));
+            enqueue(event.id, &payload, &value);
+        } else {
+            enqueue(event.id, &payload);
+        }
+    }
+
+    void post(Event<NoPayload> event)
+    {
+        static NoPayload none;
+        enqueue(event.id, &none);
+    }
+
+    // By name, like trigger(). Small plain payloads are copied the same way.
+    template <typename Payload>
+    bool post(string_view event_name, Payload &payload)
+    {
+        EventId event = lookupTyped<Payload>(event_name);
+        if (event == NO_EVENT) {
+            return false;
+        }
+        post(Event<Payload>{event}, payload);
+        return true;
+    }
+
+    // In queued mode post() defers events until drain() instead of running them right away.
+    void setQueued(bool queued);
 
-    // Emits an event
+    // Posts of this event with the same payload are merged into one until the end of the next
+    // drain(), e.g. several "hurt" events on the same Character during one turn.
+    void coalesce(EventId event);
+
+    // Runs queued events (and whatever they post) in order until the queue is empty.
+    void drain();
+
+    // Timers. A turn passes with every line of input; the clock counts milliseconds.
+    enum Clock { TURNS, MILLISECONDS };
+
+    // Posts the event after "delay" turns (or milliseconds), then every "period" more unless
+    // that's 0. The payload is copied, so it has to be small and plain (like a RoomId).
+    template <typename Payload>
+    TimerId schedule(Event<Payload> event, const Payload &payload, uint64_t delay, uint64_t period = 0, Clock clock = TURNS)
+    {
+        static_assert(is_trivially_copyable<Payload>::value && sizeof(Payload) <= sizeof(uint64_t),
+                      "Timers keep a copy of the payload, it must be small and plain");
+        uint64_t value = 0;
+        memcpy(&value, &payload, sizeof(Payload));
+        return addTimer(event.id, value, delay, period, clock);
+    }
+
+    TimerId schedule(Event<NoPayload> event, uint64_t delay, uint64_t period = 0, Clock clock = TURNS);
+
+    // Stops a timer. False if it already went off for good or was cancelled.
+    bool cancel(TimerId timer);
+
+    // One turn passes: the timers due (on either clock) post their events, which are drained.
+    void tick();
+
+    // Called by a command that uses up a turn (moving, taking, fighting...). Only then does
+    // handle_input() tick: looking at the map or mistyping a command doesn't move the enemies.
+    void takeTurn();
+
+    // Only the clock's timers, for waking up between turns.
+    void tickClock();
+
+    // Turns so far, and milliseconds since the game started.
+    uint64_t turn();
+    uint64_t milliseconds();
+
+    // Milliseconds until a clock timer could go off (0 if one is due), -1 if there are none.
+    long long nextClockTimeout();
+
+    // Every timer still waiting, on both clocks (soonest first on each), for saving a game.
+    // Put back with schedule() below after clearTimers().
+    struct WaitingTimer
+    {
+        uint64_t delay;
+        uint64_t period;
+        uint64_t value;
+        EventId  event;
+        Clock    clock;
+    };
+    void waitingTimers(vector<WaitingTimer> &list);
+    void clearTimers();
+
+    // schedule() for an event known only by its ID, with the payload already copied into "value".
+    TimerId schedule(EventId event, uint64_t value, uint64_t delay, uint64_t period, Clock clock);
+
+    // The name of an event ID ("" if there is no such event). It looks through every name.
+    static string name(EventId event);
+
+    // Emits an untyped event
     // "void *" is a generic pointer to anything.
     // !!! Highly unsafe, please don't do this at home without the presence of your parents !!!
-    void trigger(string event_name, void *args = nullptr);
+    void trigger(EventId event, void *args = nullptr);
 
     // Returns true if still running
     bool is_running();
@@ -53,33 +654,227 @@ struct EventManager // Structs in C++ are the same as classes, but default to "p
     // Stops the event loop
     void stop();
 
+    // Lets the event loop run again after stop()
+    void resume();
+
     // Reads the input and calls an input event
     void check_events();
 
+    // The two halves of check_events(): reading a line (false at the end of the input)
+    // and running the turn it describes.
+    bool read_input();
+    void handle_input();
+
+    // A turn for a line that came from somewhere else (a socket), shown on "output" (through
+    // the poller it came from, if it came from one).
+    void handle_line(string_view text, int output, Poller *poller = nullptr);
+
+    // The inputs event_loop() waits on, to add sockets before it starts.
+    Poller &getPoller();
+
+    // Where commands are read from (cin by default) and whether "> " is printed first.
+    void set_input(istream &input, bool prompt);
+
+    // Number of listener calls so far.
+    unsigned long long dispatched();
+
     // constantly checks for new inputs until the program ends.
+    // Everything is waited on with the poller, unless the input isn't stdin (or stdin is a
+    // plain file): then it's read line by line as before.
     void event_loop();
 
 private:
+    // One registered listener: the object and a function that knows its real type (and its
+    // name, for DispatchProfile).
+    struct Slot
+    {
+        void *listener;
+        void (*call)(void *listener, void *payload);
+        const char *type;
+    };
+
+    // Calls L::run directly. The listener and payload types were checked by listen() and trigger().
+    template <typename Payload, typename L>
+    static void callTyped(void *listener, void *payload)
+    {
+        static_cast<L *>(listener)->run(*static_cast<Payload *>(payload));
+    }
+
+    static void callUntyped(void *listener, void *payload);
+
+    // A unique address per payload type, used to check name-based triggers.
+    template <typename Payload>
+    static const void *payloadType()
+    {
+        static const char tag = 0;
+        return &tag;
+    }
+
+    // The event ID of a name, or NO_EVENT if its listeners don't take this payload.
+    template <typename Payload>
+    EventId lookupTyped(string_view event_name)
+    {
+        EventId event = lookup(event_name);
+        if (event >= payloadTypes.size() || payloadTypes[event] != payloadType<Payload>()) {
+            return NO_EVENT;
+        }
+        return event;
+    }
+
+    void add(EventId event, Slot slot, const void *type);
+    void dispatch(EventId event, void *payload);
+    void measuredDispatch(EventId event, void *payload);
+    void enqueue(EventId event, void *payload, const uint64_t *value = nullptr);
+    TimerId addTimer(EventId event, uint64_t value, uint64_t delay, uint64_t period, Clock clock);
+    void fire(TimerWheel &timers, uint64_t now);
+
+    // An event waiting in the queue. A copied payload is kept in "value" (payload is nullptr).
+    struct Pending
+    {
+        EventId  event;
+        void    *payload;
+        uint64_t value;
+    };
+
     // True if running
     bool running;
 
-    // map<K, V> is a collection of V's indexed by S.
-    // In this case, we have lists/vectors of events indexed by their names.
-    map<string, vector<EventListener*> > registeredEvents;
+    // The last line read and its words, kept so their memory is reused every turn.
+    istream  *input;
+    bool      prompt;
+    string    line;
+    Tokenizer tokenizer;
+    unsigned long long dispatchCount;
+    bool      turnTaken;    // by the line handle_input() is running
 
-    // Only EventManager can call the constructor, so the only way to get an instance
-    // is by calling getInstance.
-    EventManager();
+    // Lists of listeners indexed by event ID. Names live in the shared table behind intern().
+    vector<vector<Slot> > registeredEvents;
+
+    // Payload type of each event ID, taken from its first typed listener (nullptr if untyped).
+    vector<const void *> payloadTypes;
+
+    // Queued mode: a ring buffer of pending events. Its size is always a power of two (or 0
+    // until the first post), and it only grows when full, so a normal turn doesn't allocate.
+    bool            queued;
+    vector<Pending> queue;
+    size_t          queueHead;
+    size_t          queueSize;
+
+    // Which events coalesce (indexed by ID), and what was posted of them this turn.
+    vector<bool>    coalesced;
+    vector<Pending> postedThisTurn;
+
+    // One wheel per clock. The clock's TimerIds have the top bit set so cancel() can tell.
+    static constexpr TimerId CLOCK_TIMER = 1ULL << 63;
+    TimerWheel      turnTimers;
+    TimerWheel      clockTimers;
+    uint64_t        turns;
+    chrono::steady_clock::time_point started;
+
+    Poller          poller;
+
+};
+
+// Rooms are numbered 0, 1, 2, ... in the order the world declares them.
+typedef uint32_t RoomId;
+
+// "No room" (a wall, or an enemy that isn't in the world).
+const RoomId NO_ROOM = 0xFFFFFFFF;
+
+// Characters are numbered in the order they are created (see EntityStore).
+typedef uint32_t EntityId;
+const EntityId NO_ENTITY = 0xFFFFFFFF;
+
+// Where a turn is shown: an fd, and the Poller the turn came in on, which writes to its own
+// connections without blocking (nullptr: the fd is written to directly).
+struct Output
+{
+    int     fd;
+    Poller *poller;
+};
+
+// Events.h
+/** The events of the game, resolved once at startup. */
+namespace Events
+{
+    const Event<Words>     input          {EventManager::intern("input")};
+    const Event<Output>    source         {EventManager::intern("source")};   // where the next turn is shown
+    const Event<NoPayload> noCommand      {EventManager::intern("no_command")};
+    const Event<NoPayload> turnEnd        {EventManager::intern("turnEnd")};
+    const Event<NoPayload> idle           {EventManager::intern("idle")};     // all the input that was ready was run
+
+    // Commands
+    const Event<Words>     go             {EventManager::intern("go")};
+    const Event<Words>     map            {EventManager::intern("map")};
+    const Event<Words>     info           {EventManager::intern("info")};
+    const Event<Words>     restart        {EventManager::intern("restart")};
+    const Event<Words>     teleport       {EventManager::intern("teleport")};
+    const Event<Words>     take           {EventManager::intern("take")};
+    const Event<Words>     drop           {EventManager::intern("drop")};
+    const Event<Words>     attack         {EventManager::intern("attack")};
+    const Event<Words>     exit           {EventManager::intern("exit")};
+    const Event<Words>     travel         {EventManager::intern("travel")};
+    const Event<Words>     undo           {EventManager::intern("undo")};
+    const Event<Words>     save           {EventManager::intern("save")};
+    const Event<Words>     load           {EventManager::intern("load")};
+    const Event<Words>     stats          {EventManager::intern("stats")};
+
+    // State changes
+    const Event<EntityId>  characterDeath {EventManager::intern("characterDeath")};
+    const Event<RoomId>    enterRoom      {EventManager::intern("enterRoom")};
+    const Event<EntityId>  hurt           {EventManager::intern("hurt")};
+    const Event<NoPayload> victory        {EventManager::intern("victory")};
+    const Event<NoPayload> defeat         {EventManager::intern("defeat")};
+
+    // Timed
+    const Event<NoPayload> patrol         {EventManager::intern("patrol")};
+    const Event<NoPayload> report         {EventManager::intern("report")};   // the server's
+}
+
+// Screen.h
+/** Collects everything the game prints during a turn into one reusable buffer and writes it
+ *  out with a single write() instead of a flush per line. In diff mode only the lines that
+ *  changed since the last frame are redrawn (with ANSI cursor moves), for full-screen terminals. */
+class Screen
+{
+public:
+    // fd is where frames go, -1 throws them away (headless).
+    Screen(int fd = STDOUT_FILENO);
+
+//5) Binary operator overloading */
+    Screen &operator<<(string_view text);
+    Screen &operator<<(const char *text);
+    Screen &operator<<(char c);
+    Screen &operator<<(int number);
+    Screen &operator<<(double number);
+
+    // Writes the frame collected so far and starts a new one.
+    void flush();
+
+    // A poller writes for the connections it reads (see Poller::send).
+    void setOutput(int fd, Poller *poller = nullptr);
+    int  getOutput() const;
+    void setDiff(bool diff);
+
+private:
+    void writeAll(const string &data);
+
+    int    fd;
+    Poller *poller;     // nullptr: write() to fd directly
+    bool   diff;
+    string frame;       // this turn's text
+    string previous;    // last frame, for diff mode
+    string output;      // what actually gets written in diff mode
 };
 
 // InputListener
 class Game;
 
 // A listener that gets called when a new input is received.
-struct InputListener : EventListener // Structs default to public even in inheritance.
+struct InputListener final : Listener<Words> // Structs default to public even in inheritance.
 {
     InputListener(Game *game);
-    void run(void *args) override;
+    void run(Words &args) override;
 
 private:
     // We store a game pointer for easy access.
@@ -90,11 +885,11 @@ private:
 class Game;
 
 // A listener for the Go command
-class GoListener : public EventListener
+class GoListener final : public Listener<Words>
 {
 public:
     GoListener(Game *game);
-    void run(void *args) override;
+    void run(Words &args) override;
 private:
     Game  *game;
     string direction;
@@ -103,11 +898,11 @@ private:
 class Game;
 
 // A listener for the Teleport command
-class TeleportListener : public EventListener
+class TeleportListener final : public Listener<Words>
 {
 public:
     TeleportListener(Game *game);
-    void run(void *args) override;
+    void run(Words &args) override;
 private:
     Game *game;
 };
@@ -115,11 +910,11 @@ private:
 class Game;
 
 // A listener for the good ending
-class EnterRoomListener : public EventListener
+class EnterRoomListener final : public Listener<RoomId>
 {
 public:
     EnterRoomListener(Game *game);
-    void run(void *args) override;
+    void run(RoomId &room) override;
 private:
     Game *game;
 };
@@ -127,11 +922,11 @@ private:
 class Game;
 
 // A listener for the bad ending
-class CharacterDeathListener : public EventListener
+class CharacterDeathListener final : public Listener<EntityId>
 {
 public:
     CharacterDeathListener(Game *game);
-    void run(void *args) override;
+    void run(EntityId &character) override;
 private:
     Game *game;
 };
@@ -139,170 +934,850 @@ private:
 class Game;
 
 // A listener for the good ending
-class RestartListener : public EventListener
+class RestartListener final : public Listener<Words>
 {
 public:
     RestartListener(Game *game);
-    void run(void *args) override;
+    void run(Words &args) override;
 private:
    Game *game;
 };
 
-// VictoryListener.h
 class Game;
 
-// A listener for the good ending
-class VictoryListener : public EventListener
+// A listener for the undo command
+class UndoListener final : public Listener<Words>
 {
 public:
-    VictoryListener(Game *game);
-    void run(void *args) override;
+    UndoListener(Game *game);
+    void run(Words &args) override;
 private:
-   Game *game;
+    Game *game;
 };
 
-// DefeatListener.h
 class Game;
 
-// A listener for the bad ending
-class DefeatListener : public EventListener
+// A listener for the save command
+class SaveListener final : public Listener<Words>
 {
 public:
-    DefeatListener(Game *game);
-    void run(void *args) override;
+    SaveListener(Game *game);
+    void run(Words &args) override;
 private:
     Game *game;
 };
 
 class Game;
 
-// A listener for the exit command
-class ExitListener : public EventListener
+// A listener for the load command
+class LoadListener final : public Listener<Words>
 {
 public:
-    ExitListener(Game *game);
-    void run(void *args) override;
+    LoadListener(Game *game);
+    void run(Words &args) override;
 private:
     Game *game;
 };
 
 class Game;
 
-// A listener for the exit command
-class MapListener : public EventListener
+// A listener for the stats command
+class StatsListener final : public Listener<Words>
 {
 public:
-    MapListener(Game *game);
-    void run(void *args) override;
+    StatsListener(Game *game);
+    void run(Words &args) override;
 private:
     Game *game;
 };
 
 class Game;
 
-class InfoListener : public EventListener
+// A listener that redraws the screen once every turn
+class TurnEndListener final : public Listener<NoPayload>
 {
 public:
-    InfoListener(Game *game);
-    void run(void *args) override;
+    TurnEndListener(Game *game);
+    void run(NoPayload &payload) override;
 private:
     Game *game;
 };
 
-class PureVirtualClass
+class Game;
+
+// A listener that keeps the journal going at the end of every turn
+class JournalListener final : public Listener<NoPayload>
 {
-    public:
-//8) Abstract classes and pure virtual functions */
-        virtual void virtualExample() = 0;
+public:
+    JournalListener(Game *game);
+    void run(NoPayload &payload) override;
+private:
+    Game *game;
 };
 
-//2) Inheritance */
-class Items : public PureVirtualClass
+class Game;
+
+// A listener that flushes the journal once the waiting input has all been run
+class IdleListener final : public Listener<NoPayload>
 {
-    private:
-        string description;
-    public:
-        void virtualExample();
-        Items();
-        Items(string description);
-        string getDescription();
+public:
+    IdleListener(Game *game);
+    void run(NoPayload &payload) override;
+private:
+    Game *game;
 };
 
-class Room
+// VictoryListener.h
+class Game;
+
+// A listener for the good ending
+class VictoryListener final : public Listener<NoPayload>
 {
 public:
+    VictoryListener(Game *game);
+    void run(NoPayload &payload) override;
+private:
+   Game *game;
+};
 
-//6) Friends */
-    friend class Character;
+// SourceListener.h
+class Game;
 
-    Room(string name);
-    string getName();
+// A listener for where the input comes from, so the turn is shown there
+class SourceListener final : public Listener<Output>
+{
+public:
+    SourceListener(Game *game);
+    void run(Output &output) override;
+private:
+   Game *game;
+};
 
-    void setExits(Room *north, Room *east, Room *south, Room *west);
-    Room *getExit(string direction);
-    
-    void removeItem(Items *item);
-    void addItem(Items *item);
-    
-    vector<Items> getItems();
+// PatrolListener.h
+class Game;
 
-    string displayItems();
+// A listener for the wandering enemies, who take a step every turn
+class PatrolListener final : public Listener<NoPayload>
+{
+public:
+    PatrolListener(Game *game);
+    void run(NoPayload &payload) override;
+private:
+   Game *game;
+};
 
-    bool isItemInRoom(string location);
-    int amountOfItems();
+// DefeatListener.h
+class Game;
+
+// A listener for the bad ending
+class DefeatListener final : public Listener<NoPayload>
+{
+public:
+    DefeatListener(Game *game);
+    void run(NoPayload &payload) override;
+private:
+    Game *game;
+};
 
-    vector<Items> itemList;
+class Game;
 
+// A listener for the exit command
+class ExitListener final : public Listener<Words>
+{
+public:
+    ExitListener(Game *game);
+    void run(Words &args) override;
 private:
-    string name;
-    map<string, Room *> exits;
+    Game *game;
+};
+
+class Game;
+
+// A listener for the exit command
+class MapListener final : public Listener<Words>
+{
+public:
+    MapListener(Game *game);
+    void run(Words &args) override;
+private:
+    Game *game;
+};
+
+class Game;
+
+class InfoListener final : public Listener<Words>
+{
+public:
+    InfoListener(Game *game);
+    void run(Words &args) override;
+private:
+    Game *game;
+};
+
+class Game;
+
+// A listener for the travel command
+class TravelListener final : public Listener<Words>
+{
+public:
+    TravelListener(Game *game);
+    void run(Words &args) override;
+private:
+    Game *game;
+};
+
+// ItemCatalog.h
+// Every item name gets a small number once, so rooms and characters only store numbers.
+typedef uint16_t ItemId;
+const ItemId NO_ITEM = 0xFFFF;
+
+/** The names of all items. Like event names, the table is shared by every game, and it's
+ *  frozen (read only, without a lock) once every name the games use is in. */
+struct ItemCatalog
+{
+    // Gives an item name its ID, adding it the first time it is seen.
+    // Returns NO_ITEM if the catalog is full, or frozen and the name is new.
+    static ItemId intern(string_view item_name);
+
+    // Finds the ID of an item name without adding it. Returns NO_ITEM for unknown names.
+    static ItemId lookup(string_view item_name);
+
+    static const string &name(ItemId item);
+
+    // How many names there are (IDs go from 0 to count() - 1).
+    static ItemId count();
+
+    // No names are added from here on (see EventManager::freezeNames).
+    static void freeze();
+};
+
+/** A handful of items (a room's floor, an inventory) as a count per ItemId,
+ *  so checking for, adding and removing an item doesn't search anything. */
+class ItemBag
+{
+public:
+    ItemBag();
+
+    // A bag holds at most MAX_COUNT of each item (a count is 16 bits, in snapshots too): past
+    // that, add() leaves the rest out.
+    static const int MAX_COUNT = UINT16_MAX;
+
+    void add(ItemId item, int count = 1);
+    bool remove(ItemId item);           // removes one; false if there was none
+    bool contains(ItemId item) const;
+    int  count(ItemId item) const;
+    int  size() const;                  // every item, duplicates included
+    bool empty() const;
+    void clear();
+
+    // Each kind of item once, in the order it was first added (for listing them).
+    const vector<ItemId> &kinds() const;
+
+    size_t memoryUsage() const;
+
+private:
+    vector<uint16_t> counts;            // indexed by ItemId
+    vector<ItemId>   order;
+    int              total;
+};
+
+//5) Binary operator overloading */
+// Everything in both bags, e.g. your inventory plus what a dead enemy carried.
+ItemBag operator + (const ItemBag &a, const ItemBag &b);
+
+class PureVirtualClass
+{
+    public:
+//8) Abstract classes and pure virtual functions */
+        virtual void virtualExample(Screen &screen) = 0;
+};
+
+//2) Inheritance */
+class Items : public PureVirtualClass
+{
+    private:
+        ItemId id;
+    public:
+        void virtualExample(Screen &screen);
+        Items();
+        Items(string description);
+        string getDescription();
+        ItemId getId();
+};
+
+// Direction.h
+/** The four ways out of a room, in the order exits are stored everywhere. */
+enum Direction
+{
+    NORTH,
+    EAST,
+    SOUTH,
+    WEST,
+    DIRECTION_COUNT,
+    NO_DIRECTION = DIRECTION_COUNT
+};
+
+// What the player types for each direction.
+const char *const DIRECTION_NAMES[DIRECTION_COUNT] = {"north", "east", "south", "west"};
+
+// "north" -> NORTH. Anything else (like "up") is NO_DIRECTION.
+Direction parseDirection(string_view word);
+
+// Random.h
+/** A game's own random numbers (xoshiro256**): a few shifts and multiplies per number, no
+ *  shared state, and the whole state is four words, so it goes in snapshots and saves. The
+ *  same seed always gives the same numbers, which is what makes replays (and simulations)
+ *  come out the same way every time.
+ *
+ *  split() hands out generators for parallel runs: each one starts 2^128 numbers further
+ *  along the sequence, so no two of them ever overlap. */
+class Random
+{
+public:
+    explicit Random(uint64_t seed = 0);
+
+    // Starts over from a seed (any value, 0 included).
+    void seed(uint64_t seed);
+
+    uint64_t next()
+    {
+        uint64_t result = rotate(state.s[1] * 5, 7) * 9;
+        uint64_t t = state.s[1] << 17;
+        state.s[2] ^= state.s[0];
+        state.s[3] ^= state.s[1];
+        state.s[1] ^= state.s[2];
+        state.s[0] ^= state.s[3];
+        state.s[2] ^= t;
+        state.s[3] = rotate(state.s[3], 45);
+        return result;
+    }
+
+    // A number in [0, bound), every one as likely (no "% bound" bias): a multiply, and a
+    // division only in the rare case a number has to be drawn again.
+    uint32_t below(uint32_t bound)
+    {
+        uint64_t product = (next() >> 32) * bound;
+        if ((uint32_t) product < bound) {
+            uint32_t threshold = -bound % bound;
+            while ((uint32_t) product < threshold) {
+                product = (next() >> 32) * bound;
+            }
+        }
+        return product >> 32;
+    }
+
+    // A generator for another thread or run: this one's sequence from here, while this one
+    // jumps 2^128 numbers ahead.
+    Random split();
+
+    // Everything there is to it, for snapshots.
+    struct State
+    {
+        uint64_t s[4];
+    };
+    const State &getState() const;
+    void         setState(const State &state);
+
+private:
+    static uint64_t rotate(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    void jump();
+
+    State state;
+};
+
+// Snapshot.h
+/** A game's changeable state as one flat block of plain numbers: how every character is and
+ *  where, what lies in which room, which exits moved. Taking one copies the columns out and
+ *  restoring copies them back in, so "restart" and "undo" don't rebuild anything, and a game
+ *  can be cloned by restoring another one's snapshot into it.
+ *
+ *  The block is a run of sections, each a count and then that many fixed-size records, read
+ *  back in the order they were written. Records are copied in and out with memcpy, so they
+ *  must be plain structs without padding (padding bytes would be whatever was on the stack). */
+class Snapshot
+{
+public:
+    Snapshot();
+
+    void           clear();
+    size_t         size() const;
+    const uint8_t *data() const;
+
+    // Appends a section.
+    template <typename T> void put(const T *records, uint32_t count)
+    {
+        static_assert(is_trivially_copyable<T>::value, "snapshots only hold plain records");
+        append(&count, sizeof(count));
+        append(records, (size_t) count * sizeof(T));
+    }
+    template <typename T> void put(const vector<T> &records)
+    {
+        put(records.data(), records.size());
+    }
+
+    // Or one record at a time: begin() says how many there will be, then add() each of them.
+    void begin(uint32_t count)
+    {
+        append(&count, sizeof(count));
+    }
+    template <typename T> void add(const T &record)
+    {
+        static_assert(is_trivially_copyable<T>::value, "snapshots only hold plain records");
+        append(&record, sizeof(T));
+    }
+
+    /** Reads the sections back. A block that ends early, or a section that isn't the size the
+     *  reader expects, makes it return false instead of reading past the end. */
+    class Reader
+    {
+    public:
+        Reader(const Snapshot &snapshot);
+        Reader(const uint8_t *data, size_t size);
+
+        // The next section, whatever its length.
+        template <typename T> bool get(vector<T> &records)
+        {
+            const uint8_t *start;
+            uint32_t count;
+            if (!next(start, count, sizeof(T))) {
+                return false;
+            }
+            records.resize(count);
+            memcpy(records.data(), start, (size_t) count * sizeof(T));
+            return true;
+        }
+
+        // The next section, which must have exactly "count" records.
+        template <typename T> bool get(T *records, uint32_t count)
+        {
+            const uint8_t *start;
+            uint32_t found;
+            if (!next(start, found, sizeof(T)) || found != count) {
+                return false;
+            }
+            memcpy(records, start, (size_t) count * sizeof(T));
+            return true;
+        }
+
+        // Or one record at a time: begin() checks that all "count" of them are there, so
+        // take() can then be called that many times.
+        template <typename T> bool begin(uint32_t &count)
+        {
+            const uint8_t *start;
+            if (!next(start, count, sizeof(T))) {
+                return false;
+            }
+            at = start;
+            return true;
+        }
+        template <typename T> void take(T &record)
+        {
+            memcpy(&record, at, sizeof(T));
+            at += sizeof(T);
+        }
+
+        bool atEnd() const;
+
+        // A snapshot from another process numbers items by that process's catalog. This says
+        // what each of its numbers is here; without it they're taken as they are.
+        void   mapItems(const vector<ItemId> *items);
+        ItemId item(ItemId saved) const;
+
+    private:
+        bool next(const uint8_t *&records, uint32_t &count, size_t recordSize);
+
+        const uint8_t        *at;
+        const uint8_t        *end;
+        const vector<ItemId> *items;
+    };
+
+private:
+    void append(const void *bytes, size_t size);
+
+    vector<uint8_t> bytes;
+};
+
+// What an owner (a room, or a character) has of one item.
+struct ItemRecord
+{
+    uint32_t owner;
+    ItemId   item;
+    uint16_t count;
+};
+
+// RoomArena.h
+class World;
+
+/** One game's view of the rooms of a World, addressed by RoomId.
+ *  The World is shared by every game playing it and never changes, so the arena only keeps
+ *  what this game changed on top of it: the rooms whose items differ from how the world
+ *  starts, exits that were moved, and who is where. Names, exits and starting items are read
+ *  straight from the World, so a game costs the same on a ten-room world and a million-room one.
+ *
+ *  It is also the index of who is in which room: each room's occupants form a linked list
+ *  threaded through two arrays indexed by EntityId, so moving is O(1) and listing a room
+ *  is O(its occupants), however many characters there are elsewhere. */
+class RoomArena
+{
+public:
+
+//6) Friends */
+    // Characters only move through EntityStore::setRoom(), so the index can't disagree with
+    // the store's room column.
+    friend class EntityStore;
+
+    RoomArena();
+
+    // Making sure the rooms are never copied by accident.
+    RoomArena(RoomArena const& copy);            // Not Implemented (Copy constructor)
+    RoomArena& operator=(RoomArena const& copy); // Not Implemented (Assignment operator)
+
+    // Plays on this world's rooms, as they are at the start.
+    void build(const World &world);
+
+    // Puts the items and exits back the way the world has them. Occupants are left alone:
+    // they follow the characters.
+    void reset();
+
+    const World &getWorld() const;
+
+    RoomId      size() const;
+    string_view getName(RoomId room) const;
+    RoomId      getExit(RoomId room, Direction direction) const;
+
+    // Changes one exit (NO_ROOM makes it a wall). A Router of these rooms must be told too.
+    void        setExit(RoomId room, Direction direction, RoomId next);
+    bool        exitsChanged() const;
+
+    // The direction that leads straight from one room to the other, or NO_DIRECTION.
+    Direction   directionTo(RoomId room, RoomId next) const;
+
+    // Who is in a room:
+    //     for (EntityId e = rooms.firstOccupant(room); e != NO_ENTITY; e = rooms.nextOccupant(e))
+    int      occupants(RoomId room) const;
+    EntityId firstOccupant(RoomId room) const;
+    EntityId nextOccupant(EntityId entity) const;
+
+    void   addItem(RoomId room, ItemId item);
+    bool   removeItem(RoomId room, ItemId item);   // false if it isn't there
+    void   clearItems(RoomId room);
+    bool   isItemInRoom(RoomId room, ItemId item) const;
+    int    amountOfItems(RoomId room) const;
+    string displayItems(RoomId room) const;
+    const ItemBag *itemsIn(RoomId room) const;      // nullptr if there never was anything
+
+    // Bytes used by this game's changes (not counting the World they sit on).
+    size_t memoryUsage() const;
+
+    // This game's changes into a snapshot, and back. The occupant index isn't saved: it is
+    // rebuilt from the characters' room column, once they have been restored.
+    void save(Snapshot &snapshot) const;
+    bool restore(Snapshot::Reader &reader, const vector<RoomId> &characterRooms);
+
+private:
+    void enter(RoomId room, EntityId entity);
+    void leave(RoomId room, EntityId entity);
+
+    // A copy of a room's items this game can change.
+    ItemBag &changeItems(RoomId room);
+
+    struct Occupants
+    {
+        EntityId first;
+        uint32_t count;
+    };
+
+    // How the changes are written in a snapshot.
+    struct ExitRecord
+    {
+        RoomId   room;
+        uint32_t direction;
+        RoomId   next;
+    };
+
+    const World                          *world;
+    unordered_map<RoomId, ItemBag>        changedItems;    // whole rooms, copied when first changed
+    unordered_map<uint64_t, RoomId>       changedExits;    // [room * DIRECTION_COUNT + direction]
+    unordered_map<RoomId, Occupants>      occupied;        // rooms anybody has been in
+    vector<EntityId>                      nextOccupants;   // indexed by EntityId
+    vector<EntityId>                      previousOccupants;
+};
+
+// Router.h
+/** What routing knows about a world's exits. For some "landmark" rooms it keeps a complete
+ *  next-hop tree: from every room, the exit that leads one step closer to the landmark, plus
+ *  how many steps that is. In small worlds every room is a landmark, which makes an all-pairs
+ *  table. Big worlds get a few landmarks spread far apart, and the distances from them too.
+ *
+ *  Only the exits go into it, so every game of a World reads the same tables (World::routes()).
+ *  A game that changes an exit gets a copy of its own. */
+struct RouteTables
+{
+    // Steps between rooms. Unknown means unreachable, or too far to store.
+    typedef uint16_t Distance;
+    static constexpr Distance UNKNOWN = 0xFFFF;
+
+    // Worlds up to this size get the all-pairs table; bigger ones this many landmarks.
+    static constexpr RoomId ALL_PAIRS_LIMIT = 512;
+    static constexpr RoomId LANDMARKS       = 8;
+
+    RouteTables();
+
+    // Picks the landmarks and builds all their trees, for the rooms' exits as they are now.
+    void build(const RoomArena &rooms);
+    void buildReverseExits(const RoomArena &rooms);
+    void buildLandmark(const RoomArena &rooms, RoomId index);
+
+    // Which landmark a room is, or NO_ROOM.
+    RoomId landmarkIndex(RoomId room) const;
+
+    size_t memoryUsage() const;
+
+    RoomId           count;
+    bool             allPairs;
+
+    vector<RoomId>   landmarks;
+    // Per landmark, what an exit change has spoilt. A removed exit only makes distances longer,
+    // so the old ones are still good lower bounds: only the tree needs rebuilding. A shortcut
+    // spoils both.
+    enum { STALE_TREE = 1, STALE_BOUND = 2 };
+    vector<uint8_t>  stale;
+    vector<uint8_t>  hops;              // [landmark * count + room]: direction towards the landmark
+    vector<Distance> distanceTo;        // [landmark * count + room]: steps from room to landmark
+    vector<Distance> distanceFrom;      // [landmark * count + room]: steps from landmark to room (ALT)
+
+    // Who has an exit into each room (for searching backwards), rebuilt after exits change.
+    bool             reverseStale;
+    vector<uint32_t> reverseStart;      // count + 1 entries
+    vector<RoomId>   reverseRooms;
+    vector<uint8_t>  reverseDirections;
+};
+
+/** Shortest paths between rooms, for the travel command and for characters that wander.
+ *  A route to a landmark follows its tree. Routes to other rooms are searched with A*, using
+ *  the landmark distances as a lower bound (ALT), and the last few are cached.
+ *
+ *  The tables are the World's, looked up on the first query. When an exit changes, only the
+ *  landmarks and cached routes that the change can affect are rebuilt, and only when next
+ *  needed. */
+class Router
+{
+public:
+    Router();
+
+    // Making sure the tables are never copied by accident.
+    Router(Router const& copy);            // Not Implemented (Copy constructor)
+    Router& operator=(Router const& copy); // Not Implemented (Assignment operator)
+
+    void attach(const RoomArena &rooms);
+
+    // Call after RoomArena::reset(): forgets the cached routes and goes back to the World's tables.
+    void reset();
+
+    // The exit to take from "from" towards "to". NO_DIRECTION if already there or unreachable.
+    Direction nextHop(RoomId from, RoomId to);
+
+    // Every room from "from" to "to", both included. False if "to" can't be reached.
+    bool route(RoomId from, RoomId to, vector<RoomId> &path);
+
+    // Rooms every route is known to (good places for characters to wander to).
+    RoomId landmarkCount();
+    RoomId landmark(RoomId index);
+
+    // Call after RoomArena::setExit(), with the room the exit used to lead to.
+    void exitChanged(RoomId room, Direction direction, RoomId before);
+
+    // Bytes this router has of its own (the World's tables aren't counted).
+    size_t memoryUsage() const;
+
+private:
+    typedef RouteTables::Distance Distance;
+
+    void prepare();
+    void rebuildStale(RoomId index);
+    Distance lowerBound(RoomId room) const;
+    bool search(RoomId from, RoomId to, vector<RoomId> &path);
+
+    const RoomArena         *rooms;
+    const RouteTables       *tables;    // the World's, or own
+    unique_ptr<RouteTables>  own;       // made when this game's exits first change
+
+    RoomId           target;
+    Distance         targetTo[RouteTables::LANDMARKS];
+    Distance         targetFrom[RouteTables::LANDMARKS];
+
+    // The last few searched routes, most recently used first.
+    struct CachedRoute
+    {
+        RoomId         to;
+        vector<RoomId> path;
+    };
+    static constexpr size_t CACHED_ROUTES = 8;
+    vector<CachedRoute> routes;
+    vector<RoomId>      path;           // scratch for nextHop()
 };
 
+// Rules.h
+/** What the commands do to the numbers, kept apart from printing and from the events, so the
+ *  game and the solver play by exactly the same rules. */
+namespace Rules
+{
+    const double GO_STAMINA       = 1.5;    // every step
+    const int    TELEPORT_STAMINA = 50;
+    const int    HURT             = 10;     // a blow: the cursed book, or pushing past an enemy
+    const int    FULL_HEALTH      = 100;
+    const int    POTION_HEALS     = 10;
+    const int    POTION_HEALS_UP_TO = 90;   // carrying the potion, taking anything heals at this health or less
+    const char *const CURSED_ITEM = "cursed_book";
+    const char *const POTION_ITEM = "potion";
+
+    // What trying an exit does. The key opens the locked room and gets you past enemies too.
+    enum Move { WALL, LOCKED, GUARDED, MOVED };
+    Move go(RoomId next, RoomId lockedRoom, bool hasKey, bool guarded);
+
+    // What picking something up does to the player's health: the cursed book takes HURT, then,
+    // carrying the potion (the new item counts) and still alive, it heals unless health is high.
+    enum Potion { NO_POTION, HEALS, FULL, TOO_HIGH };
+    struct Taken
+    {
+        bool   cursed;
+        Potion potion;
+        int    health;      // afterwards, never below 0
+    };
+    Taken take(bool cursed, bool hasPotion, int health);
+
+    // A blow at an enemy. Killing it gives the player everything it carried.
+    struct Blow
+    {
+        int  health;        // the enemy's, afterwards, never below 0
+        bool killed;
+    };
+    Blow attack(int health, int damage);
+
+    // Teleporting lands in any room, drawn from the game's generator, and what stamina is left
+    // is cut to a whole number (setStamina<int>).
+    struct Landing
+    {
+        RoomId room;
+        int    stamina;
+    };
+    Landing teleport(RoomId roomCount, double stamina, Random &random);
+
+    // The way a wandering character in "here" goes this turn (NO_DIRECTION: it stays). With no
+    // destination, or once there, it picks a landmark at random (never the start).
+    Direction wander(Router &router, RoomId start, RoomId here, RoomId &destination, Random &random);
+}
+
 //7) Virtual functions and polymorphism */
 class VirtualClass
 {
     public:
-        virtual void check()
+        virtual void check(Screen &screen)
         {
-            cout << "Printing from the virtual class" << endl;
+            screen << "Printing from the virtual class" << '\n';
         }
 
-        void change()
+        void change(Screen &screen)
         {
-            cout << "This is from the virtual class" << endl;
+            screen << "This is from the virtual class" << '\n';
         }
 };
 
-// No need to include room since we're only working with pointers.
-// This is how we tell the compiler "there will be a room eventually".
-// This is called a "forward declaration".
-class Room;
+// EntityStore.h
+/** Every character of a game, stored as one array per field (a structure of arrays).
+ *  Questions about everybody ("who is in this room?", "who wanders?") read one or two
+ *  flat columns from start to end, which stays quick with 100k+ characters.
+ *  A Character is only a view of one row. */
+class EntityStore
+{
+public:
+    // Deaths are posted to this game's events.
+    EntityStore(EventManager &events);
+
+    // Making sure the columns are never copied by accident.
+    EntityStore(EntityStore const& copy);            // Not Implemented (Copy constructor)
+    EntityStore& operator=(EntityStore const& copy); // Not Implemented (Assignment operator)
+
+    // Adds a row and returns its ID. New characters aren't in any room yet.
+    EntityId create(string_view name, int health, double stamina, int damage = 0, bool wanders = false);
+    EntityId size() const;
+
+    string_view getName(EntityId entity) const;
+    void        setName(EntityId entity, string_view name);
+
+    // Both post characterDeath when they reach 0.
+    void setHealth(EntityId entity, int health);
+    void setStamina(EntityId entity, double stamina);
+
+    // What a character carries. Most carry nothing, so bags are only made when asked for.
+    ItemBag &inventoryOf(EntityId entity);
+    bool     carries(EntityId entity, ItemId item) const;
+
+    // Moves a character (NO_ROOM takes it out of the world). This is the only way the room
+    // column changes, so the occupant index of the attached rooms stays right.
+    void setRoom(EntityId entity, RoomId next);
+
+    // The rooms whose occupant index follows this store's characters.
+    void attach(RoomArena &rooms);
+
+    // How every character is, where, and what they carry, into a snapshot and back. Restoring
+    // copies the columns in without posting anything (a character restored dead doesn't die
+    // again). The rooms rebuild their occupant index from the restored room column.
+    void save(Snapshot &snapshot) const;
+    bool restore(Snapshot::Reader &reader);
+
+    // The columns, one entry per character.
+    vector<int>      health;
+    vector<double>   stamina;
+    vector<RoomId>   room;
+    vector<uint32_t> nameId;        // index into names
+    vector<uint32_t> inventory;     // index into inventories, or NO_INVENTORY
+    vector<int>      damage;        // health it loses per attack
+    vector<uint8_t>  wanders;       // a room a turn towards its destination (Game::patrol)
+    vector<RoomId>   destination;   // where a wandering character is walking to (NO_ROOM: nowhere yet)
+
+private:
+    EventManager *events;
+    RoomArena *rooms;
+
+    static constexpr uint32_t NO_INVENTORY = 0xFFFFFFFF;
+
+    // Each name is stored once, however many characters share it.
+    vector<string>                 names;
+    map<string, uint32_t, less<> > nameIds;
+    vector<ItemBag>                inventories;
+};
+
 //2) Inheritance */
+/** One character, as a view of its row in an EntityStore. */
 class Character : public VirtualClass 
 {
 public:
-    Character(string n, int h, int s);
-    Character(string name);
-    Character();
+    Character(EntityStore &store, string n, int h, int s);
+    Character(EntityStore &store, string name);
+    Character(EntityStore &store);
+    Character(EntityStore &store, EntityId id);     // a character that is already stored
     ~Character();
 
-    void check();
-    void change();
+    void check(Screen &screen);
+    void change(Screen &screen);
 
-    vector<Items> itemsInventory;
-    
-    string getName();
-    int    getHealth();
-    double getStamina();
-    Room  *getCurrentRoom();
-
-    void addItem(Items item);
-    void addItemEnemy(Items item);
-    void removeItem(int location);
-    bool isItemInCharacter(string str);
-
-    Items* getItem(int location);
-    vector<Items> getItems();
+    EntityId    getId();
+    string_view getName();
+    int         getHealth();
+    double      getStamina();
+    RoomId      getCurrentRoom();
+
+    void addItem(ItemId item);
+    void addItemEnemy(ItemId item);
+    bool removeItem(ItemId item);
+    bool isItemInCharacter(ItemId item);
+
+    ItemBag &getItems();
     
     void setName(string name);
     void setHealth(int setHealth);
@@ -310,992 +1785,7784 @@ public:
 //3) Template */
     template <typename T> void setStamina(T stamina)
     {
-        if (stamina <= 0) 
-        {
-            this->stamina = 0;
-            EventManager::getInstance().trigger("characterDeath", this);
-        }  
-        this->stamina = stamina;
+        store->setStamina(id, stamina);
     }
 
-    void setCurrentRoom(Room *next);
-
- //5) Binary operator overloading */
-    vector<Items> operator + (Character a)
-    {
-        Character temp("test"); 
-        for(int i = 0; i < a.itemsInventory.size(); i++){
-            temp.itemsInventory.push_back(a.itemsInventory[i]);
-            cout<<"You killed the "<< a.getName() << ", and picked up it's Items -> " << a.itemsInventory[i].getDescription() << endl;
-        }
-        return temp.itemsInventory;
-    }
+    void setCurrentRoom(RoomId next);
 
  //4) Unary operator overloading */
     int operator ++ ()
     {
-        health = health + 10;
-        return health;
+        store->health[id] = store->health[id] + Rules::POTION_HEALS;
+        return store->health[id];
     }
 
 private:
+    EntityStore *store;
+    EntityId     id;
+};
+
+// World.h
+/** An item lying in a room when the game starts. */
+struct ItemSpec
+{
+    RoomId room;
     string name;
-    int health;
-    double stamina;
-    Room *currentRoom;
 };
 
-class Game
+/** An enemy as the world file describes it. */
+struct EnemySpec
+{
+    string         name;
+    RoomId         room;
+    int            health;
+    int            stamina;
+    int            damage;      // health it loses per attack
+    bool           wanders;     // walks a room a turn from landmark to landmark, by the shortest way
+    vector<string> loot;        // items it carries
+};
+
+/** Everything about a world that doesn't change while playing: rooms, exits, items, enemies
+ *  and the win condition. Rooms are numbered in the order the file declares them.
+ *
+ *  The text format has one directive per line ("#" starts a comment):
+ *      room <name>
+ *      exits <room> <north> <east> <south> <west>      ("-" for a wall)
+ *      item <room> <item>
+ *      enemy <name> <room> <health> <stamina> <damage> [wanders] [carries <item>...]
+ *      player <name> <health> <stamina>
+ *      start <room>
+ *      goal <room>
+ *      lock <room> <key item>
+ *      map <text>                                       (room names in it get marked)
+ *
+ *  The binary format (see save()) keeps the exits and names as flat arrays that load() maps
+ *  straight into memory, so even a huge world is ready without parsing it room by room. */
+class World
 {
 public:
-    Game();
-    void reset(bool show_update = true);
+    World();
+    ~World();
 
-    void map();
-    void info();
-    void go(string direction);
-    void teleport();
+    // Making sure a world (and its mapping) is never copied.
+    World(World const& copy);               // Not Implemented (Copy constructor)
+    World& operator=(World const& copy);    // Not Implemented (Assignment operator)
 
-    void update_screen();
-    void take(string item);
-    void attack(string name);
-    Character &getPlayer();
-    void setOver(bool over);
-    bool is_over();
-    void setCurrentRoom(Room *next);
+    // Loads a text or binary world file. On failure returns false and says why in "error".
+    bool load(const string &path, string &error);
+
+    // Parses the text format. Big texts are split across threads.
+    bool parse(string_view text, string &error);
+
+    // Writes the binary format (atomically: a temporary file renamed into place).
+    bool save(const string &path, string &error) const;
+
+    RoomId      roomCount() const;
+    string_view roomName(RoomId room) const;
+    RoomId      exit(RoomId room, Direction direction) const;
+
+    // The room with this name, or NO_ROOM.
+    RoomId findRoom(string_view name) const;
+
+    // Same, ignoring case. It looks at every room, so it's only for names the player types
+    // (the tokenizer lowercases them).
+    RoomId findRoomIgnoringCase(string_view name) const;
+
+    // What games share instead of each building their own, made the first time one asks
+    // (by whichever thread that is). Items, by room, as the world starts.
+    const unordered_map<RoomId, ItemBag> &startingItems() const;
+    const RouteTables                     &routes() const;
+
+    vector<ItemSpec>  items;
+    vector<EnemySpec> enemies;
+    string            playerName;
+    int               playerHealth;
+    int               playerStamina;
+    RoomId            start;
+    RoomId            goal;         // entering it wins the game (NO_ROOM: no goal)
+    RoomId            lockedRoom;   // can only be entered carrying lockKey (NO_ROOM: none)
+    string            lockKey;
+    vector<string>    mapLines;
 
 private:
-    PureVirtualClass *pvc;
-    VirtualClass *vc;
-    vector <string> roomLetter;
-    string displayItems();
-    void makeItems();
-    Character      testChar;
-    Character      player;
-    Character      enemy1;
-    Character      enemy2;
-    vector<Room *> rooms;
-    bool           gameOver;
+    bool parseDirective(string_view line, string &error);
+    RoomId resolve(string_view room) const;
+    bool mapFile(const string &path, string &error);
+    void clear();
+
+    // The room tables. They point either into the owned vectors below or into a mapped file.
+    RoomId          rooms;
+    const RoomId   *exitTable;      // DIRECTION_COUNT per room
+    const uint32_t *nameOffsets;    // rooms + 1 offsets into nameText
+    const char     *nameText;
+
+    vector<RoomId>   ownedExits;
+    vector<uint32_t> ownedOffsets;
+    string           ownedNames;
+
+    void  *mapping;
+    size_t mappingSize;
+
+    // Name -> room, built when first needed so a mapped world starts without it.
+    mutable unordered_map<string_view, RoomId> index;
+    mutable once_flag                          indexed;
+
+    mutable unordered_map<RoomId, ItemBag> startingBags;
+    mutable once_flag                      itemsPlaced;
+    mutable RouteTables                    routeTables;
+    mutable once_flag                      routed;
 };
 
+// Journal.h
 class Game;
 
-// A listener for the good ending
-class HurtListener : public EventListener
+/** Every turn of a game, appended to a file so a crash doesn't lose what was played since the
+ *  last save. The journal goes on from a base save next to it (<path>.base): opening it loads
+ *  the base and replays the turns after it, and from then on every turn's command is added.
+ *
+ *  Adding a command only buffers it. flush() writes everything since the last one with a
+ *  single fsync (group commit): the game loop flushes once it has run all the input that was
+ *  ready, so a burst of commands costs one fsync, and a long burst is flushed every MAX_BATCH
+ *  turns. Turns replay the same way because the random generator is part of the base. */
+class Journal
+{
+public:
+    Journal(Game &game);
+    ~Journal();             // flushes what's left
+
+    Journal(Journal const& copy);            // Not Implemented (Copy constructor)
+    Journal& operator=(Journal const& copy); // Not Implemented (Assignment operator)
+
+    // Brings the game to where the journal ends (making the base if there is none yet), then
+    // starts a new base from there. False if the files can't be read or written.
+    bool open(const string &path, string &error);
+
+    // A turn's command, as InputListener gets it. It's written by the next flush().
+    void append(Words &args);
+
+    // Writes and fsyncs the commands added since the last flush.
+    void flush();
+
+    // At the end of every turn: a save or load starts a new base, a long batch is flushed.
+    void turnEnded();
+
+    // Turns open() replayed.
+    size_t replayed() const;
+
+    static constexpr size_t MAX_BATCH = 256;
+
+private:
+    bool replay(uint64_t base, string &error);
+    bool rebase(string &error);
+
+    Game  &game;
+    string path;
+    int    fd;
+    string pending;         // records not written yet
+    size_t pendingTurns;
+    size_t replayedTurns;
+    bool   rebaseWanted;    // the turn saved or loaded: its base is out of date
+    bool   failing;         // a write failed (said once, not every turn)
+};
+
+class Game
+{
+public:
+    // Plays the world with these events (its own: a game listens to everything on them).
+    Game(const World &world, EventManager &events, int screenFd = STDOUT_FILENO);
+    void reset(bool show_update = true);
+
+    // Everything about the game that changes while playing, for restarting, undoing and
+    // copying one game into another of the same world. Restore returns false (leaving the game
+    // partly restored) if the snapshot doesn't fit this game.
+    void snapshot(Snapshot &snapshot) const;
+    bool restore(Snapshot::Reader reader);
+
+    // Remembers how things are before a turn, so undo() can go back to it.
+    void checkpoint();
+    // A command calls this just before it changes the game: a checkpoint, and the turn's timers
+    // go off once the command is done (EventManager::takeTurn).
+    void takeTurn();
+    void undo();
+    void forgetUndo();      // the next undo has nothing to take back
+
+    // Writes the game and its timers to a file (atomically), or reads one back. A file from
+    // another world, or a damaged one, is refused and the game stays as it was.
+    bool save(const string &path, string &error);
+    bool load(const string &path, string &error);
+
+    // The save and load commands: a slot is a file in the save directory.
+    void saveSlot(string_view slot);
+    void loadSlot(string_view slot);
+
+    // Server sessions can't use slots: the directory is shared and sessions don't know who
+    // their player is, so anyone could load or overwrite anyone else's game. On by default.
+    void setSlotsAllowed(bool allowed);
+
+    // Puts every name the games of this world use into the shared tables and freezes them
+    // (see EventManager::freezeNames). Called once, before the first game.
+    static void prepareNames(const World &world);
+
+    // Where slots are kept, for every game of the process ("saves" unless set before games start).
+    static void   setSaveDirectory(const string &directory);
+    static string slotPath(string_view slot);   // "" if it isn't a usable slot name
+
+    // Keeps a journal of every turn in "path" (see Journal), after first playing the game up
+    // to where it ends. False if it can't be read or written.
+    bool openJournal(const string &path, string &error);
+    Journal *getJournal();      // nullptr without one
+
+    // Starts the game's random numbers over from a seed (by default it comes from the clock).
+    // Where they are is part of the snapshot, so replayed turns come out the same.
+    void setSeed(uint64_t seed);
+
+    void map();
+    void info();
+    void stats();       // the dispatch profile (see DispatchProfile), if it's on
+    void go(Direction direction);
+    void travel(string_view room);
+    void patrol();
+    void teleport();
+
+    void update_screen();
+    void take(string_view item);
+    void drop(string_view item);
+    void attack(string_view name);
+    Character &getPlayer();
+    EntityStore &getEntities();
+    const RoomArena &getRooms() const;
+    EventManager &getEvents();
+    Screen &getScreen();
+    void setOver(bool over);
+    bool is_over();
+    bool isGoal(RoomId room);
+
+private:
+    // Registers a listener the game owns (freed with the game).
+    template <typename Payload, typename L>
+    void listen(Event<Payload> event, L *listener)
+    {
+        listeners.emplace_back(listener);
+        events.listen(event, listener);
+    }
+
+    const World &world;
+    EventManager &events;
+    vector<shared_ptr<void> > listeners;
+    Random random;
+    Screen screen;
+    PureVirtualClass *pvc;
+    VirtualClass *vc;
+    vector <string> roomLetter;
+    string displayItems();
+    void makeItems();
+    EntityId enemyIn(RoomId room, bool living);
+    void wander(EntityId enemy);
+    EntityStore    entities;
+    Character      testChar;
+    Character      player;
+    EntityId       firstEnemy;      // the enemies are the rows from here on, in the world's order
+    vector<EntityId> met;           // living enemies in the player's room (reused every turn)
+    ItemId         lockKey;         // NO_ITEM if the world has no lock
+    RoomArena      rooms;
+    Router         router;
+    vector<RoomId> route;           // the travel command's path (reused)
+    bool           gameOver;
+    Snapshot       start;           // the game as it begins
+    Snapshot       beforeTurn;      // before the last turn, for undo
+    bool           undoable;
+    bool           slotsAllowed;    // see setSlotsAllowed()
+    unique_ptr<Journal> journal;
+};
+
+class Game;
+
+// A listener for the good ending
+class HurtListener final : public Listener<EntityId>
 {
 public:
     HurtListener(Game *game);
-    void run(void *args) override;
+    void run(EntityId &character) override;
+private:
+    Game *game;
+};
+
+class Game;
+
+// A listener for the good ending
+class AttackListener final : public Listener<Words>
+{
+public:
+    AttackListener(Game *game);
+    void run(Words &args) override;
 private:
     Game *game;
 };
 
-class Game;
+class Game;
+
+class TakeListener final : public Listener<Words>
+{
+    public:
+        TakeListener(Game *game);
+        void run(Words &args) override;
+    private:
+        Game *game;
+};
+
+class Game;
+
+class DropListener final : public Listener<Words>
+{
+    public:
+        DropListener(Game *game);
+        void run(Words &args) override;
+    private:
+        Game *game;
+};
+
+//CPP FILES
+
+EventManager::EventManager()
+{
+    running   = true;
+    input     = &cin;
+    prompt    = true;
+    dispatchCount = 0;
+    turnTaken = false;
+    queued    = false;
+    queueHead = 0;
+    queueSize = 0;
+    turns     = 0;
+    started   = chrono::steady_clock::now();
+}
+
+EventManager &EventManager::getInstance()
+{
+    // static inside functions creates an instance of this variable for all the calls of this function, 
+    //and initializes only once.
+    static EventManager instance;
+    return instance;
+}
+
+// The name table is shared by every EventManager so an ID means the same event everywhere.
+static map<string, EventId, CaseInsensitiveLess> &eventNames()
+{
+    static map<string, EventId, CaseInsensitiveLess> names;
+    return names;
+}
+
+// Until the table is frozen, names can be added while they are looked up.
+static shared_mutex &eventNamesLock()
+{
+    static shared_mutex lock;
+    return lock;
+}
+
+// Set once, before any game thread starts: they only read it.
+static bool &eventNamesFrozen()
+{
+    static bool frozen = false;
+    return frozen;
+}
+
+void EventManager::freezeNames()
+{
+    unique_lock<shared_mutex> guard(eventNamesLock());
+    eventNamesFrozen() = true;
+}
+
+EventId EventManager::intern(string_view event_name)
+{
+    if (eventNamesFrozen()) {
+        return lookup(event_name);
+    }
+    unique_lock<shared_mutex> guard(eventNamesLock());
+    auto &names = eventNames();
+    auto found = names.find(event_name);
+    if (found != names.end()) {
+        return found->second;
+    }
+
+    EventId id = names.size();
+    names.emplace(string(event_name), id);
+    return id;
+}
+
+string EventManager::name(EventId event)
+{
+    shared_lock<shared_mutex> guard(eventNamesLock(), defer_lock);
+    if (!eventNamesFrozen()) {
+        guard.lock();
+    }
+    for (const auto &name : eventNames()) {
+        if (name.second == event) {
+            return name.first;
+        }
+    }
+    return "";
+}
+
+EventId EventManager::lookup(string_view event_name)
+{
+    shared_lock<shared_mutex> guard(eventNamesLock(), defer_lock);
+    if (!eventNamesFrozen()) {
+        guard.lock();
+    }
+    auto &names = eventNames();
+    auto found = names.find(event_name);
+    return found != names.end() ? found->second : NO_EVENT;
+}
+
+void EventManager::add(EventId event, Slot slot, const void *type)
+{
+    // A name that came after the table froze: nothing can ever trigger it.
+    if (event == NO_EVENT) {
+        return;
+    }
+    if (event >= registeredEvents.size()) {
+        registeredEvents.resize(event + 1);
+        payloadTypes.resize(event + 1, nullptr);
+    }
+    // Two payload types on one event would have trigger() hand a listener the other type's
+    // payload. That's a bug in the program, not something to get past: it stops here.
+    if (type != nullptr && payloadTypes[event] != nullptr && payloadTypes[event] != type) {
+        cerr << "listen(): event " << event << " already has listeners of another payload type" << endl;
+        abort();
+    }
+    registeredEvents[event].push_back(slot);
+    if (payloadTypes[event] == nullptr) {
+        payloadTypes[event] = type;
+    }
+}
+
+void EventManager::callUntyped(void *listener, void *payload)
+{
+    static_cast<EventListener *>(listener)->run(payload);
+}
+
+void EventManager::listen(EventId event, EventListener *listener)
+{
+    add(event, Slot{listener, &callUntyped, typeid(*listener).name()}, nullptr);
+}
+
+void EventManager::listen(string_view event_name, EventListener *listener)
+{
+    listen(intern(event_name), listener);
+}
+
+void EventManager::dispatch(EventId event, void *payload)
+{
+    if (DispatchProfile::enabled() || DispatchTrace::enabled()) {
+        measuredDispatch(event, payload);
+        return;
+    }
+
+    // Unknown or unlistened events simply fall through, the table never grows here.
+    if (event >= registeredEvents.size()) {
+        return;
+    }
+
+    // Index instead of iterators, and the list is looked up again for every listener: one may
+    // listen() while we run, which can move this event's list or (a new event) the whole table.
+    for (size_t i = 0; i < registeredEvents[event].size(); i++) {
+        const Slot &slot = registeredEvents[event][i];
+        slot.call(slot.listener, payload);
+    }
+    dispatchCount += registeredEvents[event].size();
+}
+
+// dispatch() timing every listener, for the profile, the trace or both. A copy of the slot is
+// kept: the listener may listen() to this same event while it runs, which can move the list.
+void EventManager::measuredDispatch(EventId event, void *payload)
+{
+    static thread_local int depth = 0;
+    bool profiling = DispatchProfile::enabled();
+    bool tracing   = DispatchTrace::enabled();
+    DispatchProfile &profile = DispatchProfile::get();
+    depth++;
+    if (profiling) {
+        profile.triggered(event, depth);
+    }
+    // The trigger's own span goes from its first listener's start to its last one's end,
+    // which saves reading the clock twice more.
+    uint64_t triggered = 0, ended = 0;
+    if (event < registeredEvents.size()) {
+        for (size_t i = 0; i < registeredEvents[event].size(); i++) {
+            Slot slot = registeredEvents[event][i];
+            uint64_t start = DispatchTrace::now();
+            slot.call(slot.listener, payload);
+            ended = DispatchTrace::now();
+            triggered = i == 0 ? start : triggered;
+            if (profiling) {
+                profile.ran(event, i, slot.type, ended - start);
+            }
+            if (tracing) {
+                DispatchTrace::span(event, slot.type, start, ended - start);
+            }
+        }
+        dispatchCount += registeredEvents[event].size();
+    }
+    if (tracing) {
+        if (ended == 0) {
+            triggered = ended = DispatchTrace::now();   // nobody listens
+        }
+        DispatchTrace::span(event, nullptr, triggered, ended - triggered);
+    }
+    depth--;
+}
+
+void EventManager::trigger(EventId event, void *args)
+{
+    dispatch(event, args);
+}
+
+void EventManager::setQueued(bool queued)
+{
+    this->queued = queued;
+}
+
+void EventManager::coalesce(EventId event)
+{
+    if (event >= coalesced.size()) {
+        coalesced.resize(event + 1, false);
+    }
+    coalesced[event] = true;
+}
+
+void EventManager::enqueue(EventId event, void *payload, const uint64_t *value)
+{
+    if (!queued) {
+        dispatch(event, payload);
+        return;
+    }
+
+    Pending pending = value != nullptr ? Pending{event, nullptr, *value} : Pending{event, payload, 0};
+
+    if (event < coalesced.size() && coalesced[event]) {
+        for (const Pending &posted : postedThisTurn) {
+            if (posted.event == event && posted.payload == pending.payload && posted.value == pending.value) {
+                return;
+            }
+        }
+        postedThisTurn.push_back(pending);
+    }
+
+    // Full: double the buffer, unrolling the pending events to the front.
+    if (queueSize == queue.size()) {
+        vector<Pending> bigger(max<size_t>(16, queue.size() * 2));
+        for (size_t i = 0; i < queueSize; i++) {
+            bigger[i] = queue[(queueHead + i) & (queue.size() - 1)];
+        }
+        queue.swap(bigger);
+        queueHead = 0;
+    }
+
+    queue[(queueHead + queueSize) & (queue.size() - 1)] = pending;
+    queueSize++;
+}
+
+void EventManager::drain()
+{
+    while (queueSize > 0) {
+        Pending next = queue[queueHead];
+        queueHead = (queueHead + 1) & (queue.size() - 1);
+        queueSize--;
+        dispatch(next.event, next.payload != nullptr ? next.payload : &next.value);
+    }
+    postedThisTurn.clear();
+}
+
+TimerId EventManager::schedule(Event<NoPayload> event, uint64_t delay, uint64_t period, Clock clock)
+{
+    return addTimer(event.id, 0, delay, period, clock);
+}
+
+TimerId EventManager::addTimer(EventId event, uint64_t value, uint64_t delay, uint64_t period, Clock clock)
+{
+    if (clock == TURNS) {
+        return turnTimers.add(delay, period, event, value);
+    }
+    // The wheel is only as far as the last tick, so the delay counts from the real now.
+    uint64_t behind = milliseconds() - clockTimers.now();
+    return clockTimers.add(delay + behind, period, event, value) | CLOCK_TIMER;
+}
+
+void EventManager::waitingTimers(vector<WaitingTimer> &list)
+{
+    list.clear();
+    vector<TimerWheel::Waiting> waiting;
+    turnTimers.waiting(waiting);
+    for (const TimerWheel::Waiting &timer : waiting) {
+        list.push_back(WaitingTimer{timer.delay, timer.period, timer.value, timer.event, TURNS});
+    }
+    // The clock wheel is only as far as its last tick: count from the real now.
+    uint64_t behind = milliseconds() - clockTimers.now();
+    clockTimers.waiting(waiting);
+    for (const TimerWheel::Waiting &timer : waiting) {
+        uint64_t delay = timer.delay > behind ? timer.delay - behind : 1;
+        list.push_back(WaitingTimer{delay, timer.period, timer.value, timer.event, MILLISECONDS});
+    }
+}
+
+void EventManager::clearTimers()
+{
+    turnTimers.clear();
+    clockTimers.clear();
+}
+
+TimerId EventManager::schedule(EventId event, uint64_t value, uint64_t delay, uint64_t period, Clock clock)
+{
+    return addTimer(event, value, delay, period, clock);
+}
+
+bool EventManager::cancel(TimerId timer)
+{
+    if (timer & CLOCK_TIMER) {
+        return clockTimers.cancel(timer & ~CLOCK_TIMER);
+    }
+    return turnTimers.cancel(timer);
+}
+
+void EventManager::fire(TimerWheel &timers, uint64_t now)
+{
+    EventId  event;
+    uint64_t value;
+    while (timers.expire(now, event, value)) {
+        enqueue(event, &value, &value);
+    }
+    drain();
+}
+
+void EventManager::tick()
+{
+    fire(turnTimers, ++turns);
+    fire(clockTimers, milliseconds());
+}
+
+void EventManager::takeTurn()
+{
+    turnTaken = true;
+}
+
+void EventManager::tickClock()
+{
+    fire(clockTimers, milliseconds());
+}
+
+uint64_t EventManager::turn()
+{
+    return turns;
+}
+
+uint64_t EventManager::milliseconds()
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+}
+
+long long EventManager::nextClockTimeout()
+{
+    TimerWheel::Tick due = clockTimers.nextDue();
+    if (due == TimerWheel::NEVER) {
+        return -1;
+    }
+    uint64_t now = milliseconds();
+    return due > now ? due - now : 0;
+}
+
+bool EventManager::is_running()
+{
+    return running;
+}
+
+void EventManager::stop()
+{
+    running = false;
+}
+
+void EventManager::resume()
+{
+    running = true;
+}
+
+unsigned long long EventManager::dispatched()
+{
+    return dispatchCount;
+}
+
+void EventManager::set_input(istream &input, bool prompt)
+{
+    this->input  = &input;
+    this->prompt = prompt;
+}
+
+void EventManager::check_events()
+{
+    if (read_input()) {
+        handle_input();
+    } else {
+        stop();                             // no more input (end of a piped script)
+    }
+}
+
+bool EventManager::read_input()
+{
+    if (prompt) {
+        cout << "> ";                       // print prompt
+    }
+    return (bool) getline(*input, line, '\n');  // read a line from the input to "line"
+}
+
+void EventManager::handle_line(string_view text, int output, Poller *poller)
+{
+    line.assign(text.data(), text.size());
+    Output where{output, poller};
+    trigger(Events::source, where);
+    handle_input();
+}
+
+Poller &EventManager::getPoller()
+{
+    return poller;
+}
+
+void EventManager::handle_input()
+{
+    Words words = tokenizer.split(line);
+
+    // One turn: the input, every event it causes, the timers (if the command took a turn),
+    // then a single redraw.
+    turnTaken = false;
+    post(Events::input, words);
+    drain();
+    if (turnTaken) {
+        tick();
+    } else {
+        tickClock();
+    }
+    trigger(Events::turnEnd);
+}
+
+Words Tokenizer::split(string &line)
+{
+    lowercase(&line[0], line.size());
+    words.clear();
+
+    const char *text = line.data();
+    size_t length = line.size();
+    size_t pos = 0;
+    while (pos < length) {
+        while (pos < length && isspace((unsigned char) text[pos])) {    // skip the spaces
+            pos++;
+        }
+        size_t start = pos;
+        while (pos < length && !isspace((unsigned char) text[pos])) {   // and take the word
+            pos++;
+        }
+        if (pos > start) {
+            words.push_back(string_view(text + start, pos - start));
+        }
+    }
+
+    return Words(words.data(), words.size());
+}
+
+void EventManager::event_loop()
+{
+    string error;
+    if (input == &cin && poller.addInput(STDIN_FILENO, STDOUT_FILENO, prompt, this, error)) {
+        while (is_running() && poller.poll(-1)) {
+            trigger(Events::idle);
+        }
+        return;
+    }
+
+    // A plain file can't be waited on (and doesn't need to be).
+    while (is_running()) {
+        check_events();
+    }
+}
+
+// DispatchProfile.cpp
+bool DispatchProfile::on = false;
+
+int DispatchProfile::Histogram::bucketOf(uint64_t value)
+{
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    // The power of two, then the next three bits below its top one.
+    int power  = 63 - __builtin_clzll(value);
+    int bucket = (power - 2) * SUB_BUCKETS + (int) ((value >> (power - 3)) & (SUB_BUCKETS - 1));
+    return min(bucket, BUCKETS - 1);
+}
+
+uint64_t DispatchProfile::Histogram::highestIn(int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int power = bucket / SUB_BUCKETS + 2;
+    return ((uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (power - 3)) - 1;
+}
+
+void DispatchProfile::Histogram::record(uint64_t nanoseconds)
+{
+    counts[bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+    uint64_t seen = most.load(memory_order_relaxed);
+    while (nanoseconds > seen && !most.compare_exchange_weak(seen, nanoseconds, memory_order_relaxed)) {
+    }
+}
+
+uint64_t DispatchProfile::Histogram::count() const
+{
+    uint64_t total = 0;
+    for (const atomic<uint64_t> &bucket : counts) {
+        total += bucket.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t DispatchProfile::Histogram::longest() const
+{
+    return most.load(memory_order_relaxed);
+}
+
+uint64_t DispatchProfile::Histogram::percentile(double fraction) const
+{
+    uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = max<uint64_t>(1, (uint64_t) ceil(fraction * total));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; bucket++) {
+        seen += counts[bucket].load(memory_order_relaxed);
+        if (seen >= rank) {
+            return min(highestIn(bucket), longest());
+        }
+    }
+    return longest();     // (more came in while counting)
+}
+
+DispatchProfile &DispatchProfile::get()
+{
+    static DispatchProfile profile;
+    return profile;
+}
+
+void DispatchProfile::enable(bool enabled)
+{
+    on = enabled;
+}
+
+DispatchProfile::EventProfile *DispatchProfile::profileOf(EventId event)
+{
+    if (event >= MAX_EVENTS) {
+        return nullptr;
+    }
+    EventProfile *profile = events[event].load(memory_order_acquire);
+    if (profile == nullptr) {
+        // Two threads can both make one: the one that loses throws its own away.
+        EventProfile *made = new EventProfile();
+        if (events[event].compare_exchange_strong(profile, made, memory_order_acq_rel)) {
+            profile = made;
+        } else {
+            delete made;
+        }
+    }
+    return profile;
+}
+
+void DispatchProfile::triggered(EventId event, int depth)
+{
+    int seen = deepest.load(memory_order_relaxed);
+    while (depth > seen && !deepest.compare_exchange_weak(seen, depth, memory_order_relaxed)) {
+    }
+    if (EventProfile *profile = profileOf(event)) {
+        profile->calls.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void DispatchProfile::ran(EventId event, size_t index, const char *listener, uint64_t nanoseconds)
+{
+    EventProfile *profile = profileOf(event);
+    if (profile == nullptr) {
+        return;
+    }
+    ListenerProfile &ran = profile->listeners[min(index, MAX_LISTENERS - 1)];
+    if (ran.type.load(memory_order_relaxed) == nullptr) {
+        ran.type.store(listener, memory_order_relaxed);
+    }
+    ran.total.fetch_add(nanoseconds, memory_order_relaxed);
+    ran.latency.record(nanoseconds);
+}
+
+// "InputListener" rather than "13InputListener".
+static string typeName(const char *mangled)
+{
+    int status = 0;
+    char *name = abi::__cxa_demangle(mangled, nullptr, nullptr, &status);
+    string readable = status == 0 ? name : mangled;
+    free(name);
+    return readable;
+}
+
+string DispatchProfile::report() const
+{
+    string text;
+    char line[160];
+    snprintf(line, sizeof(line), "%-32s %10s %10s %9s %9s %9s %9s\n",
+             "Event / listener", "calls", "total ms", "mean us", "p50 us", "p99 us", "max us");
+    text += line;
+    for (EventId event = 0; event < MAX_EVENTS; event++) {
+        const EventProfile *profile = events[event].load(memory_order_acquire);
+        if (profile == nullptr) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%-32s %10llu\n", EventManager::name(event).c_str(),
+                 (unsigned long long) profile->calls.load(memory_order_relaxed));
+        text += line;
+        for (const ListenerProfile &listener : profile->listeners) {
+            const char *type = listener.type.load(memory_order_relaxed);
+            uint64_t calls = listener.latency.count();
+            if (type == nullptr || calls == 0) {
+                continue;
+            }
+            double total = listener.total.load(memory_order_relaxed);
+            snprintf(line, sizeof(line), "  %-30s %10llu %10.3f %9.2f %9.2f %9.2f %9.2f\n",
+                     typeName(type).substr(0, 30).c_str(), (unsigned long long) calls, total / 1e6,
+                     total / calls / 1e3, listener.latency.percentile(0.5) / 1e3,
+                     listener.latency.percentile(0.99) / 1e3, listener.latency.longest() / 1e3);
+            text += line;
+        }
+    }
+    text += "Deepest nesting: " + to_string(deepest.load(memory_order_relaxed)) + " triggers\n";
+    return text;
+}
+
+// Event and type names are identifiers, but quotes and backslashes are escaped all the same.
+static string jsonString(const string &text)
+{
+    string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+bool DispatchProfile::writeJson(const string &path, string &error) const
+{
+    ofstream file(path);
+    if (!file) {
+        error = "can't write " + path;
+        return false;
+    }
+    file << "{\n  \"deepest\": " << deepest.load(memory_order_relaxed) << ",\n  \"events\": [";
+    const char *eventComma = "";
+    for (EventId event = 0; event < MAX_EVENTS; event++) {
+        const EventProfile *profile = events[event].load(memory_order_acquire);
+        if (profile == nullptr) {
+            continue;
+        }
+        file << eventComma << "\n    {\"event\": " << jsonString(EventManager::name(event))
+             << ", \"calls\": " << profile->calls.load(memory_order_relaxed) << ", \"listeners\": [";
+        eventComma = ",";
+        const char *listenerComma = "";
+        for (const ListenerProfile &listener : profile->listeners) {
+            const char *type = listener.type.load(memory_order_relaxed);
+            uint64_t calls = listener.latency.count();
+            if (type == nullptr || calls == 0) {
+                continue;
+            }
+            file << listenerComma << "\n      {\"listener\": " << jsonString(typeName(type))
+                 << ", \"calls\": " << calls
+                 << ", \"total_ns\": " << listener.total.load(memory_order_relaxed)
+                 << ", \"p50_ns\": " << listener.latency.percentile(0.5)
+                 << ", \"p99_ns\": " << listener.latency.percentile(0.99)
+                 << ", \"max_ns\": " << listener.latency.longest() << "}";
+            listenerComma = ",";
+        }
+        file << "]}";
+    }
+    file << "\n  ]\n}\n";
+    file.close();
+    if (!file) {
+        error = "can't write " + path;
+        return false;
+    }
+    return true;
+}
+
+// DispatchTrace.cpp
+bool DispatchTrace::on = false;
+
+void DispatchTrace::enable(bool enabled)
+{
+    on = enabled;
+
+    // The list is made now, before main() has it written at exit: a static made after that
+    // would already be destroyed by then.
+    lock_guard<mutex> guard(ringsLock());
+    rings();
+}
+
+uint64_t DispatchTrace::now()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+vector<unique_ptr<DispatchTrace::Ring> > &DispatchTrace::rings()
+{
+    static vector<unique_ptr<Ring> > rings;
+    return rings;
+}
+
+mutex &DispatchTrace::ringsLock()
+{
+    static mutex lock;
+    return lock;
+}
+
+DispatchTrace::Ring *DispatchTrace::addRing()
+{
+    unique_ptr<Ring> ring(new Ring());
+    ring->spans.reset(new Span[RING_SIZE]);
+    ring->recorded = 0;
+    lock_guard<mutex> guard(ringsLock());
+    rings().push_back(move(ring));
+    return rings().back().get();
+}
+
+void DispatchTrace::span(EventId event, const char *listener, uint64_t start, uint64_t duration)
+{
+    static thread_local Ring *ring = nullptr;
+    if (ring == nullptr) {
+        ring = addRing();
+    }
+    // Only this thread writes the ring: the position is atomic for writeJson() alone.
+    uint64_t at = ring->recorded.load(memory_order_relaxed);
+    ring->spans[at & (RING_SIZE - 1)] = Span{start, duration, listener, event};
+    ring->recorded.store(at + 1, memory_order_release);
+}
+
+// Complete ("X") events, one per span, in microseconds from the first span of any thread.
+// Each ring is a thread of its own in the viewer, numbered from 1 in the order they started.
+// A ring has spans in the order they ended, and viewers nest spans in the order they start
+// (a trigger with one listener starts and ends with it), so each is sorted parents first.
+bool DispatchTrace::writeJson(const string &path, string &error)
+{
+    ofstream file(path);
+    if (!file) {
+        error = "can't write " + path;
+        return false;
+    }
+
+    lock_guard<mutex> guard(ringsLock());
+    uint64_t first = UINT64_MAX;
+    for (const auto &ring : rings()) {
+        uint64_t recorded = ring->recorded.load(memory_order_acquire);
+        for (uint64_t at = recorded - min<uint64_t>(recorded, RING_SIZE); at < recorded; at++) {
+            first = min(first, ring->spans[at & (RING_SIZE - 1)].start);
+        }
+    }
+
+    unordered_map<EventId, string> eventNames;
+    unordered_map<const char *, string> listenerNames;
+    vector<Span> spans;
+    int pid = getpid();
+    const char *comma = "";
+    char line[128];
+    file << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    for (size_t thread = 0; thread < rings().size(); thread++) {
+        const Ring &ring = *rings()[thread];
+        uint64_t recorded = ring.recorded.load(memory_order_acquire);
+        spans.clear();
+        for (uint64_t at = recorded - min<uint64_t>(recorded, RING_SIZE); at < recorded; at++) {
+            spans.push_back(ring.spans[at & (RING_SIZE - 1)]);
+        }
+        stable_sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) {
+            if (a.start != b.start) {
+                return a.start < b.start;
+            }
+            if (a.duration != b.duration) {
+                return a.duration > b.duration;
+            }
+            return a.listener == nullptr && b.listener != nullptr;
+        });
+        for (const Span &span : spans) {
+            auto event = eventNames.find(span.event);
+            if (event == eventNames.end()) {
+                event = eventNames.emplace(span.event, jsonString(EventManager::name(span.event))).first;
+            }
+            file << comma << "\n{\"name\": ";
+            if (span.listener != nullptr) {
+                auto listener = listenerNames.find(span.listener);
+                if (listener == listenerNames.end()) {
+                    listener = listenerNames.emplace(span.listener, jsonString(typeName(span.listener))).first;
+                }
+                file << listener->second << ", \"cat\": \"listener\", \"args\": {\"event\": " << event->second << "}";
+            } else {
+                file << event->second << ", \"cat\": \"trigger\"";
+            }
+            snprintf(line, sizeof(line), ", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %zu}",
+                     (span.start - first) / 1e3, span.duration / 1e3, pid, thread + 1);
+            file << line;
+            comma = ",";
+        }
+    }
+    file << "\n]}\n";
+    file.close();
+    if (!file) {
+        error = "can't write " + path;
+        return false;
+    }
+    return true;
+}
+
+// TimerWheel.cpp
+TimerWheel::TimerWheel()
+{
+    current    = 0;
+    freeTimers = NONE;
+    count      = 0;
+    fill(occupied, occupied + LEVELS, 0);
+}
+
+TimerId TimerWheel::add(Tick delay, Tick period, EventId event, uint64_t value)
+{
+    if (heads.empty()) {
+        heads.assign(DUE + 1, NONE);
+        tails.assign(DUE + 1, NONE);
+    }
+
+    uint32_t index = freeTimers;
+    if (index != NONE) {
+        freeTimers = timers[index].next;
+    } else {
+        index = timers.size();
+        timers.push_back(Timer{0, 0, 0, NO_EVENT, 1, NONE, NONE, NONE});
+    }
+
+    Timer &timer  = timers[index];
+    timer.expires = current + max<Tick>(delay, 1);
+    timer.period  = period;
+    timer.value   = value;
+    timer.event   = event;
+    insert(index);
+    count++;
+    return (TimerId) timer.generation << 32 | index;
+}
+
+bool TimerWheel::cancel(TimerId id)
+{
+    uint32_t index = (uint32_t) id;
+    if (index >= timers.size() || timers[index].generation != id >> 32 || timers[index].list == NONE) {
+        return false;
+    }
+    unlink(index);
+    release(index);
+    return true;
+}
+
+bool TimerWheel::expire(Tick now, EventId &event, uint64_t &value)
+{
+    if (heads.empty()) {
+        current = max(current, now);
+        return false;
+    }
+
+    while (heads[DUE] == NONE) {
+        if (current >= now) {
+            return false;
+        }
+        if (count == 0) {
+            current = now;
+            return false;
+        }
+
+        // Empty ticks are skipped over.
+        Tick next = nextStop();
+        if (next > now) {
+            current = now;
+            return false;
+        }
+
+        current = next;
+        if ((current & (SLOTS - 1)) == 0) {
+            cascade(1);
+        }
+        uint32_t list = current & (SLOTS - 1);
+        while (heads[list] != NONE) {
+            uint32_t index = heads[list];
+            unlink(index);
+            link(index, DUE);
+        }
+    }
+
+    uint32_t index = heads[DUE];
+    Timer &timer = timers[index];
+    event = timer.event;
+    value = timer.value;
+    unlink(index);
+    if (timer.period > 0) {
+        timer.expires = current + timer.period;     // same TimerId, so it can still be cancelled
+        insert(index);
+    } else {
+        release(index);
+    }
+    return true;
+}
+
+// The next tick anything can happen: an occupied slot later in the first wheel, or else the
+// first wheel coming round (and the next one cascading).
+TimerWheel::Tick TimerWheel::nextStop() const
+{
+    Tick slot = current & (SLOTS - 1);
+    uint64_t later = slot == SLOTS - 1 ? 0 : occupied[0] & (~0ULL << (slot + 1));
+    return current - slot + (later != 0 ? __builtin_ctzll(later) : SLOTS);
+}
+
+TimerWheel::Tick TimerWheel::nextDue() const
+{
+    if (heads.empty()) {
+        return NEVER;
+    }
+    if (heads[DUE] != NONE) {
+        return current;
+    }
+    return count > 0 ? nextStop() : NEVER;
+}
+
+// Puts a timer in the slot of the lowest wheel that reaches its time.
+void TimerWheel::insert(uint32_t index)
+{
+    Timer &timer = timers[index];
+    Tick delta = timer.expires - current;
+    Tick at    = timer.expires;
+
+    int level = 0;
+    while (level + 1 < LEVELS && delta >= (Tick) 1 << ((level + 1) * SLOT_BITS)) {
+        level++;
+    }
+    if (delta >= (Tick) 1 << (LEVELS * SLOT_BITS)) {
+        // Further than the wheels reach: park it in the last slot of the top wheel to come
+        // round, and it gets put back (further down) when that happens.
+        at = current + ((Tick) (SLOTS - 1) << ((LEVELS - 1) * SLOT_BITS));
+    }
+    link(index, level * SLOTS + ((at >> (level * SLOT_BITS)) & (SLOTS - 1)));
+}
+
+// Spreads this tick's slot of a wheel over the wheels below (after the wheel above did the same).
+void TimerWheel::cascade(int level)
+{
+    uint32_t slot = (current >> (level * SLOT_BITS)) & (SLOTS - 1);
+    if (slot == 0 && level + 1 < LEVELS) {
+        cascade(level + 1);
+    }
+
+    // Taken off first: a timer a whole turn of this wheel away lands in this same slot again.
+    uint32_t list  = level * SLOTS + slot;
+    uint32_t index = heads[list];
+    heads[list] = tails[list] = NONE;
+    occupied[level] &= ~(1ULL << slot);
+    while (index != NONE) {
+        uint32_t next = timers[index].next;
+        insert(index);
+        index = next;
+    }
+}
+
+void TimerWheel::link(uint32_t index, uint32_t list)
+{
+    Timer &timer   = timers[index];
+    timer.list     = list;
+    timer.next     = NONE;
+    timer.previous = tails[list];
+    if (tails[list] != NONE) {
+        timers[tails[list]].next = index;
+    } else {
+        heads[list] = index;
+    }
+    tails[list] = index;
+    if (list < DUE) {
+        occupied[list / SLOTS] |= 1ULL << (list % SLOTS);
+    }
+}
+
+void TimerWheel::unlink(uint32_t index)
+{
+    Timer &timer  = timers[index];
+    uint32_t list = timer.list;
+    if (timer.previous != NONE) {
+        timers[timer.previous].next = timer.next;
+    } else {
+        heads[list] = timer.next;
+    }
+    if (timer.next != NONE) {
+        timers[timer.next].previous = timer.previous;
+    } else {
+        tails[list] = timer.previous;
+    }
+    if (list < DUE && heads[list] == NONE) {
+        occupied[list / SLOTS] &= ~(1ULL << (list % SLOTS));
+    }
+    timer.list = NONE;
+}
+
+void TimerWheel::release(uint32_t index)
+{
+    Timer &timer = timers[index];
+    timer.generation = timer.generation % 0x7FFFFFFF + 1;   // never 0, and leaves the top bit alone
+    timer.list = NONE;
+    timer.next = freeTimers;
+    freeTimers = index;
+    count--;
+}
+
+void TimerWheel::waiting(vector<Waiting> &list) const
+{
+    list.clear();
+    vector<uint32_t> order;
+    for (uint32_t index = 0; index < timers.size(); index++) {
+        if (timers[index].list != NONE) {
+            order.push_back(index);
+        }
+    }
+    // Ties go in the order the timers were made, which is roughly the order they'd go off in.
+    stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        return timers[a].expires < timers[b].expires;
+    });
+    for (uint32_t index : order) {
+        const Timer &timer = timers[index];
+        list.push_back(Waiting{timer.expires > current ? timer.expires - current : 1, timer.period,
+                               timer.value, timer.event});
+    }
+}
+
+void TimerWheel::clear()
+{
+    for (uint32_t index = 0; index < timers.size(); index++) {
+        if (timers[index].list != NONE) {
+            unlink(index);
+            release(index);
+        }
+    }
+}
+
+TimerWheel::Tick TimerWheel::now() const
+{
+    return current;
+}
+
+size_t TimerWheel::pending() const
+{
+    return count;
+}
+
+size_t TimerWheel::memoryUsage() const
+{
+    return sizeof(*this) + timers.capacity() * sizeof(Timer) + (heads.capacity() + tails.capacity()) * sizeof(uint32_t);
+}
+
+// Writes all of it, however many write() calls that takes.
+static bool writeFully(int fd, const void *bytes, size_t size)
+{
+    const char *data = (const char *) bytes;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = ::write(fd, data + done, size - done);
+        if (count < 0 && errno != EINTR) {
+            return false;
+        } else if (count > 0) {
+            done += count;
+        }
+    }
+    return true;
+}
+
+// Poller.cpp
+Poller::Poller()
+{
+    epollFd      = -1;
+    clockFd      = -1;
+    clockManager = nullptr;
+    host         = nullptr;
+    armedFor     = -1;
+    openInputs   = 0;
+    listeners    = 0;
+    port         = 0;
+}
+
+Poller::~Poller()
+{
+    for (size_t fd = 0; fd < sources.size(); fd++) {
+        if (sources[fd].kind != CLOSED && fd != STDIN_FILENO) {
+            ::close(fd);
+        }
+    }
+    if (!unixPath.empty()) {
+        unlink(unixPath.c_str());
+    }
+    if (clockFd >= 0) {
+        ::close(clockFd);
+    }
+    if (epollFd >= 0) {
+        ::close(epollFd);
+    }
+}
+
+bool Poller::open(string &error)
+{
+    if (epollFd >= 0) {
+        return true;
+    }
+
+    // A client hanging up mid-frame should cost that client its frame, not kill the game.
+    signal(SIGPIPE, SIG_IGN);
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    clockFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epollFd < 0 || clockFd < 0) {
+        error = string("can't wait on inputs: ") + strerror(errno);
+        return false;
+    }
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = clockFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, clockFd, &event);
+
+    ready.resize(256);
+    buffer.resize(16 * 1024);
+    return true;
+}
+
+bool Poller::add(int fd, Kind kind, int output, bool prompt, EventManager *manager, string &error)
+{
+    if (!open(error)) {
+        return false;
+    }
+
+    epoll_event event{};
+    event.events  = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        error = string("can't wait on input: ") + strerror(errno);
+        return false;
+    }
+
+    if ((size_t) fd >= sources.size()) {
+        sources.resize(fd + 1, Source{CLOSED, false, -1, nullptr, string(), string()});
+    }
+    Source &source = sources[fd];
+    source.kind    = kind;
+    source.prompt  = prompt;
+    source.output  = output;
+    source.manager = manager;
+    source.pending.clear();
+    source.unsent.clear();
+
+    if (kind == INPUT) {
+        openInputs++;
+        if (prompt) {
+            send(output, "> ");
+        }
+    } else {
+        listeners++;
+    }
+    if (clockManager == nullptr && host == nullptr) {
+        clockManager = manager;
+    }
+    return true;
+}
+
+bool Poller::addInput(int fd, int output, bool prompt, EventManager *manager, string &error)
+{
+    return add(fd, INPUT, output, prompt, manager, error);
+}
+
+bool Poller::listenTcp(int port, EventManager *manager, string &error)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = "can't listen on port " + to_string(port) + ": " + strerror(errno);
+        return false;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    // Only on localhost: there's no login, so nobody else gets to play.
+    sockaddr_in address{};
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(fd, (sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0 ||
+        getsockname(fd, (sockaddr *) &address, &length) < 0) {
+        error = "can't listen on port " + to_string(port) + ": " + strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    if (!add(fd, LISTENER, -1, false, manager, error)) {
+        ::close(fd);
+        return false;
+    }
+    this->port = ntohs(address.sin_port);
+    return true;
+}
+
+bool Poller::listenUnix(const string &path, EventManager *manager, string &error)
+{
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        error = path + ": path too long for a socket";
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = path + ": can't listen: " + strerror(errno);
+        return false;
+    }
+    unlink(path.c_str());       // left over from a game that didn't get to clean up
+    if (bind(fd, (sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        error = path + ": can't listen: " + strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    if (!add(fd, LISTENER, -1, false, manager, error)) {
+        ::close(fd);
+        return false;
+    }
+    unixPath = path;
+    return true;
+}
+
+int Poller::tcpPort() const
+{
+    return port;
+}
+
+void Poller::setHost(SessionHost *host)
+{
+    this->host = host;
+}
+
+bool Poller::addHandoff(int fd, string &error)
+{
+    return add(fd, HANDOFF, -1, false, nullptr, error);
+}
+
+void Poller::followClock(EventManager *manager)
+{
+    clockManager = manager;
+    armedFor = -1;
+}
+
+size_t Poller::inputs() const
+{
+    return openInputs;
+}
+
+void Poller::close(int fd)
+{
+    Source &source = sources[fd];
+    if (source.kind == INPUT) {
+        openInputs--;
+    } else if (source.kind != DRAINING) {
+        listeners--;
+    }
+    source.pending.clear();
+    source.pending.shrink_to_fit();
+
+    // The last frames (the goodbye after "exit") still go out before the connection closes.
+    if (source.kind == INPUT && !source.unsent.empty()) {
+        source.kind = DRAINING;
+        shutdown(fd, SHUT_RD);
+        watchOutput(fd, false, true);
+        return;
+    }
+
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    source.kind = CLOSED;
+    source.unsent.clear();
+    source.unsent.shrink_to_fit();
+    if (fd != STDIN_FILENO) {
+        ::close(fd);
+    }
+}
+
+void Poller::accept(int fd)
+{
+    for (;;) {
+        int connection = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connection < 0) {
+            return;     // EAGAIN: that's all of them for now
+        }
+        int on = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));     // fails on Unix sockets, which is fine
+
+        string error;
+        if (host != nullptr) {
+            host->accepted(connection);
+        } else if (!add(connection, INPUT, connection, true, sources[fd].manager, error)) {
+            ::close(connection);
+        }
+    }
+}
+
+// The other end writes each accepted fd as an int.
+void Poller::takeHandoff(int fd)
+{
+    int connections[64];
+    ssize_t got = ::read(fd, connections, sizeof(connections));
+    for (ssize_t i = 0; i < got / (ssize_t) sizeof(int); i++) {
+        host->accepted(connections[i]);
+    }
+}
+
+// One read per wakeup, so a chatty connection can't starve the others. Every whole line is a
+// turn; the rest waits for more. False when the input is finished with.
+bool Poller::read(int fd)
+{
+    ssize_t got = ::read(fd, buffer.data(), buffer.size());
+    if (got < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+
+    Source &source = sources[fd];
+    EventManager *manager = source.manager;
+    source.pending.append(buffer.data(), got);
+
+    size_t start = 0;
+    for (;;) {
+        size_t end = source.pending.find('\n', start);
+        if (end == string::npos) {
+            if (got > 0) {
+                break;
+            }
+            end = source.pending.size();    // the end of the input ends the last line too
+            if (end == start) {
+                break;
+            }
+        }
+        size_t length = end - start;
+        if (length > 0 && source.pending[end - 1] == '\r') {
+            length--;       // telnet and friends
+        }
+        manager->handle_line(string_view(source.pending.data() + start, length), source.output, this);
+        start = min(end + 1, source.pending.size());
+        if (!manager->is_running()) {
+            return false;
+        }
+        if (source.prompt) {
+            send(source.output, "> ");
+        }
+    }
+    source.pending.erase(0, start);
+
+    return got > 0 && source.pending.size() <= MAX_LINE;
+}
+
+void Poller::send(int fd, string_view data)
+{
+    if (fd < 0 || data.empty()) {
+        return;
+    }
+    if ((size_t) fd >= sources.size() || sources[fd].kind == CLOSED) {
+        writeFully(fd, data.data(), data.size());
+        return;
+    }
+    Source &source = sources[fd];
+    if (source.kind != INPUT || source.output != fd) {
+        return;     // being closed: nobody is reading any more
+    }
+
+    // Behind already: it goes after what's waiting, or it would come out of order.
+    if (source.unsent.empty()) {
+        ssize_t written;
+        do {
+            written = ::write(fd, data.data(), data.size());
+        } while (written < 0 && errno == EINTR);
+        if (written < 0 && errno != EAGAIN) {
+            return;     // hung up: the next read closes it
+        }
+        data.remove_prefix(max<ssize_t>(written, 0));
+        if (data.empty()) {
+            return;
+        }
+        watchOutput(fd, true, true);
+    }
+
+    if (source.unsent.size() + data.size() > MAX_UNSENT) {
+        // Shut down, the next read sees the end and closes it like any hang-up.
+        source.unsent.clear();
+        shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    source.unsent.append(data.data(), data.size());
+}
+
+// Sends what a connection couldn't take before, as much as it takes now. False if it's gone.
+bool Poller::writeUnsent(int fd)
+{
+    Source &source = sources[fd];
+    ssize_t written = ::write(fd, source.unsent.data(), source.unsent.size());
+    if (written < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    source.unsent.erase(0, written);
+    if (source.unsent.empty() && source.kind == INPUT) {
+        watchOutput(fd, true, false);
+    }
+    return true;
+}
+
+// What epoll tells about an fd: lines to read, room to write, or both.
+void Poller::watchOutput(int fd, bool input, bool output)
+{
+    epoll_event event{};
+    if (input) {
+        event.events |= EPOLLIN;
+    }
+    if (output) {
+        event.events |= EPOLLOUT;
+    }
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+// Sets the timerfd to when the next clock timer could go off. Ones already due go off now.
+void Poller::armClock()
+{
+    if (clockManager == nullptr) {
+        return;
+    }
+    long long timeout = clockManager->nextClockTimeout();
+    while (timeout == 0) {
+        clockManager->tickClock();
+        timeout = clockManager->nextClockTimeout();
+    }
+    if (timeout == armedFor) {
+        return;
+    }
+
+    itimerspec when{};
+    if (timeout > 0) {
+        when.it_value.tv_sec  = timeout / 1000;
+        when.it_value.tv_nsec = timeout % 1000 * 1000000;
+    }
+    timerfd_settime(clockFd, 0, &when, nullptr);
+    armedFor = timeout;
+}
+
+bool Poller::poll(int timeout)
+{
+    if (epollFd < 0 || (openInputs == 0 && listeners == 0)) {
+        return false;
+    }
+
+    armClock();
+    int count = epoll_wait(epollFd, ready.data(), ready.size(), timeout);
+    if (count < 0) {
+        return errno == EINTR;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int fd = ready[i].data.fd;
+        if (fd == clockFd) {
+            uint64_t expirations;
+            ssize_t got = ::read(clockFd, &expirations, sizeof(expirations));
+            (void) got;
+            armedFor = -1;
+            clockManager->tickClock();
+        } else if (sources[fd].kind == LISTENER) {
+            accept(fd);
+        } else if (sources[fd].kind == HANDOFF) {
+            takeHandoff(fd);
+        } else if (sources[fd].kind == DRAINING) {
+            if (!writeUnsent(fd) || sources[fd].unsent.empty()) {
+                close(fd);
+            }
+        } else if (sources[fd].kind == INPUT) {
+            bool open = (ready[i].events & EPOLLOUT) == 0 || writeUnsent(fd);
+            if (open && (ready[i].events & ~EPOLLOUT) != 0) {
+                open = read(fd);
+            }
+            if (open) {
+                continue;
+            }
+            EventManager *manager = sources[fd].manager;
+            close(fd);
+            if (host != nullptr) {
+                host->closed(manager);
+            } else if (!manager->is_running()) {
+                return false;
+            }
+        }
+    }
+    return openInputs > 0 || listeners > 0;
+}
+
+Screen::Screen(int fd)
+{
+    this->fd = fd;
+    poller   = nullptr;
+    diff     = false;
+    frame.reserve(1024);        // a turn's text is usually well under this, it grows if not
+}
+
+Screen &Screen::operator<<(string_view text)
+{
+    frame.append(text.data(), text.size());
+    return *this;
+}
+
+Screen &Screen::operator<<(const char *text)
+{
+    frame.append(text);
+    return *this;
+}
+
+Screen &Screen::operator<<(char c)
+{
+    frame.push_back(c);
+    return *this;
+}
+
+Screen &Screen::operator<<(int number)
+{
+    char digits[16];
+    frame.append(digits, snprintf(digits, sizeof(digits), "%d", number));
+    return *this;
+}
+
+Screen &Screen::operator<<(double number)
+{
+    // %g prints like cout does by default: 98.5, 100, 1e+06.
+    char digits[32];
+    frame.append(digits, snprintf(digits, sizeof(digits), "%g", number));
+    return *this;
+}
+
+void Screen::setOutput(int fd, Poller *poller)
+{
+    this->fd     = fd;
+    this->poller = poller;
+}
+
+int Screen::getOutput() const
+{
+    return fd;
+}
+
+void Screen::setDiff(bool diff)
+{
+    this->diff = diff;
+    previous.clear();
+}
+
+void Screen::flush()
+{
+    if (fd < 0 || frame.empty()) {
+        frame.clear();
+        return;
+    }
+
+    if (!diff) {
+        writeAll(frame);
+        frame.clear();
+        return;
+    }
+
+    // Diff mode: compare line by line and only move to and rewrite the lines that changed.
+    output.clear();
+    if (previous.empty()) {
+        output += "\x1b[2J";                // first frame, start from a clear screen
+    }
+    size_t at = 0, before = 0;
+    int row = 1;
+    while (at < frame.size()) {
+        size_t end = frame.find('\n', at);
+        if (end == string::npos) {
+            end = frame.size();
+        }
+        size_t beforeEnd = before < previous.size() ? previous.find('\n', before) : string::npos;
+        if (beforeEnd == string::npos) {
+            beforeEnd = previous.size();
+        }
+        string_view line(frame.data() + at, end - at);
+        string_view old(previous.data() + min(before, previous.size()), beforeEnd - min(before, previous.size()));
+        if (before >= previous.size() || line != old) {
+            char move[24];
+            output.append(move, snprintf(move, sizeof(move), "\x1b[%d;1H", row));
+            output.append(line.data(), line.size());
+            output += "\x1b[K";             // clear the rest of the old line
+        }
+        at = end + 1;
+        before = beforeEnd + 1;
+        row++;
+    }
+    // Clear whatever the last frame had below this one and leave the cursor there for the prompt.
+    char move[24];
+    output.append(move, snprintf(move, sizeof(move), "\x1b[%d;1H\x1b[J", row));
+    writeAll(output);
+
+    previous.swap(frame);
+    frame.clear();
+}
+
+void Screen::writeAll(const string &data)
+{
+    if (poller != nullptr) {
+        poller->send(fd, data);
+    } else {
+        writeFully(fd, data.data(), data.size());     // gone: nothing sensible left to do
+    }
+}
+
+InputListener::InputListener(Game *game)
+{
+    this->game = game;
+}
+
+void InputListener::run(Words &args)
+{
+    EventManager &eventManager = game->getEvents();
+
+    // Every line is a turn (even one that's ignored), so every line goes in the journal.
+    if (Journal *journal = game->getJournal()) {
+        journal->append(args);
+    }
+
+    if (args.size() > 0) {
+        // If arg[0] is "input", we are going to ignore the input.
+        // If we do not ignore the input, it's an infinite loop.
+        if (args[0] == "input") {
+            return;
+        }
+
+        // Commands that change the game remember how it was themselves (Game::takeTurn), so
+        // a line that changes nothing doesn't copy anything.
+        eventManager.post(args[0], args);
+    } else {
+        eventManager.post(Events::noCommand);
+    }
+}
+
+TeleportListener::TeleportListener(Game *game)
+{
+    this->game = game;
+}
+
+void TeleportListener::run(Words &)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    game->takeTurn();
+    this->game->teleport();
+}
+
+RestartListener::RestartListener(Game *game)
+{
+    this->game = game;
+}
+
+void RestartListener::run(Words &)
+{
+    game->checkpoint();
+    game->reset(false);
+}
+
+UndoListener::UndoListener(Game *game)
+{
+    this->game = game;
+}
+
+void UndoListener::run(Words &)
+{
+    game->undo();
+}
+
+SaveListener::SaveListener(Game *game)
+{
+    this->game = game;
+}
+
+void SaveListener::run(Words &args)
+{
+    if (args.size() > 1) {
+        game->saveSlot(args[1]);
+    } else {
+        game->getScreen() << "Need a slot name" << '\n';
+    }
+}
+
+LoadListener::LoadListener(Game *game)
+{
+    this->game = game;
+}
+
+void LoadListener::run(Words &args)
+{
+    if (args.size() > 1) {
+        game->loadSlot(args[1]);
+    } else {
+        game->getScreen() << "Need a slot name" << '\n';
+    }
+}
+
+StatsListener::StatsListener(Game *game)
+{
+    this->game = game;
+}
+
+void StatsListener::run(Words &)
+{
+    game->stats();
+}
+
+TakeListener::TakeListener(Game *game)
+{
+    this->game = game;
+}
+
+void TakeListener::run(Words &args)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (args.size() > 1) {
+        game->takeTurn();
+        game->take(args[1]);
+    } else {
+        game->getScreen() << "Need an Item name" << '\n';
+    }
+}
+
+DropListener::DropListener(Game *game)
+{
+    this->game = game;
+}
+
+void DropListener::run(Words &args)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (args.size() > 1) {
+        game->takeTurn();
+        game->drop(args[1]);
+    } else {
+        game->getScreen() << "Need an Item name" << '\n';
+    }
+}
+
+
+EnterRoomListener::EnterRoomListener(Game *game)
+{
+    this->game = game;
+}
+
+void EnterRoomListener::run(RoomId &room)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (game->isGoal(room)) {
+        game->getEvents().post(Events::victory);
+    }
+}
+
+CharacterDeathListener::CharacterDeathListener(Game *game)
+{
+    this->game = game;
+}
+
+void CharacterDeathListener::run(EntityId &character)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (character == game->getPlayer().getId()) {
+        game->getEvents().post(Events::defeat);
+    }
+}
+
+GoListener::GoListener(Game *game)
+{
+    this->game = game;
+    direction  = "";
+}
+
+void GoListener::run(Words &args)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (args.size() > 1) {
+        game->takeTurn();
+        game->go(parseDirection(args[1]));
+    } else {
+        game->getScreen() << "Need a direction!" << '\n';
+    }
+}
+
+TurnEndListener::TurnEndListener(Game *game)
+{
+    this->game = game;
+}
+
+void TurnEndListener::run(NoPayload &)
+{
+    if (game->getEvents().is_running()) {
+        game->update_screen();
+    }
+    game->getScreen().flush();
+}
+
+JournalListener::JournalListener(Game *game)
+{
+    this->game = game;
+}
+
+void JournalListener::run(NoPayload &)
+{
+    game->getJournal()->turnEnded();
+}
+
+IdleListener::IdleListener(Game *game)
+{
+    this->game = game;
+}
+
+void IdleListener::run(NoPayload &)
+{
+    game->getJournal()->flush();
+}
+
+VictoryListener::VictoryListener(Game *game)
+{
+    this->game = game;
+}
+
+void VictoryListener::run(NoPayload &)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    game->getScreen() << '\n';
+    game->getScreen() << "Victory!" << '\n';
+    game->setOver(true);
+}
+
+SourceListener::SourceListener(Game *game)
+{
+    this->game = game;
+}
+
+void SourceListener::run(Output &output)
+{
+    game->getScreen().setOutput(output.fd, output.poller);
+}
+
+PatrolListener::PatrolListener(Game *game)
+{
+    this->game = game;
+}
+
+void PatrolListener::run(NoPayload &)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    game->patrol();
+}
+
+// DefeatListener.cpp
+DefeatListener::DefeatListener(Game *game)
+{
+    this->game = game;
+}
+
+void DefeatListener::run(NoPayload &)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    game->getScreen() << '\n';
+    game->getScreen() << "Defeat!" << '\n';
+    game->setOver(true);
+}
+
+
+MapListener::MapListener(Game *game)
+{
+    this->game = game;
+}
+
+void MapListener::run(Words &)
+{
+    game->map();
+}
+
+InfoListener::InfoListener(Game *game)
+{
+    this->game = game;
+}
+
+void InfoListener::run(Words &)
+{
+    game->info();
+}
+
+TravelListener::TravelListener(Game *game)
+{
+    this->game = game;
+}
+
+void TravelListener::run(Words &args)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (args.size() > 1) {
+        game->takeTurn();
+        game->travel(args[1]);
+    } else {
+        game->getScreen() << "Travel where?" << '\n';
+    }
+}
+
+ExitListener::ExitListener(Game *game)
+{
+    this->game = game;
+}
+
+void ExitListener::run(Words &)
+{
+    game->getEvents().stop();
+}
+
+HurtListener::HurtListener(Game *game)
+{
+    this->game = game;
+}
+
+void HurtListener::run(EntityId &character)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    EntityStore &entities = game->getEntities();
+    int health = entities.health[character];
+    int newHealth = health - Rules::HURT;
+    entities.setHealth(character, newHealth);
+}
+
+AttackListener::AttackListener(Game *game)
+{
+    this->game = game;
+}
+
+void AttackListener::run(Words &args)
+{
+    if (game->is_over()) {
+        return;
+    }
+
+    if (args.size() > 1) {
+        game->takeTurn();
+        game->attack(args[1]);
+    } else {
+        game->getScreen() << "Enter enemy name" << '\n';
+    }
+}
+
+// The item table is shared by every game, like the event names.
+static map<string, ItemId, less<> > &itemIds()
+{
+    static map<string, ItemId, less<> > ids;
+    return ids;
+}
+
+// ID -> name, pointing at the keys of itemIds() (which never move).
+static vector<const string *> &itemNames()
+{
+    static vector<const string *> names;
+    return names;
+}
+
+// Until the table is frozen, names can be added while they are looked up.
+static shared_mutex &itemsLock()
+{
+    static shared_mutex lock;
+    return lock;
+}
+
+// Set once, before any game thread starts: they only read it.
+static bool &itemsFrozen()
+{
+    static bool frozen = false;
+    return frozen;
+}
+
+void ItemCatalog::freeze()
+{
+    unique_lock<shared_mutex> guard(itemsLock());
+    itemsFrozen() = true;
+}
+
+ItemId ItemCatalog::intern(string_view item_name)
+{
+    ItemId known = lookup(item_name);
+    if (known != NO_ITEM || itemsFrozen()) {
+        return known;
+    }
+
+    unique_lock<shared_mutex> guard(itemsLock());
+    auto &ids = itemIds();
+    auto found = ids.find(item_name);
+    if (found != ids.end()) {
+        return found->second;
+    }
+    if (itemNames().size() >= NO_ITEM) {
+        return NO_ITEM;
+    }
+
+    ItemId id = itemNames().size();
+    auto added = ids.emplace(string(item_name), id).first;
+    itemNames().push_back(&added->first);
+    return id;
+}
+
+ItemId ItemCatalog::lookup(string_view item_name)
+{
+    shared_lock<shared_mutex> guard(itemsLock(), defer_lock);
+    if (!itemsFrozen()) {
+        guard.lock();
+    }
+    auto &ids = itemIds();
+    auto found = ids.find(item_name);
+    return found != ids.end() ? found->second : NO_ITEM;
+}
+
+const string &ItemCatalog::name(ItemId item)
+{
+    shared_lock<shared_mutex> guard(itemsLock(), defer_lock);
+    if (!itemsFrozen()) {
+        guard.lock();
+    }
+    return *itemNames()[item];     // the string itself never moves
+}
+
+ItemId ItemCatalog::count()
+{
+    shared_lock<shared_mutex> guard(itemsLock(), defer_lock);
+    if (!itemsFrozen()) {
+        guard.lock();
+    }
+    return itemNames().size();
+}
+
+ItemBag::ItemBag() :
+    total(0)
+{
+}
+
+void ItemBag::add(ItemId item, int count)
+{
+    if (item == NO_ITEM || count <= 0) {
+        return;
+    }
+    if (item >= counts.size()) {
+        counts.resize(item + 1, 0);
+    }
+    count = min(count, MAX_COUNT - counts[item]);
+    if (count == 0) {
+        return;
+    }
+    if (counts[item] == 0) {
+        order.push_back(item);
+    }
+    counts[item] += count;
+    total += count;
+}
+
+bool ItemBag::remove(ItemId item)
+{
+    if (!contains(item)) {
+        return false;
+    }
+    total--;
+    if (--counts[item] == 0) {
+        // The last one: it no longer gets listed (a bag only holds a few kinds).
+        order.erase(find(order.begin(), order.end(), item));
+    }
+    return true;
+}
+
+bool ItemBag::contains(ItemId item) const
+{
+    return item < counts.size() && counts[item] > 0;
+}
+
+int ItemBag::count(ItemId item) const
+{
+    return item < counts.size() ? counts[item] : 0;
+}
+
+int ItemBag::size() const
+{
+    return total;
+}
+
+bool ItemBag::empty() const
+{
+    return total == 0;
+}
+
+void ItemBag::clear()
+{
+    counts.clear();
+    order.clear();
+    total = 0;
+}
+
+const vector<ItemId> &ItemBag::kinds() const
+{
+    return order;
+}
+
+ItemBag operator + (const ItemBag &a, const ItemBag &b)
+{
+    ItemBag both = a;
+    for (ItemId item : b.kinds()) {
+        both.add(item, b.count(item));
+    }
+    return both;
+}
+
+size_t ItemBag::memoryUsage() const
+{
+    return sizeof(*this) + counts.capacity() * sizeof(uint16_t) + order.capacity() * sizeof(ItemId);
+}
+
+Items::Items(){
+    id = ItemCatalog::intern("");
+}
+
+Items:: Items(string description)
+{
+    id = ItemCatalog::intern(description);
+}
+
+string Items::getDescription()
+{
+    return ItemCatalog::name(id);
+}
+
+ItemId Items::getId()
+{
+    return id;
+}
+
+//8) Abstract classes and pure virtual functions */
+void Items::virtualExample(Screen &screen) {
+        screen << "Pure Virtual Function example from the Items class" << '\n';
+    }
+
+
+// Random.cpp
+Random::Random(uint64_t seed)
+{
+    this->seed(seed);
+}
+
+// The state is filled from the seed with splitmix64, so even seeds like 0 and 1 give
+// unrelated sequences (and never the all-zero state xoshiro can't leave).
+void Random::seed(uint64_t seed)
+{
+    for (uint64_t &word : state.s) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        word = z ^ (z >> 31);
+    }
+}
+
+Random Random::split()
+{
+    Random other = *this;
+    jump();
+    return other;
+}
+
+// The same as calling next() 2^128 times (the polynomial is xoshiro256's own).
+void Random::jump()
+{
+    static const uint64_t JUMP[] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                    0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+    State jumped = {};
+    for (uint64_t word : JUMP) {
+        for (int bit = 0; bit < 64; bit++) {
+            if (word & (1ULL << bit)) {
+                for (int i = 0; i < 4; i++) {
+                    jumped.s[i] ^= state.s[i];
+                }
+            }
+            next();
+        }
+    }
+    state = jumped;
+}
+
+const Random::State &Random::getState() const
+{
+    return state;
+}
+
+void Random::setState(const State &state)
+{
+    this->state = state;
+}
+
+// Snapshot.cpp
+Snapshot::Snapshot()
+{
+}
+
+void Snapshot::clear()
+{
+    bytes.clear();      // keeps the capacity: taking the next one doesn't allocate
+}
+
+size_t Snapshot::size() const
+{
+    return bytes.size();
+}
+
+const uint8_t *Snapshot::data() const
+{
+    return bytes.data();
+}
+
+void Snapshot::append(const void *data, size_t size)
+{
+    const uint8_t *from = (const uint8_t *) data;
+    bytes.insert(bytes.end(), from, from + size);
+}
+
+Snapshot::Reader::Reader(const Snapshot &snapshot) :
+    Reader(snapshot.data(), snapshot.size())
+{
+}
+
+Snapshot::Reader::Reader(const uint8_t *data, size_t size) :
+    at(data),
+    end(data + size),
+    items(nullptr)
+{
+}
+
+void Snapshot::Reader::mapItems(const vector<ItemId> *items)
+{
+    this->items = items;
+}
+
+ItemId Snapshot::Reader::item(ItemId saved) const
+{
+    if (items == nullptr || saved == NO_ITEM) {
+        return saved;
+    }
+    return saved < items->size() ? (*items)[saved] : NO_ITEM;
+}
+
+bool Snapshot::Reader::next(const uint8_t *&records, uint32_t &count, size_t recordSize)
+{
+    if ((size_t) (end - at) < sizeof(count)) {
+        return false;
+    }
+    memcpy(&count, at, sizeof(count));
+    if ((size_t) (end - at - sizeof(count)) / recordSize < count) {
+        return false;
+    }
+    records = at + sizeof(count);
+    at      = records + (size_t) count * recordSize;
+    return true;
+}
+
+bool Snapshot::Reader::atEnd() const
+{
+    return at == end;
+}
+
+// EntityStore.cpp
+EntityStore::EntityStore(EventManager &events) :
+    events(&events),
+    rooms(nullptr)
+{
+}
+
+EntityId EntityStore::create(string_view name, int health, double stamina, int damage, bool wanders)
+{
+    EntityId entity = this->health.size();
+    this->health.push_back(health);
+    this->stamina.push_back(stamina);
+    this->room.push_back(NO_ROOM);
+    this->nameId.push_back(0);
+    this->inventory.push_back(NO_INVENTORY);
+    this->damage.push_back(damage);
+    this->wanders.push_back(wanders);
+    this->destination.push_back(NO_ROOM);
+    setName(entity, name);
+    return entity;
+}
+
+EntityId EntityStore::size() const
+{
+    return health.size();
+}
+
+string_view EntityStore::getName(EntityId entity) const
+{
+    return names[nameId[entity]];
+}
+
+void EntityStore::setName(EntityId entity, string_view name)
+{
+    auto found = nameIds.find(name);
+    if (found == nameIds.end()) {
+        found = nameIds.emplace(string(name), names.size()).first;
+        names.push_back(string(name));
+    }
+    nameId[entity] = found->second;
+}
+
+void EntityStore::setHealth(EntityId entity, int health)
+{
+    if (health <= 0) {
+        health = 0;
+        events->post(Events::characterDeath, entity);
+    }
+    this->health[entity] = health;
+}
+
+void EntityStore::setStamina(EntityId entity, double stamina)
+{
+    if (stamina <= 0) 
+    {
+        this->stamina[entity] = 0;
+        events->post(Events::characterDeath, entity);
+    }  
+    this->stamina[entity] = stamina;
+}
+
+ItemBag &EntityStore::inventoryOf(EntityId entity)
+{
+    if (inventory[entity] == NO_INVENTORY) {
+        inventory[entity] = inventories.size();
+        inventories.emplace_back();
+    }
+    return inventories[inventory[entity]];
+}
+
+bool EntityStore::carries(EntityId entity, ItemId item) const
+{
+    return inventory[entity] != NO_INVENTORY && inventories[inventory[entity]].contains(item);
+}
+
+void EntityStore::setRoom(EntityId entity, RoomId next)
+{
+    RoomId current = room[entity];
+    if (current == next) {
+        return;
+    }
+    if (rooms != nullptr) {
+        if (current != NO_ROOM) {
+            rooms->leave(current, entity);
+        }
+        if (next != NO_ROOM) {
+            rooms->enter(next, entity);
+        }
+    }
+    room[entity] = next;
+}
+
+void EntityStore::attach(RoomArena &rooms)
+{
+    this->rooms = &rooms;
+}
+
+void EntityStore::save(Snapshot &snapshot) const
+{
+    snapshot.put(health);
+    snapshot.put(stamina);
+    snapshot.put(room);
+    snapshot.put(destination);
+
+    uint32_t records = 0;
+    for (EntityId entity = 0; entity < size(); entity++) {
+        if (inventory[entity] != NO_INVENTORY) {
+            records += inventories[inventory[entity]].kinds().size();
+        }
+    }
+    snapshot.begin(records);
+    for (EntityId entity = 0; entity < size(); entity++) {
+        if (inventory[entity] == NO_INVENTORY) {
+            continue;
+        }
+        const ItemBag &bag = inventories[inventory[entity]];
+        for (ItemId item : bag.kinds()) {
+            snapshot.add(ItemRecord{entity, item, (uint16_t) bag.count(item)});
+        }
+    }
+}
+
+bool EntityStore::restore(Snapshot::Reader &reader)
+{
+    // The rows themselves (names, damage, who wanders) never change after the game is made,
+    // so a snapshot only fits a game with the same characters.
+    EntityId count = size();
+    if (!reader.get(health.data(), count) || !reader.get(stamina.data(), count) ||
+        !reader.get(room.data(), count) || !reader.get(destination.data(), count)) {
+        return false;
+    }
+    RoomId rooms = this->rooms != nullptr ? this->rooms->size() : 0;
+    for (EntityId entity = 0; entity < count; entity++) {
+        if ((room[entity] != NO_ROOM && room[entity] >= rooms) ||
+            (destination[entity] != NO_ROOM && destination[entity] >= rooms)) {
+            return false;
+        }
+    }
+
+    for (ItemBag &bag : inventories) {
+        bag.clear();
+    }
+    uint32_t records;
+    if (!reader.begin<ItemRecord>(records)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < records; i++) {
+        ItemRecord record;
+        reader.take(record);
+        if (record.owner >= count) {
+            return false;
+        }
+        inventoryOf(record.owner).add(reader.item(record.item), record.count);
+    }
+    return true;
+}
+
+//2) cascading constructors */
+Character::Character(EntityStore &store) :
+    Character(store, "")
+{
+}
+
+Character::Character(EntityStore &store, string name) :
+    Character(store, name, 100, 100)
+{
+}
+
+//9) Initializer list */
+Character::Character(EntityStore &store, string n, int h, int s) : store(&store), id(store.create(n, h, s)){}
+
+Character::Character(EntityStore &store, EntityId id) : store(&store), id(id){}
+
+
+//1) Destructor */
+Character::~Character(){
+    // The row stays in the store. Nothing is printed: the game may be one session of a
+    // server, and the process console isn't that player's.
+}
+
+EntityId Character::getId()
+{
+    return id;
+}
+
+string_view Character::getName()
+{
+    return store->getName(id);
+}
+
+int Character::getHealth()
+{
+    return store->health[id];
+}
+
+double Character::getStamina()
+{
+    return store->stamina[id];
+}
+
+RoomId Character::getCurrentRoom()
+{
+    return store->room[id];
+}
+
+void Character::setName(string name)
+{
+    store->setName(id, name);
+}
+
+void Character::setHealth(int health)
+{
+    store->setHealth(id, health);
+}
+
+
+void Character::setCurrentRoom(RoomId next)
+{
+    store->setRoom(id, next);
+}
+
+void Character::addItem(ItemId item)
+{
+    store->inventoryOf(id).add(item);
+}
+
+void Character::addItemEnemy(ItemId item)
+{
+    store->inventoryOf(id).add(item);
+}
+
+bool Character::isItemInCharacter(ItemId item)
+{
+    return store->carries(id, item);
+}
+
+bool Character::removeItem(ItemId item)
+{
+    return store->inventoryOf(id).remove(item);
+}
+
+ItemBag &Character::getItems()
+{
+    return store->inventoryOf(id);
+}
+
+//7) Virtual functions and polymorphism */
+void Character::check(Screen &screen)
+{
+    screen << "Printing from the Character class" << '\n';
+}
+
+//7) Virtual functions and polymorphism */
+void Character::change(Screen &screen)
+{
+    screen << "This is from the Character class" << '\n';
+}
+
+Direction parseDirection(string_view word)
+{
+    for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+        if (word == DIRECTION_NAMES[direction]) {
+            return (Direction) direction;
+        }
+    }
+    return NO_DIRECTION;
+}
+
+// RoomArena.cpp
+RoomArena::RoomArena() :
+    world(nullptr)
+{
+}
+
+void RoomArena::build(const World &world)
+{
+    this->world = &world;
+    reset();
+    occupied.clear();
+    nextOccupants.clear();
+    previousOccupants.clear();
+}
+
+void RoomArena::reset()
+{
+    changedItems.clear();
+    changedExits.clear();
+}
+
+const World &RoomArena::getWorld() const
+{
+    return *world;
+}
+
+RoomId RoomArena::size() const
+{
+    return world->roomCount();
+}
+
+string_view RoomArena::getName(RoomId room) const
+{
+    return world->roomName(room);
+}
+
+RoomId RoomArena::getExit(RoomId room, Direction direction) const
+{
+    if (direction >= DIRECTION_COUNT) {
+        return NO_ROOM;
+    }
+    // Games almost never change exits, and then this is one read of the World's table.
+    if (!changedExits.empty()) {
+        auto changed = changedExits.find((uint64_t) room * DIRECTION_COUNT + direction);
+        if (changed != changedExits.end()) {
+            return changed->second;
+        }
+    }
+    return world->exit(room, direction);
+}
+
+void RoomArena::setExit(RoomId room, Direction direction, RoomId next)
+{
+    uint64_t key = (uint64_t) room * DIRECTION_COUNT + direction;
+    if (next == world->exit(room, direction)) {
+        changedExits.erase(key);
+    } else {
+        changedExits[key] = next;
+    }
+}
+
+bool RoomArena::exitsChanged() const
+{
+    return !changedExits.empty();
+}
+
+Direction RoomArena::directionTo(RoomId room, RoomId next) const
+{
+    for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+        if (getExit(room, (Direction) direction) == next) {
+            return (Direction) direction;
+        }
+    }
+    return NO_DIRECTION;
+}
+
+int RoomArena::occupants(RoomId room) const
+{
+    auto found = occupied.find(room);
+    return found != occupied.end() ? found->second.count : 0;
+}
+
+EntityId RoomArena::firstOccupant(RoomId room) const
+{
+    auto found = occupied.find(room);
+    return found != occupied.end() ? found->second.first : NO_ENTITY;
+}
+
+EntityId RoomArena::nextOccupant(EntityId entity) const
+{
+    return nextOccupants[entity];
+}
+
+// Newcomers go to the front of the list. A room's entry stays once it has been made (empty
+// rooms keep theirs), so characters walking around don't allocate.
+void RoomArena::enter(RoomId room, EntityId entity)
+{
+    if (entity >= nextOccupants.size()) {
+        nextOccupants.resize(entity + 1, NO_ENTITY);
+        previousOccupants.resize(entity + 1, NO_ENTITY);
+    }
+
+    Occupants &here = occupied.emplace(room, Occupants{NO_ENTITY, 0}).first->second;
+    EntityId first = here.first;
+    nextOccupants[entity]     = first;
+    previousOccupants[entity] = NO_ENTITY;
+    if (first != NO_ENTITY) {
+        previousOccupants[first] = entity;
+    }
+    here.first = entity;
+    here.count++;
+}
+
+void RoomArena::leave(RoomId room, EntityId entity)
+{
+    auto found = occupied.find(room);
+    if (found == occupied.end() || entity >= nextOccupants.size()) {
+        return;     // not in the index, so not in the room either
+    }
+    Occupants &here = found->second;
+    EntityId next     = nextOccupants[entity];
+    EntityId previous = previousOccupants[entity];
+    if (previous != NO_ENTITY) {
+        nextOccupants[previous] = next;
+    } else {
+        here.first = next;
+    }
+    if (next != NO_ENTITY) {
+        previousOccupants[next] = previous;
+    }
+    here.count--;
+}
+
+const ItemBag *RoomArena::itemsIn(RoomId room) const
+{
+    auto changed = changedItems.find(room);
+    if (changed != changedItems.end()) {
+        return &changed->second;
+    }
+    const unordered_map<RoomId, ItemBag> &starting = world->startingItems();
+    auto found = starting.find(room);
+    return found != starting.end() ? &found->second : nullptr;
+}
+
+// The first change to a room copies what the world puts there, and later ones change the copy.
+ItemBag &RoomArena::changeItems(RoomId room)
+{
+    auto changed = changedItems.find(room);
+    if (changed != changedItems.end()) {
+        return changed->second;
+    }
+    const ItemBag *starting = itemsIn(room);
+    return changedItems.emplace(room, starting != nullptr ? *starting : ItemBag()).first->second;
+}
+
+void RoomArena::addItem(RoomId room, ItemId item)
+{
+    changeItems(room).add(item);
+}
+
+bool RoomArena::removeItem(RoomId room, ItemId item)
+{
+    return isItemInRoom(room, item) && changeItems(room).remove(item);
+}
+
+void RoomArena::clearItems(RoomId room)
+{
+    if (amountOfItems(room) > 0) {
+        changeItems(room).clear();
+    }
+}
+
+bool RoomArena::isItemInRoom(RoomId room, ItemId item) const
+{
+    const ItemBag *items = itemsIn(room);
+    return items != nullptr && items->contains(item);
+}
+
+int RoomArena::amountOfItems(RoomId room) const
+{
+    const ItemBag *items = itemsIn(room);
+    return items != nullptr ? items->size() : 0;
+}
+
+string RoomArena::displayItems(RoomId room) const
+{
+    const ItemBag *itemList = itemsIn(room);
+    if (itemList == nullptr || itemList->empty()) {
+        return "There are no items in this room.";
+    }
+    string message = "The items in this room are: ";
+    for (ItemId item : itemList->kinds()) {
+        for (int i = 0; i < itemList->count(item); i++) {
+            message = message + ItemCatalog::name(item) + " ";
+        }
+    }
+    return message;
+}
+
+void RoomArena::save(Snapshot &snapshot) const
+{
+    // A room emptied by this game still differs from the world, so it gets a record with no item.
+    uint32_t records = 0;
+    for (const auto &changed : changedItems) {
+        records += max<size_t>(changed.second.kinds().size(), 1);
+    }
+    snapshot.begin(records);
+    for (const auto &changed : changedItems) {
+        const ItemBag &bag = changed.second;
+        if (bag.empty()) {
+            snapshot.add(ItemRecord{changed.first, NO_ITEM, 0});
+        }
+        for (ItemId item : bag.kinds()) {
+            snapshot.add(ItemRecord{changed.first, item, (uint16_t) bag.count(item)});
+        }
+    }
+
+    snapshot.begin(changedExits.size());
+    for (const auto &changed : changedExits) {
+        snapshot.add(ExitRecord{(RoomId) (changed.first / DIRECTION_COUNT),
+                                (uint32_t) (changed.first % DIRECTION_COUNT), changed.second});
+    }
+}
+
+bool RoomArena::restore(Snapshot::Reader &reader, const vector<RoomId> &characterRooms)
+{
+    RoomId rooms = size();
+
+    changedItems.clear();
+    uint32_t records;
+    if (!reader.begin<ItemRecord>(records)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < records; i++) {
+        ItemRecord record;
+        reader.take(record);
+        if (record.owner >= rooms) {
+            return false;
+        }
+        changedItems[record.owner].add(reader.item(record.item), record.count);
+    }
+
+    changedExits.clear();
+    if (!reader.begin<ExitRecord>(records)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < records; i++) {
+        ExitRecord record;
+        reader.take(record);
+        if (record.room >= rooms || record.direction >= DIRECTION_COUNT ||
+            (record.next != NO_ROOM && record.next >= rooms)) {
+            return false;
+        }
+        changedExits[(uint64_t) record.room * DIRECTION_COUNT + record.direction] = record.next;
+    }
+
+    // Everybody enters their room again, in order, as when the game was made. Rooms that were
+    // occupied keep their (now empty) entries, like they do when people leave.
+    for (RoomId room : characterRooms) {
+        if (room != NO_ROOM && room >= rooms) {
+            return false;
+        }
+    }
+    for (auto &room : occupied) {
+        room.second = Occupants{NO_ENTITY, 0};
+    }
+    nextOccupants.assign(characterRooms.size(), NO_ENTITY);
+    previousOccupants.assign(characterRooms.size(), NO_ENTITY);
+    for (EntityId entity = 0; entity < characterRooms.size(); entity++) {
+        if (characterRooms[entity] != NO_ROOM) {
+            enter(characterRooms[entity], entity);
+        }
+    }
+    return true;
+}
+
+size_t RoomArena::memoryUsage() const
+{
+    size_t bytes = sizeof(*this);
+    for (const auto &itemList : changedItems) {
+        bytes += sizeof(itemList) + itemList.second.memoryUsage();
+    }
+    bytes += changedExits.size() * (sizeof(uint64_t) + sizeof(RoomId));
+    bytes += occupied.size() * (sizeof(RoomId) + sizeof(Occupants));
+    bytes += (nextOccupants.capacity() + previousOccupants.capacity()) * sizeof(EntityId);
+    return bytes;
+}
+
+// Router.cpp
+/** Scratch space for the searches, reused so a query doesn't allocate. There is one per
+ *  thread rather than one per game: all the games of a server thread take turns with it, so
+ *  none of them carries a world-sized buffer of its own. */
+struct RouteScratch
+{
+    vector<uint32_t> stamps;            // a room was reached in this search if its stamp matches
+    uint32_t         stamp = 0;
+    vector<uint32_t> steps;
+    vector<RoomId>   parents;
+    vector<RoomId>   frontier;
+    struct Open
+    {
+        uint32_t estimate;
+        uint32_t steps;
+        RoomId   room;
+        bool operator > (const Open &other) const { return estimate > other.estimate; }
+    };
+    vector<Open>     open;
+
+    // Big enough for a world of this many rooms.
+    void fit(RoomId count)
+    {
+        if (stamps.size() < count) {
+            stamps.resize(count, 0);
+            steps.resize(count, 0);
+            parents.resize(count, NO_ROOM);
+            frontier.reserve(count);
+        }
+    }
+
+    uint32_t nextStamp()
+    {
+        if (++stamp == 0) {
+            // Wrapped around, so an old stamp could match again: forget them all.
+            fill(stamps.begin(), stamps.end(), 0);
+            stamp = 1;
+        }
+        return stamp;
+    }
+};
+
+static thread_local RouteScratch scratch;
+
+RouteTables::RouteTables() :
+    count(0),
+    allPairs(false),
+    reverseStale(true)
+{
+}
+
+void RouteTables::build(const RoomArena &rooms)
+{
+    count    = rooms.size();
+    allPairs = count <= ALL_PAIRS_LIMIT;
+    scratch.fit(count);
+    buildReverseExits(rooms);
+
+    RoomId landmarkCount = allPairs ? count : min(count, LANDMARKS);
+    landmarks.assign(landmarkCount, 0);
+    stale.assign(landmarkCount, STALE_TREE | STALE_BOUND);
+    hops.assign((size_t) landmarkCount * count, NO_DIRECTION);
+    distanceTo.assign((size_t) landmarkCount * count, UNKNOWN);
+    distanceFrom.assign(allPairs ? 0 : (size_t) landmarkCount * count, UNKNOWN);
+
+    if (allPairs) {
+        // Every room is a landmark. That's at most ALL_PAIRS_LIMIT little searches, done now
+        // so the tables never change once games share them.
+        for (RoomId room = 0; room < count; room++) {
+            landmarks[room] = room;
+            buildLandmark(rooms, room);
+        }
+        return;
+    }
+
+    // Landmarks far apart give the best bounds, so each one is the room furthest from all
+    // those picked before it.
+    vector<Distance> nearest(count, UNKNOWN);
+    for (RoomId index = 0; index < landmarkCount; index++) {
+        buildLandmark(rooms, index);
+
+        const Distance *from = &distanceFrom[(size_t) index * count];
+        RoomId   furthest = NO_ROOM;
+        Distance longest  = 0;
+        for (RoomId room = 0; room < count; room++) {
+            if (from[room] != UNKNOWN && (nearest[room] == UNKNOWN || from[room] < nearest[room])) {
+                nearest[room] = from[room];
+            }
+            if (nearest[room] != UNKNOWN && nearest[room] > longest) {
+                longest  = nearest[room];
+                furthest = room;
+            }
+        }
+        if (index + 1 < landmarkCount) {
+            landmarks[index + 1] = furthest != NO_ROOM ? furthest : (landmarks[index] + 1) % count;
+        }
+    }
+}
+
+// Who has an exit into each room, as one flat array grouped by room.
+void RouteTables::buildReverseExits(const RoomArena &rooms)
+{
+    reverseStart.assign(count + 1, 0);
+    for (RoomId room = 0; room < count; room++) {
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = rooms.getExit(room, (Direction) direction);
+            if (next != NO_ROOM) {
+                reverseStart[next + 1]++;
+            }
+        }
+    }
+    for (RoomId room = 0; room < count; room++) {
+        reverseStart[room + 1] += reverseStart[room];
+    }
+
+    vector<uint32_t> &slots = scratch.steps;    // next free slot per room
+    reverseRooms.resize(reverseStart[count]);
+    reverseDirections.resize(reverseStart[count]);
+    copy(reverseStart.begin(), reverseStart.end() - 1, slots.begin());
+    for (RoomId room = 0; room < count; room++) {
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = rooms.getExit(room, (Direction) direction);
+            if (next != NO_ROOM) {
+                uint32_t at = slots[next]++;
+                reverseRooms[at]      = room;
+                reverseDirections[at] = direction;
+            }
+        }
+    }
+    reverseStale = false;
+}
+
+// Two breadth-first searches: backwards from the landmark for the next-hop tree and the
+// distances to it, and (for ALT) forwards for the distances from it.
+void RouteTables::buildLandmark(const RoomArena &rooms, RoomId index)
+{
+    scratch.fit(count);
+    if (reverseStale) {
+        buildReverseExits(rooms);
+    }
+
+    vector<uint32_t> &stamps   = scratch.stamps;
+    vector<uint32_t> &steps    = scratch.steps;
+    vector<RoomId>   &frontier = scratch.frontier;
+
+    RoomId    landmark = landmarks[index];
+    uint8_t  *hop      = &hops[(size_t) index * count];
+    Distance *to       = &distanceTo[(size_t) index * count];
+    fill(hop, hop + count, NO_DIRECTION);
+    fill(to, to + count, UNKNOWN);
+
+    uint32_t mark = scratch.nextStamp();
+    frontier.clear();
+    frontier.push_back(landmark);
+    stamps[landmark] = mark;
+    steps[landmark]  = 0;
+    to[landmark]     = 0;
+    for (size_t head = 0; head < frontier.size(); head++) {
+        RoomId room = frontier[head];
+        for (uint32_t at = reverseStart[room]; at < reverseStart[room + 1]; at++) {
+            RoomId previous = reverseRooms[at];
+            if (stamps[previous] != mark) {
+                stamps[previous] = mark;
+                steps[previous]  = steps[room] + 1;
+                hop[previous]    = reverseDirections[at];
+                to[previous]     = steps[previous] < UNKNOWN ? steps[previous] : UNKNOWN;
+                frontier.push_back(previous);
+            }
+        }
+    }
+
+    if (!allPairs) {
+        Distance *from = &distanceFrom[(size_t) index * count];
+        fill(from, from + count, UNKNOWN);
+
+        mark = scratch.nextStamp();
+        frontier.clear();
+        frontier.push_back(landmark);
+        stamps[landmark] = mark;
+        steps[landmark]  = 0;
+        from[landmark]   = 0;
+        for (size_t head = 0; head < frontier.size(); head++) {
+            RoomId room = frontier[head];
+            for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+                RoomId next = rooms.getExit(room, (Direction) direction);
+                if (next != NO_ROOM && stamps[next] != mark) {
+                    stamps[next] = mark;
+                    steps[next]  = steps[room] + 1;
+                    from[next]   = steps[next] < UNKNOWN ? steps[next] : UNKNOWN;
+                    frontier.push_back(next);
+                }
+            }
+        }
+    }
+    stale[index] = 0;
+}
+
+RoomId RouteTables::landmarkIndex(RoomId room) const
+{
+    if (allPairs) {
+        return room;
+    }
+    for (RoomId index = 0; index < landmarks.size(); index++) {
+        if (landmarks[index] == room) {
+            return index;
+        }
+    }
+    return NO_ROOM;
+}
+
+size_t RouteTables::memoryUsage() const
+{
+    size_t bytes = sizeof(*this);
+    bytes += landmarks.capacity() * sizeof(RoomId) + stale.capacity() + hops.capacity();
+    bytes += (distanceTo.capacity() + distanceFrom.capacity()) * sizeof(Distance);
+    bytes += reverseStart.capacity() * sizeof(uint32_t) + reverseRooms.capacity() * sizeof(RoomId);
+    bytes += reverseDirections.capacity();
+    return bytes;
+}
+
+Router::Router() :
+    rooms(nullptr),
+    tables(nullptr),
+    target(NO_ROOM)
+{
+}
+
+void Router::attach(const RoomArena &rooms)
+{
+    this->rooms = &rooms;
+    reset();
+}
+
+void Router::reset()
+{
+    tables = nullptr;
+    own.reset();
+    routes.clear();
+}
+
+void Router::prepare()
+{
+    if (tables != nullptr) {
+        return;
+    }
+    if (!rooms->exitsChanged()) {
+        tables = &rooms->getWorld().routes();
+        return;
+    }
+    // Exits were changed before the first query: the World's tables are no use.
+    own.reset(new RouteTables());
+    own->build(*rooms);
+    tables = own.get();
+}
+
+// Only a game's own tables can be stale (the World's are complete and never change).
+void Router::rebuildStale(RoomId index)
+{
+    if (tables->stale[index]) {
+        own->buildLandmark(*rooms, index);
+    }
+}
+
+// The fewest steps from this room to the search's target could possibly be, from the
+// triangle inequality through each landmark.
+Router::Distance Router::lowerBound(RoomId room) const
+{
+    const RoomId count = tables->count;
+    int bound = 0;
+    for (RoomId index = 0; index < tables->landmarks.size(); index++) {
+        Distance to   = tables->distanceTo[(size_t) index * count + room];
+        Distance from = tables->distanceFrom[(size_t) index * count + room];
+        // room -> landmark is no longer than room -> target -> landmark.
+        if (to != RouteTables::UNKNOWN && targetTo[index] != RouteTables::UNKNOWN) {
+            bound = max(bound, (int) to - (int) targetTo[index]);
+        }
+        // landmark -> target is no longer than landmark -> room -> target.
+        if (from != RouteTables::UNKNOWN && targetFrom[index] != RouteTables::UNKNOWN) {
+            bound = max(bound, (int) targetFrom[index] - (int) from);
+        }
+    }
+    return bound;
+}
+
+// A* from one room to another, guided by lowerBound().
+bool Router::search(RoomId from, RoomId to, vector<RoomId> &path)
+{
+    const RoomId count = tables->count;
+    scratch.fit(count);
+    vector<uint32_t> &stamps  = scratch.stamps;
+    vector<uint32_t> &steps   = scratch.steps;
+    vector<RoomId>   &parents = scratch.parents;
+    vector<RouteScratch::Open> &open = scratch.open;
+
+    // Landmarks with spoilt bounds sit this one out rather than being rebuilt (a whole
+    // world's worth of work); route() and nextHop() rebuild them when they're headed to.
+    for (RoomId index = 0; index < tables->landmarks.size(); index++) {
+        bool usable = !(tables->stale[index] & RouteTables::STALE_BOUND);
+        targetTo[index]   = usable ? tables->distanceTo[(size_t) index * count + to] : RouteTables::UNKNOWN;
+        targetFrom[index] = usable ? tables->distanceFrom[(size_t) index * count + to] : RouteTables::UNKNOWN;
+    }
+    target = to;
+
+    uint32_t mark = scratch.nextStamp();
+    stamps[from]  = mark;
+    steps[from]   = 0;
+    parents[from] = NO_ROOM;
+    open.clear();
+    open.push_back(RouteScratch::Open{lowerBound(from), 0, from});
+
+    while (!open.empty()) {
+        pop_heap(open.begin(), open.end(), greater<RouteScratch::Open>());
+        RouteScratch::Open next = open.back();
+        open.pop_back();
+        if (next.steps != steps[next.room]) {
+            continue;       // a shorter way there was found after this was queued
+        }
+        if (next.room == to) {
+            break;
+        }
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId room = rooms->getExit(next.room, (Direction) direction);
+            if (room == NO_ROOM) {
+                continue;
+            }
+            uint32_t through = next.steps + 1;
+            if (stamps[room] != mark || through < steps[room]) {
+                stamps[room]  = mark;
+                steps[room]   = through;
+                parents[room] = next.room;
+                open.push_back(RouteScratch::Open{through + lowerBound(room), through, room});
+                push_heap(open.begin(), open.end(), greater<RouteScratch::Open>());
+            }
+        }
+    }
+
+    if (stamps[to] != mark) {
+        return false;
+    }
+    path.clear();
+    for (RoomId room = to; room != NO_ROOM; room = parents[room]) {
+        path.push_back(room);
+    }
+    reverse(path.begin(), path.end());
+    return true;
+}
+
+bool Router::route(RoomId from, RoomId to, vector<RoomId> &path)
+{
+    prepare();
+    const RoomId count = tables->count;
+    if (from >= count || to >= count) {
+        return false;
+    }
+
+    // To a landmark: follow its tree.
+    RoomId index = tables->landmarkIndex(to);
+    if (index != NO_ROOM) {
+        rebuildStale(index);
+        const uint8_t *hop = &tables->hops[(size_t) index * count];
+        path.clear();
+        path.push_back(from);
+        for (RoomId room = from; room != to; room = path.back()) {
+            if (hop[room] == NO_DIRECTION) {
+                return false;
+            }
+            path.push_back(rooms->getExit(room, (Direction) hop[room]));
+        }
+        return true;
+    }
+
+    // Part of a route found before? The rest of a shortest route is a shortest route too.
+    for (size_t i = 0; i < routes.size(); i++) {
+        if (routes[i].to != to) {
+            continue;
+        }
+        auto at = find(routes[i].path.begin(), routes[i].path.end(), from);
+        if (at != routes[i].path.end()) {
+            path.assign(at, routes[i].path.end());
+            rotate(routes.begin(), routes.begin() + i, routes.begin() + i + 1);
+            return true;
+        }
+    }
+
+    if (!search(from, to, path)) {
+        return false;
+    }
+    routes.insert(routes.begin(), CachedRoute{to, path});
+    if (routes.size() > CACHED_ROUTES) {
+        routes.pop_back();
+    }
+    return true;
+}
+
+Direction Router::nextHop(RoomId from, RoomId to)
+{
+    prepare();
+    const RoomId count = tables->count;
+    if (from == to || from >= count || to >= count) {
+        return NO_DIRECTION;
+    }
+
+    RoomId index = tables->landmarkIndex(to);
+    if (index != NO_ROOM) {
+        rebuildStale(index);
+        return (Direction) tables->hops[(size_t) index * count + from];
+    }
+
+    if (!route(from, to, path)) {
+        return NO_DIRECTION;
+    }
+    return rooms->directionTo(path[0], path[1]);
+}
+
+RoomId Router::landmarkCount()
+{
+    prepare();
+    return tables->landmarks.size();
+}
+
+RoomId Router::landmark(RoomId index)
+{
+    prepare();
+    return tables->landmarks[index];
+}
+
+void Router::exitChanged(RoomId room, Direction direction, RoomId before)
+{
+    if (tables == nullptr) {
+        return;     // nothing looked up yet
+    }
+    if (own == nullptr) {
+        // The World's tables are shared, so this game needs its own copy to spoil.
+        own.reset(new RouteTables(*tables));
+        tables = own.get();
+    }
+    RoomId after = rooms->getExit(room, direction);
+    own->reverseStale = true;
+
+    const RoomId count = own->count;
+    for (RoomId index = 0; index < own->landmarks.size(); index++) {
+        size_t base = (size_t) index * count;
+        if (before != NO_ROOM && own->hops[base + room] == direction) {
+            own->stale[index] |= RouteTables::STALE_TREE;   // the tree went through the exit that's gone
+        }
+        if (after != NO_ROOM) {
+            // Is the new exit a shortcut, to or from the landmark?
+            Distance there = own->distanceTo[base + after], here = own->distanceTo[base + room];
+            if (there != RouteTables::UNKNOWN && (here == RouteTables::UNKNOWN || there + 1 < here)) {
+                own->stale[index] |= RouteTables::STALE_TREE | RouteTables::STALE_BOUND;
+            }
+            if (!own->allPairs) {
+                Distance from = own->distanceFrom[base + room], next = own->distanceFrom[base + after];
+                if (from != RouteTables::UNKNOWN && (next == RouteTables::UNKNOWN || from + 1 < next)) {
+                    own->stale[index] |= RouteTables::STALE_BOUND;
+                }
+            }
+        }
+    }
+
+    if (after != NO_ROOM) {
+        routes.clear();     // a new exit could shorten any of them
+        return;
+    }
+    for (size_t i = routes.size(); i-- > 0;) {
+        const vector<RoomId> &cached = routes[i].path;
+        for (size_t step = 0; step + 1 < cached.size(); step++) {
+            if (cached[step] == room && cached[step + 1] == before) {
+                routes.erase(routes.begin() + i);
+                break;
+            }
+        }
+    }
+}
+
+size_t Router::memoryUsage() const
+{
+    size_t bytes = sizeof(*this) + path.capacity() * sizeof(RoomId);
+    if (own != nullptr) {
+        bytes += own->memoryUsage();
+    }
+    for (const CachedRoute &cached : routes) {
+        bytes += sizeof(cached) + cached.path.capacity() * sizeof(RoomId);
+    }
+    return bytes;
+}
+
+// World.cpp
+// The classic ten rooms, exactly as the game always had them.
+const char *CLASSIC_WORLD = R"(# The original Zork world
+room A
+room B
+room C
+room D
+room E
+room F
+room G
+room H
+room I
+room J
+
+#     room  north east south west
+exits A     E     C    H     B
+exits B     -     A    -     -
+exits C     -     -    -     A
+exits D     -     E    -     -
+exits E     -     F    A     D
+exits F     -     -    -     E
+exits G     -     H    -     -
+exits H     A     I    J     G
+exits I     -     -    -     H
+exits J     H     -    -     -
+
+item A cursed_book
+item C potion
+
+player Hero 100 100
+enemy zombie H 100 100 20 carries key
+enemy ghost D 100 100 10 wanders
+
+start A
+goal J
+lock J key
+
+map D -- E -- F
+map      |    
+map B -- A -- C
+map      |    
+map G -- H -- I
+map      |    
+map      J
+)";
+
+// Header of a binary world file. The tables follow it in this order:
+// uint32 exits[rooms * 4], uint32 nameOffsets[rooms + 1], char names[nameBytes],
+// then everything else as text directives (rooms written as @index), extraBytes long.
+struct WorldFileHeader
+{
+    char     magic[4];      // "ZRKW"
+    uint32_t version;
+    uint32_t rooms;
+    uint32_t nameBytes;
+    uint32_t extraBytes;
+    uint32_t reserved[3];
+};
+
+const uint32_t WORLD_FILE_VERSION = 1;
+
+// Takes the next word off the front of "rest".
+static string_view nextWord(string_view &rest)
+{
+    size_t start = 0;
+    while (start < rest.size() && isspace((unsigned char) rest[start])) {
+        start++;
+    }
+    size_t end = start;
+    while (end < rest.size() && !isspace((unsigned char) rest[end])) {
+        end++;
+    }
+    string_view word = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return word;
+}
+
+static bool parseNumber(string_view word, int &number)
+{
+    auto result = from_chars(word.data(), word.data() + word.size(), number);
+    return result.ec == errc() && result.ptr == word.data() + word.size();
+}
+
+// What one thread finds in its share of a text world.
+struct WorldChunk
+{
+    string_view         text;
+    size_t              lines = 0;
+    vector<string_view> rooms;
+    vector<size_t>      roomLines;
+    vector<pair<string_view, size_t> > exits;       // line and its number within the chunk
+    vector<RoomId>      exitRooms;                  // the room of each of those read (pass 2)
+    vector<pair<string_view, size_t> > directives;
+    string              error;
+    size_t              errorLine = 0;
+};
+
+// First pass over a chunk: collect room names and set the other lines aside.
+static void scanWorldChunk(WorldChunk &chunk)
+{
+    string_view text = chunk.text;
+    while (!text.empty() && chunk.error.empty()) {
+        size_t end = text.find('\n');
+        string_view line = text.substr(0, end);
+        text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+        chunk.lines++;
+
+        string_view rest = line;
+        string_view directive = nextWord(rest);
+        if (directive.empty() || directive[0] == '#') {
+            continue;
+        }
+        if (directive == "room") {
+            string_view name = nextWord(rest);
+            if (name.empty() || name[0] == '@' || name == "-" || !nextWord(rest).empty()) {
+                chunk.error = "expected \"room <name>\"";
+                chunk.errorLine = chunk.lines;
+            }
+            chunk.rooms.push_back(name);
+            chunk.roomLines.push_back(chunk.lines);
+        } else if (directive == "exits") {
+            chunk.exits.emplace_back(line, chunk.lines);
+        } else {
+            chunk.directives.emplace_back(line, chunk.lines);
+        }
+    }
+}
+
+World::World()
+{
+    mapping     = nullptr;
+    mappingSize = 0;
+    clear();
+}
+
+World::~World()
+{
+    if (mapping != nullptr) {
+        munmap(mapping, mappingSize);
+    }
+}
+
+void World::clear()
+{
+    rooms       = 0;
+    exitTable   = nullptr;
+    nameOffsets = nullptr;
+    nameText    = nullptr;
+    items.clear();
+    enemies.clear();
+    playerName    = "Hero";
+    playerHealth  = 100;
+    playerStamina = 100;
+    start      = NO_ROOM;
+    goal       = NO_ROOM;
+    lockedRoom = NO_ROOM;
+    lockKey.clear();
+    mapLines.clear();
+}
+
+RoomId World::roomCount() const
+{
+    return rooms;
+}
+
+string_view World::roomName(RoomId room) const
+{
+    return string_view(nameText + nameOffsets[room], nameOffsets[room + 1] - nameOffsets[room]);
+}
+
+RoomId World::exit(RoomId room, Direction direction) const
+{
+    return exitTable[(size_t) room * DIRECTION_COUNT + direction];
+}
+
+const unordered_map<RoomId, ItemBag> &World::startingItems() const
+{
+    call_once(itemsPlaced, [this]() {
+        for (const ItemSpec &item : items) {
+            startingBags[item.room].add(ItemCatalog::intern(item.name));
+        }
+    });
+    return startingBags;
+}
+
+const RouteTables &World::routes() const
+{
+    call_once(routed, [this]() {
+        RoomArena rooms;
+        rooms.build(*this);
+        routeTables.build(rooms);
+    });
+    return routeTables;
+}
+
+RoomId World::findRoom(string_view name) const
+{
+    call_once(indexed, [this]() {
+        index.reserve(rooms);
+        for (RoomId room = 0; room < rooms; room++) {
+            index.emplace(roomName(room), room);
+        }
+    });
+
+    auto found = index.find(name);
+    return found != index.end() ? found->second : NO_ROOM;
+}
+
+RoomId World::findRoomIgnoringCase(string_view name) const
+{
+    RoomId room = findRoom(name);
+    if (room != NO_ROOM) {
+        return room;
+    }
+    CaseInsensitiveLess less;
+    for (room = 0; room < rooms; room++) {
+        string_view other = roomName(room);
+        if (other.size() == name.size() && !less(other, name) && !less(name, other)) {
+            return room;
+        }
+    }
+    return NO_ROOM;
+}
+
+// A room in a directive: its name, or "@index" as binary files write it.
+RoomId World::resolve(string_view room) const
+{
+    if (!room.empty() && room[0] == '@') {
+        int number;
+        if (parseNumber(room.substr(1), number) && number >= 0 && (RoomId) number < rooms) {
+            return number;
+        }
+        return NO_ROOM;
+    }
+    return findRoom(room);
+}
+
+bool World::load(const string &path, string &error)
+{
+    ifstream file(path, ios::binary);
+    if (!file) {
+        error = "can't open " + path;
+        return false;
+    }
+
+    char magic[4] = {};
+    file.read(magic, sizeof(magic));
+    if (file.gcount() == sizeof(magic) && memcmp(magic, "ZRKW", 4) == 0) {
+        return mapFile(path, error);
+    }
+
+    file.clear();
+    file.seekg(0);
+    string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return parse(text, error);
+}
+
+bool World::parse(string_view text, string &error)
+{
+    clear();
+
+    // Split the text into one chunk per thread, cut at line ends. Small worlds use one chunk.
+    size_t threads = text.size() < (1 << 16) ? 1 : max(1u, thread::hardware_concurrency());
+    vector<WorldChunk> chunks(threads);
+    size_t begin = 0;
+    for (size_t i = 0; i < threads; i++) {
+        size_t end = i + 1 == threads ? text.size() : max(begin, text.size() * (i + 1) / threads);
+        while (end < text.size() && text[end - 1] != '\n') {
+            end++;
+        }
+        chunks[i].text = text.substr(begin, end - begin);
+        begin = end;
+    }
+
+    auto parallel = [&](auto work) {
+        vector<thread> workers;
+        for (size_t i = 1; i < threads; i++) {
+            workers.emplace_back(work, ref(*this), ref(chunks[i]));
+        }
+        work(*this, chunks[0]);
+        for (thread &worker : workers) {
+            worker.join();
+        }
+    };
+
+    // Pass 1 (parallel): find the rooms.
+    parallel([](World &, WorldChunk &chunk) { scanWorldChunk(chunk); });
+
+    size_t firstLine = 1;
+    size_t nameBytes = 0;
+    for (WorldChunk &chunk : chunks) {
+        if (!chunk.error.empty()) {
+            error = "line " + to_string(firstLine + chunk.errorLine - 1) + ": " + chunk.error;
+            return false;
+        }
+        rooms += chunk.rooms.size();
+        for (string_view name : chunk.rooms) {
+            nameBytes += name.size();
+        }
+        firstLine += chunk.lines;
+    }
+
+    // Copy the names into one block and index them.
+    ownedNames.reserve(nameBytes);
+    ownedOffsets.reserve(rooms + 1);
+    for (WorldChunk &chunk : chunks) {
+        for (string_view name : chunk.rooms) {
+            ownedOffsets.push_back(ownedNames.size());
+            ownedNames.append(name.data(), name.size());
+        }
+    }
+    ownedOffsets.push_back(ownedNames.size());
+    nameOffsets = ownedOffsets.data();
+    nameText    = ownedNames.data();
+
+    findRoom("");       // builds the index
+    if (index.size() != rooms) {
+        // Some name points to an earlier room: report where it is declared again.
+        RoomId room = 0;
+        firstLine = 1;
+        for (WorldChunk &chunk : chunks) {
+            for (size_t i = 0; i < chunk.rooms.size(); i++, room++) {
+                if (index.at(chunk.rooms[i]) != room) {
+                    error = "line " + to_string(firstLine + chunk.roomLines[i] - 1) + ": room "
+                          + string(chunk.rooms[i]) + " is declared twice";
+                    return false;
+                }
+            }
+            firstLine += chunk.lines;
+        }
+    }
+
+    // Pass 2 (parallel): wire the exits. A room's exits may only be given once: the first line
+    // for it to claim the room writes them, so two threads never write the same slots, and
+    // the error pass below says which line came second.
+    ownedExits.assign((size_t) rooms * DIRECTION_COUNT, NO_ROOM);
+    exitTable = ownedExits.data();
+    unique_ptr<atomic<bool>[]> claimed(new atomic<bool>[rooms]());
+    parallel([&claimed](World &world, WorldChunk &chunk) {
+        for (auto &line : chunk.exits) {
+            string_view rest = line.first;
+            nextWord(rest);                                 // "exits"
+            RoomId room = world.resolve(nextWord(rest));
+            if (room == NO_ROOM) {
+                chunk.error = "exits of an unknown room";
+                chunk.errorLine = line.second;
+                return;
+            }
+            chunk.exitRooms.push_back(room);
+            if (claimed[room].exchange(true, memory_order_relaxed)) {
+                continue;
+            }
+            for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+                string_view target = nextWord(rest);
+                RoomId next = target == "-" ? NO_ROOM : world.resolve(target);
+                if (target.empty() || (next == NO_ROOM && target != "-")) {
+                    chunk.error = "expected \"exits <room> <north> <east> <south> <west>\" with known rooms or -";
+                    chunk.errorLine = line.second;
+                    return;
+                }
+                world.ownedExits[(size_t) room * DIRECTION_COUNT + direction] = next;
+            }
+        }
+    });
+
+    // Everything else is small, so it is read in file order on this thread.
+    vector<bool> exitsGiven(rooms, false);
+    firstLine = 1;
+    for (WorldChunk &chunk : chunks) {
+        // (A chunk stops at its error, so the exits it did read all come before it.)
+        for (size_t i = 0; i < chunk.exitRooms.size(); i++) {
+            RoomId room = chunk.exitRooms[i];
+            if (exitsGiven[room]) {
+                error = "line " + to_string(firstLine + chunk.exits[i].second - 1) + ": exits of "
+                      + string(roomName(room)) + " given twice";
+                return false;
+            }
+            exitsGiven[room] = true;
+        }
+        if (!chunk.error.empty()) {
+            error = "line " + to_string(firstLine + chunk.errorLine - 1) + ": " + chunk.error;
+            return false;
+        }
+        for (auto &line : chunk.directives) {
+            if (!parseDirective(line.first, error)) {
+                error = "line " + to_string(firstLine + line.second - 1) + ": " + error;
+                return false;
+            }
+        }
+        firstLine += chunk.lines;
+    }
+
+    if (start == NO_ROOM) {
+        error = "the world has no start room";
+        return false;
+    }
+    return true;
+}
+
+bool World::parseDirective(string_view line, string &error)
+{
+    string_view rest = line;
+    string_view directive = nextWord(rest);
+
+    if (directive == "item") {
+        RoomId room = resolve(nextWord(rest));
+        string_view item = nextWord(rest);
+        if (room == NO_ROOM || item.empty()) {
+            error = "expected \"item <room> <item>\"";
+            return false;
+        }
+        items.push_back(ItemSpec{room, string(item)});
+    } else if (directive == "enemy") {
+        EnemySpec enemy;
+        enemy.name = string(nextWord(rest));
+        enemy.room = resolve(nextWord(rest));
+        enemy.wanders = false;
+        if (enemy.name.empty() || enemy.room == NO_ROOM || !parseNumber(nextWord(rest), enemy.health)
+                || !parseNumber(nextWord(rest), enemy.stamina) || !parseNumber(nextWord(rest), enemy.damage)) {
+            error = "expected \"enemy <name> <room> <health> <stamina> <damage> [wanders] [carries <item>...]\"";
+            return false;
+        }
+        bool carries = false;
+        for (string_view word = nextWord(rest); !word.empty(); word = nextWord(rest)) {
+            if (carries) {
+                enemy.loot.push_back(string(word));
+            } else if (word == "wanders") {
+                enemy.wanders = true;
+            } else if (word == "carries") {
+                carries = true;
+            } else {
+                error = "unknown enemy option " + string(word);
+                return false;
+            }
+        }
+        enemies.push_back(enemy);
+    } else if (directive == "player") {
+        playerName = string(nextWord(rest));
+        if (playerName.empty() || !parseNumber(nextWord(rest), playerHealth)
+                || !parseNumber(nextWord(rest), playerStamina)) {
+            error = "expected \"player <name> <health> <stamina>\"";
+            return false;
+        }
+    } else if (directive == "start" || directive == "goal") {
+        RoomId room = resolve(nextWord(rest));
+        if (room == NO_ROOM) {
+            error = "expected \"" + string(directive) + " <room>\"";
+            return false;
+        }
+        (directive == "start" ? start : goal) = room;
+    } else if (directive == "lock") {
+        lockedRoom = resolve(nextWord(rest));
+        lockKey    = string(nextWord(rest));
+        if (lockedRoom == NO_ROOM || lockKey.empty()) {
+            error = "expected \"lock <room> <key item>\"";
+            return false;
+        }
+    } else if (directive == "map") {
+        // Everything after "map " is kept as it is, spaces included.
+        size_t text = line.find("map") + 3;
+        mapLines.push_back(string(line.substr(min(line.size(), text + 1))));
+    } else {
+        error = "unknown directive " + string(directive);
+        return false;
+    }
+    return true;
+}
+
+bool World::save(const string &path, string &error) const
+{
+    // Everything but the room tables, as text directives with rooms written by index.
+    ostringstream extra;
+    auto room = [](RoomId index) { return "@" + to_string(index); };
+    extra << "player " << playerName << " " << playerHealth << " " << playerStamina << "\n";
+    extra << "start " << room(start) << "\n";
+    if (goal != NO_ROOM) {
+        extra << "goal " << room(goal) << "\n";
+    }
+    if (lockedRoom != NO_ROOM) {
+        extra << "lock " << room(lockedRoom) << " " << lockKey << "\n";
+    }
+    for (const ItemSpec &item : items) {
+        extra << "item " << room(item.room) << " " << item.name << "\n";
+    }
+    for (const EnemySpec &enemy : enemies) {
+        extra << "enemy " << enemy.name << " " << room(enemy.room) << " " << enemy.health << " "
+              << enemy.stamina << " " << enemy.damage << (enemy.wanders ? " wanders" : "");
+        if (!enemy.loot.empty()) {
+            extra << " carries";
+            for (const string &item : enemy.loot) {
+                extra << " " << item;
+            }
+        }
+        extra << "\n";
+    }
+    for (const string &line : mapLines) {
+        extra << "map " << line << "\n";
+    }
+    string extraText = extra.str();
+
+    WorldFileHeader header = {};
+    memcpy(header.magic, "ZRKW", 4);
+    header.version    = WORLD_FILE_VERSION;
+    header.rooms      = rooms;
+    header.nameBytes  = nameOffsets[rooms];
+    header.extraBytes = extraText.size();
+
+    string temporary = path + ".tmp";
+    ofstream file(temporary, ios::binary | ios::trunc);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) exitTable, (size_t) rooms * DIRECTION_COUNT * sizeof(RoomId));
+    file.write((const char *) nameOffsets, ((size_t) rooms + 1) * sizeof(uint32_t));
+    file.write(nameText, header.nameBytes);
+    file.write(extraText.data(), extraText.size());
+    file.close();
+    if (!file || rename(temporary.c_str(), path.c_str()) != 0) {
+        error = "can't write " + path;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool World::mapFile(const string &path, string &error)
+{
+    clear();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        error = "can't open " + path;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    mappingSize = info.st_size;
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        error = "can't map " + path;
+        return false;
+    }
+
+    // The header, then that every table fits in the file before pointing into it.
+    const char *data = (const char *) mapping;
+    WorldFileHeader header;
+    string invalid = path + " is not a valid world file (version " + to_string(WORLD_FILE_VERSION) + ")";
+    if (mappingSize < sizeof(header)) {
+        error = invalid;
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t exitsAt   = sizeof(header);
+    size_t offsetsAt = exitsAt + (size_t) header.rooms * DIRECTION_COUNT * sizeof(RoomId);
+    size_t namesAt   = offsetsAt + ((size_t) header.rooms + 1) * sizeof(uint32_t);
+    size_t extraAt   = namesAt + header.nameBytes;
+    if (memcmp(header.magic, "ZRKW", 4) != 0 || header.version != WORLD_FILE_VERSION
+            || extraAt + header.extraBytes != mappingSize) {
+        error = invalid;
+        return false;
+    }
+
+    rooms       = header.rooms;
+    exitTable   = (const RoomId *) (data + exitsAt);
+    nameOffsets = (const uint32_t *) (data + offsetsAt);
+    nameText    = data + namesAt;
+
+    // And what's in the tables, in one pass: every exit goes to a room or nowhere, and each
+    // name starts where the one before it ended, inside the text. Rooms, routes and names
+    // are then read without checking.
+    bool valid = nameOffsets[rooms] == header.nameBytes;
+    for (RoomId room = 0; room < rooms && valid; room++) {
+        valid = nameOffsets[room] <= nameOffsets[room + 1];
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = exitTable[(size_t) room * DIRECTION_COUNT + direction];
+            valid = valid && (next < rooms || next == NO_ROOM);
+        }
+    }
+    if (!valid) {
+        error = path + " has a corrupt room table";
+        return false;
+    }
+
+    string_view extra(data + extraAt, header.extraBytes);
+    while (!extra.empty()) {
+        size_t end = extra.find('\n');
+        string_view line = extra.substr(0, end);
+        extra.remove_prefix(end == string_view::npos ? extra.size() : end + 1);
+        if (!line.empty() && !parseDirective(line, error)) {
+            return false;
+        }
+    }
+    if (start == NO_ROOM) {
+        error = "the world has no start room";
+        return false;
+    }
+    return true;
+}
+
+// Writes a text world of "rooms" rooms laid out on a square grid, for testing at scale.
+// "npcs" extra rats are spread over it, every other one wandering.
+bool makeWorld(int rooms, const string &path, int npcs = 0)
+{
+    ofstream file(path);
+    int width = max(1, (int) sqrt((double) rooms));
+    auto name = [](int room) { return "r" + to_string(room); };
+
+    file << "# A generated " << rooms << " room grid\n";
+    for (int room = 0; room < rooms; room++) {
+        file << "room " << name(room) << "\n";
+    }
+    for (int room = 0; room < rooms; room++) {
+        int column = room % width;
+        int north = room - width, east = room + 1, south = room + width, west = room - 1;
+        file << "exits " << name(room)
+             << " " << (north >= 0 ? name(north) : "-")
+             << " " << (column + 1 < width && east < rooms ? name(east) : "-")
+             << " " << (south < rooms ? name(south) : "-")
+             << " " << (column > 0 ? name(west) : "-") << "\n";
+    }
+    file << "item " << name(0) << " cursed_book\n";
+    file << "item " << name(rooms / 3) << " potion\n";
+    file << "player Hero 100 100\n";
+    file << "enemy zombie " << name(rooms / 2) << " 100 100 20 carries key\n";
+    file << "enemy ghost " << name(rooms - 1) << " 100 100 10 wanders\n";
+    for (int npc = 0; npc < npcs; npc++) {
+        int room = 1 + (int) ((npc * 7919LL) % max(1, rooms - 1));
+        file << "enemy rat " << name(min(room, rooms - 1)) << " 10 10 5" << (npc % 2 ? " wanders" : "") << "\n";
+    }
+    file << "start " << name(0) << "\n";
+    file << "goal " << name(rooms - 1) << "\n";
+    file << "lock " << name(rooms - 1) << " key\n";
+    return (bool) file;
+}
+
+// Rules.cpp
+Rules::Move Rules::go(RoomId next, RoomId lockedRoom, bool hasKey, bool guarded)
+{
+    if (next == NO_ROOM) {
+        return WALL;
+    } else if (lockedRoom != NO_ROOM && hasKey) {
+        return MOVED;
+    } else if (lockedRoom != NO_ROOM && next == lockedRoom) {
+        return LOCKED;
+    } else if (guarded) {
+        return GUARDED;
+    }
+    return MOVED;
+}
+
+Rules::Taken Rules::take(bool cursed, bool hasPotion, int health)
+{
+    Taken taken = { cursed, NO_POTION, max(0, cursed ? health - HURT : health) };
+    if (!hasPotion || taken.health == 0) {
+        return taken;
+    }
+
+    if (taken.health == FULL_HEALTH) {
+        taken.potion = FULL;
+    } else if (taken.health > POTION_HEALS_UP_TO) {
+        taken.potion = TOO_HIGH;
+    } else {
+        taken.potion = HEALS;
+        taken.health += POTION_HEALS;
+    }
+    return taken;
+}
+
+Rules::Blow Rules::attack(int health, int damage)
+{
+    Blow blow = { max(0, health - damage), false };
+    blow.killed = blow.health == 0;
+    return blow;
+}
+
+Rules::Landing Rules::teleport(RoomId roomCount, double stamina, Random &random)
+{
+    Landing landing;
+    landing.room    = random.below(roomCount);
+    landing.stamina = (int) (stamina - TELEPORT_STAMINA);
+    return landing;
+}
+
+Direction Rules::wander(Router &router, RoomId start, RoomId here, RoomId &destination, Random &random)
+{
+    RoomId landmarks = router.landmarkCount();
+    if (landmarks < 2) {
+        return NO_DIRECTION;
+    }
+
+    if (destination == NO_ROOM || destination == here) {
+        RoomId index = random.below(landmarks);
+        destination = router.landmark(index);
+        if (destination == start) {
+            destination = router.landmark((index + 1) % landmarks);
+        }
+    }
+
+    Direction direction = router.nextHop(here, destination);
+    if (direction == NO_DIRECTION) {
+        destination = NO_ROOM;      // can't get there from here, so pick again next time
+    }
+    return direction;
+}
+
+// SaveFile.cpp
+// Header of a saved game. After it come two snapshot blocks, "bytes" long together:
+//   - item names (uint32 offsets[count + 1], then the characters), the events the timers post
+//     (the same way), the timers (TimerRecord) and up to 7 bytes of padding;
+//   - the game itself, as Game::snapshot() writes it.
+// The columns in the second one are copied out of the mapped file as they are, without
+// parsing anything per character.
+struct SaveFileHeader
+{
+    char     magic[4];      // "ZRKS"
+    uint32_t version;
+    uint64_t checksum;      // of the "bytes" after the header, see checksum()
+    uint64_t bytes;
+    uint32_t rooms;         // of the world it was saved in, and how many characters that has:
+    uint32_t characters;    // a save only fits that world
+};
+
+const uint32_t SAVE_FILE_VERSION = 3;    // 2: the random generator's state is in the game
+                                         // 3: no occupant index, it is rebuilt from the rooms
+
+// A waiting timer as a save file has it.
+struct TimerRecord
+{
+    uint64_t delay;
+    uint64_t period;
+    uint64_t value;
+    uint32_t event;         // index into the saved event names
+    uint32_t clock;
+};
+
+// FNV-1a, eight bytes at a time (then the odd ones). Each step is a bijection of the running
+// hash, so changing any one word of the file always changes the result.
+static uint64_t checksum(const uint8_t *data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    const uint64_t prime = 1099511628211ULL;
+    size_t at = 0;
+    for (; at + sizeof(uint64_t) <= size; at += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + at, sizeof(word));
+        hash = (hash ^ word) * prime;
+    }
+    for (; at < size; at++) {
+        hash = (hash ^ data[at]) * prime;
+    }
+    return hash;
+}
+
+// A list of names as two sections: where each starts, then all the characters.
+static void putNames(Snapshot &snapshot, const vector<string> &names)
+{
+    vector<uint32_t> offsets;
+    string text;
+    for (const string &name : names) {
+        offsets.push_back(text.size());
+        text += name;
+    }
+    offsets.push_back(text.size());
+    snapshot.put(offsets);
+    snapshot.put(text.data(), text.size());
+}
+
+static bool getNames(Snapshot::Reader &reader, vector<string> &names)
+{
+    vector<uint32_t> offsets;
+    vector<char> text;
+    if (!reader.get(offsets) || !reader.get(text) || offsets.empty() || offsets.back() != text.size()) {
+        return false;
+    }
+    names.clear();
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+        if (offsets[i] > offsets[i + 1]) {
+            return false;
+        }
+        names.emplace_back(text.data() + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    return true;
+}
+
+// Writes the parts one after another to a temporary file next to "path", flushes it to disk
+// and renames it over "path": a crash leaves the old file or the new one, never half of one.
+static bool writeAtomically(const string &path, initializer_list<pair<const void *, size_t> > parts, string &error)
+{
+    string temporary = path + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0) {
+        error = "can't write " + path + ": " + strerror(errno);
+        return false;
+    }
+    bool written = true;
+    for (const auto &part : parts) {
+        written = written && writeFully(fd, part.first, part.second);
+    }
+    written = written && fsync(fd) == 0;
+    written = ::close(fd) == 0 && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        error = "can't write " + path + ": " + strerror(errno);
+        remove(temporary.c_str());
+        return false;
+    }
+
+    // The rename itself is only durable once the directory is flushed too.
+    size_t slash = path.rfind('/');
+    int directory = open(slash == string::npos ? "." : path.substr(0, slash).c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory >= 0) {
+        fsync(directory);
+        ::close(directory);
+    }
+    return true;
+}
+
+// Where save slots go, for every game of the process (set once, before games start).
+static string &saveDirectory()
+{
+    static string directory = "saves";
+    return directory;
+}
+
+void Game::setSaveDirectory(const string &directory)
+{
+    saveDirectory() = directory;
+}
+
+string Game::slotPath(string_view slot)
+{
+    // Slot names become file names: no slashes, dots or anything else a path could use.
+    if (slot.empty() || slot.size() > 32) {
+        return "";
+    }
+    for (char c : slot) {
+        if (!isalnum((unsigned char) c) && c != '_' && c != '-') {
+            return "";
+        }
+    }
+    return saveDirectory() + "/" + string(slot) + ".sav";
+}
+
+bool Game::save(const string &path, string &error)
+{
+    Snapshot names;
+    vector<string> items;
+    for (ItemId item = 0; item < ItemCatalog::count(); item++) {
+        items.push_back(ItemCatalog::name(item));
+    }
+    putNames(names, items);
+
+    // Timers are written with their event's name: IDs are only good in this process.
+    vector<EventManager::WaitingTimer> waiting;
+    events.waitingTimers(waiting);
+    vector<string>      eventNames;
+    vector<EventId>     eventIds;
+    vector<TimerRecord> timers;
+    for (const EventManager::WaitingTimer &timer : waiting) {
+        size_t index = find(eventIds.begin(), eventIds.end(), timer.event) - eventIds.begin();
+        if (index == eventIds.size()) {
+            eventIds.push_back(timer.event);
+            eventNames.push_back(EventManager::name(timer.event));
+        }
+        timers.push_back(TimerRecord{timer.delay, timer.period, timer.value, (uint32_t) index, (uint32_t) timer.clock});
+    }
+    putNames(names, eventNames);
+    names.put(timers);
+
+    // Padding, so the game's columns start eight-byte aligned in the file and checksum() sees
+    // the same words whether it runs over both blocks in one go or one after the other.
+    const char padding[8] = {};
+    names.put(padding, (8 - (names.size() + sizeof(uint32_t)) % 8) % 8);
+
+    Snapshot state;
+    snapshot(state);
+
+    SaveFileHeader header = {};
+    memcpy(header.magic, "ZRKS", 4);
+    header.version    = SAVE_FILE_VERSION;
+    header.bytes      = names.size() + state.size();
+    header.checksum   = checksum(state.data(), state.size(), checksum(names.data(), names.size()));
+    header.rooms      = world.roomCount();
+    header.characters = entities.size();
+    return writeAtomically(path, {{&header, sizeof(header)}, {names.data(), names.size()},
+                                  {state.data(), state.size()}}, error);
+}
+
+bool Game::load(const string &path, string &error)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        error = "can't open " + path;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    size_t size = info.st_size;
+    void *mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        error = "can't map " + path;
+        return false;
+    }
+    // Unmapped however this returns.
+    shared_ptr<void> unmap(mapping, [size](void *mapping) { munmap(mapping, size); });
+
+    const uint8_t *data = (const uint8_t *) mapping;
+    SaveFileHeader header;
+    memcpy(&header, data, min(size, sizeof(header)));
+    if (size < sizeof(header) || memcmp(header.magic, "ZRKS", 4) != 0 || header.version != SAVE_FILE_VERSION
+            || header.bytes != size - sizeof(header)) {
+        error = path + " is not a saved game (version " + to_string(SAVE_FILE_VERSION) + ")";
+        return false;
+    }
+    if (checksum(data + sizeof(header), header.bytes) != header.checksum) {
+        error = path + " is damaged (wrong checksum)";
+        return false;
+    }
+    if (header.rooms != world.roomCount() || header.characters != entities.size()) {
+        error = path + " was saved in another world";
+        return false;
+    }
+
+    Snapshot::Reader reader(data + sizeof(header), header.bytes);
+    vector<string> itemNames, eventNames;
+    vector<TimerRecord> timers;
+    vector<char> padding;
+    if (!getNames(reader, itemNames) || !getNames(reader, eventNames) || !reader.get(timers) || !reader.get(padding)) {
+        error = path + " is damaged";
+        return false;
+    }
+    vector<ItemId> items;
+    for (const string &name : itemNames) {
+        items.push_back(ItemCatalog::intern(name));
+        if (items.back() == NO_ITEM) {
+            error = path + " has an item this game doesn't know";
+            return false;
+        }
+    }
+    vector<EventId> eventIds;
+    for (const string &name : eventNames) {
+        eventIds.push_back(EventManager::lookup(name));
+    }
+    for (const TimerRecord &timer : timers) {
+        if (timer.event >= eventIds.size() || eventIds[timer.event] == NO_EVENT || timer.clock > (uint32_t) EventManager::MILLISECONDS) {
+            error = path + " has a timer this game doesn't know";
+            return false;
+        }
+    }
+
+    // Everything that can be checked up front was: still, a game left half loaded is put back.
+    Snapshot before;
+    snapshot(before);
+    reader.mapItems(&items);
+    if (!restore(reader)) {
+        restore(before);
+        error = path + " is damaged";
+        return false;
+    }
+    events.clearTimers();
+    for (const TimerRecord &timer : timers) {
+        events.schedule(eventIds[timer.event], timer.value, timer.delay, timer.period, (EventManager::Clock) timer.clock);
+    }
+    return true;
+}
+
+void Game::setSlotsAllowed(bool allowed)
+{
+    slotsAllowed = allowed;
+}
+
+void Game::saveSlot(string_view slot)
+{
+    if (!slotsAllowed) {
+        screen << "Games can't be saved on this server." << '\n';
+        return;
+    }
+    string path = slotPath(slot);
+    if (path.empty()) {
+        screen << "A slot name is up to 32 letters, digits, '-' or '_'." << '\n';
+        return;
+    }
+    string error;
+    mkdir(saveDirectory().c_str(), 0755);   // fails harmlessly if it's there
+    if (!save(path, error)) {
+        screen << "Could not save: " << error << '\n';
+        return;
+    }
+    screen << "Saved to slot " << slot << "." << '\n';
+}
+
+void Game::loadSlot(string_view slot)
+{
+    if (!slotsAllowed) {
+        screen << "Games can't be loaded on this server." << '\n';
+        return;
+    }
+    string path = slotPath(slot);
+    if (path.empty()) {
+        screen << "A slot name is up to 32 letters, digits, '-' or '_'." << '\n';
+        return;
+    }
+    string error;
+    checkpoint();
+    if (!load(path, error)) {
+        screen << "Could not load: " << error << '\n';
+        return;
+    }
+    screen << "Loaded slot " << slot << "." << '\n';
+}
+
+// Journal.cpp
+// The journal file: this header, then a record per turn (JournalRecord and the command's text).
+struct JournalHeader
+{
+    char     magic[4];      // "ZRKJ"
+    uint32_t version;
+    uint64_t base;          // checksum of the base save the turns go on from
+};
+
+struct JournalRecord
+{
+    uint32_t length;
+    uint32_t checksum;      // of the text: a record cut short by a crash is where replay stops
+};
+
+const uint32_t JOURNAL_VERSION = 2;      // 2: the random seed went into the base
+
+// The checksum in a save file's header, which tells saves apart. False if there is no such file.
+static bool savedChecksum(const string &path, uint64_t &sum)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    SaveFileHeader header;
+    bool read = ::read(fd, &header, sizeof(header)) == (ssize_t) sizeof(header);
+    ::close(fd);
+    sum = header.checksum;
+    return read;
+}
+
+Journal::Journal(Game &game) :
+    game(game),
+    fd(-1),
+    pendingTurns(0),
+    replayedTurns(0),
+    rebaseWanted(false),
+    failing(false)
+{
+}
+
+Journal::~Journal()
+{
+    flush();
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool Journal::open(const string &path, string &error)
+{
+    this->path = path;
+    uint64_t base;
+    if (savedChecksum(path + ".base", base)) {
+        if (!game.load(path + ".base", error) || !replay(base, error)) {
+            return false;
+        }
+    }
+    return rebase(error);
+}
+
+bool Journal::replay(uint64_t base, string &error)
+{
+    ifstream file(path, ios::binary);
+    string journal((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    JournalHeader header;
+    if (journal.size() < sizeof(header)) {
+        return true;        // the crash came before its header was written: nothing to replay
+    }
+    memcpy(&header, journal.data(), sizeof(header));
+    if (memcmp(header.magic, "ZRKJ", 4) != 0 || header.version != JOURNAL_VERSION) {
+        error = path + " is not a journal (version " + to_string(JOURNAL_VERSION) + ")";
+        return false;
+    }
+    // A journal from an older base: the base was rewritten, but the crash came before the
+    // journal was started over. Its turns are already in the base.
+    if (header.base != base) {
+        return true;
+    }
+
+    // Quietly: the player only needs to see where it ends.
+    size_t at = sizeof(header);
+    while (journal.size() - at >= sizeof(JournalRecord)) {
+        JournalRecord record;
+        memcpy(&record, journal.data() + at, sizeof(record));
+        at += sizeof(record);
+        if (journal.size() - at < record.length ||
+            (uint32_t) checksum((const uint8_t *) journal.data() + at, record.length) != record.checksum) {
+            break;
+        }
+        game.getEvents().handle_line(string_view(journal.data() + at, record.length), -1);
+        at += record.length;
+        replayedTurns++;
+    }
+    return true;
+}
+
+// The game as it is now becomes the base, and the journal starts over empty after it.
+bool Journal::rebase(string &error)
+{
+    pending.clear();
+    pendingTurns = 0;
+    rebaseWanted = false;
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+
+    JournalHeader header = {};
+    memcpy(header.magic, "ZRKJ", 4);
+    header.version = JOURNAL_VERSION;
+    if (!game.save(path + ".base", error) || !savedChecksum(path + ".base", header.base) ||
+        !writeAtomically(path, {{&header, sizeof(header)}}, error)) {
+        return false;
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        error = "can't open " + path + ": " + strerror(errno);
+        return false;
+    }
+    // The turn before the base isn't in it: replaying couldn't undo it.
+    game.forgetUndo();
+    return true;
+}
+
+void Journal::append(Words &args)
+{
+    string text;
+    for (size_t i = 0; i < args.size(); i++) {
+        text.append(i > 0 ? " " : "").append(args[i]);
+    }
+    if (args.size() > 0 && (args[0] == "save" || args[0] == "load")) {
+        rebaseWanted = true;
+    } else if (args.size() > 0 && args[0] == "exit") {
+        text.clear();       // it only ends this run: replayed, it's a turn where nothing happens
+    }
+
+    JournalRecord record = {(uint32_t) text.size(), (uint32_t) checksum((const uint8_t *) text.data(), text.size())};
+    pending.append((const char *) &record, sizeof(record));
+    pending.append(text);
+    pendingTurns++;
+}
+
+void Journal::flush()
+{
+    if (pending.empty() || fd < 0) {
+        return;
+    }
+    if ((!writeFully(fd, pending.data(), pending.size()) || fdatasync(fd) != 0) && !failing) {
+        cerr << "Can't write the journal " << path << ": " << strerror(errno) << endl;
+        failing = true;
+    }
+    pending.clear();
+    pendingTurns = 0;
+}
+
+void Journal::turnEnded()
+{
+    if (rebaseWanted) {
+        string error;
+        if (!rebase(error)) {
+            cerr << "Can't start a new journal: " << error << endl;
+        }
+    } else if (pendingTurns >= MAX_BATCH) {
+        flush();
+    }
+}
+
+size_t Journal::replayed() const
+{
+    return replayedTurns;
+}
+
+bool Game::openJournal(const string &path, string &error)
+{
+    int output = screen.getOutput();
+    unique_ptr<Journal> opened(new Journal(*this));
+    bool ok = opened->open(path, error);
+    screen.setOutput(output);       // replaying showed the turns nowhere
+    if (!ok) {
+        return false;
+    }
+
+    // From here on (not while replaying) turns go in the journal.
+    journal = move(opened);
+    listen(Events::turnEnd, new JournalListener(this));
+    listen(Events::idle,    new IdleListener(this));
+    return true;
+}
+
+Journal *Game::getJournal()
+{
+    return journal.get();
+}
+
+// The item the game-over screen makes, to show dynamic dispatch.
+static const char *TEST_ITEM = "testItem";
+
+void Game::prepareNames(const World &world)
+{
+    for (const ItemSpec &item : world.items) {
+        ItemCatalog::intern(item.name);
+    }
+    for (const EnemySpec &enemy : world.enemies) {
+        for (const string &loot : enemy.loot) {
+            ItemCatalog::intern(loot);
+        }
+    }
+    if (!world.lockKey.empty()) {
+        ItemCatalog::intern(world.lockKey);
+    }
+    ItemCatalog::intern(TEST_ITEM);
+
+    // Event names are all interned by Events, as the program starts.
+    ItemCatalog::freeze();
+    EventManager::freezeNames();
+}
+
+Game::Game(const World &world, EventManager &events, int screenFd) :
+    world(world),
+    events(events),
+    random(time(nullptr) ^ (uintptr_t) this),
+    screen(screenFd),
+    entities(events),
+    testChar(entities, "testChar"),
+    player(entities, "Hero")
+{
+    // Commands 
+    listen(Events::input,     new InputListener(this));
+    listen(Events::go,        new GoListener(this));
+    listen(Events::map,       new MapListener(this));
+    listen(Events::info,      new InfoListener(this));
+    listen(Events::restart,   new RestartListener(this));
+    listen(Events::teleport,  new TeleportListener(this));
+    listen(Events::take,      new TakeListener(this));
+    listen(Events::drop,      new DropListener(this));
+    listen(Events::attack,    new AttackListener(this));
+    listen(Events::exit,      new ExitListener(this));
+    listen(Events::travel,    new TravelListener(this));
+    listen(Events::undo,      new UndoListener(this));
+    listen(Events::save,      new SaveListener(this));
+    listen(Events::load,      new LoadListener(this));
+    listen(Events::stats,     new StatsListener(this));
+
+    // State changes
+    listen(Events::characterDeath, new CharacterDeathListener(this));
+    listen(Events::enterRoom,      new EnterRoomListener(this));
+    listen(Events::hurt,           new HurtListener(this));
+    listen(Events::victory,        new VictoryListener(this));
+    listen(Events::defeat,         new DefeatListener(this));
+    listen(Events::turnEnd,        new TurnEndListener(this));
+    listen(Events::patrol,         new PatrolListener(this));
+    listen(Events::source,         new SourceListener(this));
+
+    // In queued mode one turn can't hurt or kill the same character twice.
+    events.coalesce(Events::hurt.id);
+    events.coalesce(Events::characterDeath.id);
+    events.coalesce(Events::victory.id);
+    events.coalesce(Events::defeat.id);
+
+    // Ongoing things happen on timers, not as a side effect of some command.
+    events.schedule(Events::patrol, 1, 1);
+
+    // The rooms, exits and starting items are the world's: the game only keeps what changes.
+    rooms.build(world);
+    entities.attach(rooms);
+    router.attach(rooms);
+
+    lockKey = world.lockKey.empty() ? NO_ITEM : ItemCatalog::intern(world.lockKey);
+
+    player.setName(world.playerName);
+
+    // One row per enemy of the world, right after the player.
+    firstEnemy = entities.size();
+    for (const EnemySpec &enemy : world.enemies) {
+        entities.create(enemy.name, enemy.health, enemy.stamina, enemy.damage, enemy.wanders);
+    }
+
+    // Everybody in their starting place. This is built once: restarting restores it.
+    gameOver = false;
+    undoable = false;
+    slotsAllowed = true;
+    player.setCurrentRoom(world.start);
+    player.setHealth(world.playerHealth);
+    player.setStamina<int>(world.playerStamina);
+    for (EntityId enemy = firstEnemy; enemy < entities.size(); enemy++) {
+        const EnemySpec &spec = world.enemies[enemy - firstEnemy];
+        entities.setRoom(enemy, spec.room);
+        for (const string &loot : spec.loot) {
+            entities.inventoryOf(enemy).add(ItemCatalog::intern(loot));
+        }
+    }
+    snapshot(start);
+
+    reset();
+    screen.flush();
+}
+ 
+void Game::snapshot(Snapshot &snapshot) const
+{
+    snapshot.clear();
+    uint8_t over = gameOver;
+    snapshot.put(&over, 1);
+    snapshot.put(&random.getState(), 1);
+    entities.save(snapshot);
+    rooms.save(snapshot);
+}
+
+bool Game::restore(Snapshot::Reader reader)
+{
+    uint8_t over;
+    Random::State state;
+    if (!reader.get(&over, 1) || !reader.get(&state, 1) || !entities.restore(reader) || !rooms.restore(reader, entities.room) || !reader.atEnd()) {
+        return false;
+    }
+    gameOver = over;
+    random.setState(state);
+    router.reset();     // its cached routes and tables were for the exits as they were
+    return true;
+}
+
+void Game::checkpoint()
+{
+    snapshot(beforeTurn);
+    undoable = true;
+}
+
+void Game::takeTurn()
+{
+    checkpoint();
+    events.takeTurn();
+}
+
+void Game::undo()
+{
+    if (!undoable) {
+        screen << "There is nothing to undo." << '\n';
+        return;
+    }
+    // One step back only: undoing twice doesn't go further. Undo doesn't take a turn itself
+    // (see EventManager::takeTurn), so no patrol moves anyone again after this.
+    restore(beforeTurn);
+    undoable = false;
+    screen << "You take back your last turn." << '\n';
+}
+
+void Game::forgetUndo()
+{
+    undoable = false;
+}
+
+void Game::reset(bool show_update)
+{
+    // A new game, not the same one again: the random numbers go on from where they were.
+    Random::State state = random.getState();
+    restore(start);
+    random.setState(state);
+
+    screen << "Welcome to Zork!" << '\n';
+    if (show_update) {
+        update_screen();
+    }
+}
+
+// The first enemy in a room (only living ones if asked), or NO_ENTITY.
+EntityId Game::enemyIn(RoomId room, bool living)
+{
+    for (EntityId entity = rooms.firstOccupant(room); entity != NO_ENTITY; entity = rooms.nextOccupant(entity)) {
+        if (entity >= firstEnemy && (!living || entities.health[entity] > 0)) {
+            return entity;
+        }
+    }
+    return NO_ENTITY;
+}
+
+void Game::setOver(bool over)
+{
+    this->gameOver = over;
+}
+
+void Game::map()
+{
+    if (world.mapLines.empty()) {
+        screen << "There is no map of this world." << '\n';
+        return;
+    }
+
+    RoomId playerRoom = player.getCurrentRoom();
+
+    // Every room name in the map gets marked: !X! if a living enemy is there, [X] if you are.
+    screen << "\n\n";
+    for (const string &line : world.mapLines) {
+        size_t pos = 0;
+        while (pos < line.size()) {
+            if (line[pos] == ' ') {
+                screen << ' ';
+                pos++;
+                continue;
+            }
+            size_t end = min(line.find(' ', pos), line.size());
+            string_view word(line.data() + pos, end - pos);
+            RoomId room = world.findRoom(word);
+
+            if (room != NO_ROOM && enemyIn(room, true) != NO_ENTITY) {
+                screen << '!' << word << '!';
+            } else if (room != NO_ROOM && room == playerRoom) {
+                screen << '[' << word << ']';
+            } else {
+                screen << word;
+            }
+            pos = end;
+        }
+        screen << '\n';
+    }
+}
+
+void Game::info()
+{
+    screen << "Available commands:" << '\n';
+    screen << " - take <Item name>" << '\n';
+    screen << " - drop <Item name>" << '\n';
+    screen << " - attack          " << '\n';
+    screen << " - go <direction>"   << '\n';
+    screen << " - travel <room>"    << '\n';
+    screen << " - teleport"         << '\n';
+    screen << " - undo"             << '\n';
+    screen << " - save <slot>"      << '\n';
+    screen << " - load <slot>"      << '\n';
+    screen << " - map"              << '\n';
+    screen << " - info"             << '\n';
+}
+
+void Game::stats()
+{
+    if (!DispatchProfile::enabled()) {
+        screen << "Nothing is being measured: start the game with --profile." << '\n';
+        return;
+    }
+    screen << DispatchProfile::get().report();
+}
+
+void Game::take(string_view item)
+{
+    RoomId currentRoom = player.getCurrentRoom();
+    ItemId id = ItemCatalog::lookup(item);
+    bool isItem = rooms.removeItem(currentRoom, id);
+
+    if(isItem == false){
+        screen << "Item is not in this Room" << '\n';
+    }else if(isItem){
+        screen << "Added " << item << " to your inventory." << '\n';
+        player.addItem(id);
+        screen << "Item " << item << " has been picked up" << '\n';
+        Rules::Taken taken = Rules::take(item == Rules::CURSED_ITEM,
+                                         player.isItemInCharacter(ItemCatalog::lookup(Rules::POTION_ITEM)),
+                                         player.getHealth());
+        if(taken.cursed){
+            screen << "You have opened a cursed book, you lose " << Rules::HURT << " health." << '\n';
+            // Straight away, not posted: the potion below heals what the book took, queued or not.
+            EntityId hero = player.getId();
+            events.trigger(Events::hurt, hero);
+        }
+
+        if(taken.potion == Rules::FULL){
+            screen << "Health is Full" << '\n';
+        }else if(taken.potion == Rules::TOO_HIGH){
+            screen << "Health is too high" << '\n';
+        }else if(taken.potion == Rules::HEALS){
+//4) Unary operator overloading */
+            ++player;
+        }
+    }
+}
+
+void Game::drop(string_view item)
+{
+    ItemId id = ItemCatalog::lookup(item);
+
+    if (!player.removeItem(id)) {
+        screen << "You don't have " << item << '\n';
+    } else {
+        rooms.addItem(player.getCurrentRoom(), id);
+        screen << "Dropped " << item << '\n';
+    }
+}
+
+void Game::attack(string_view name)
+{
+    RoomId playerRoom = player.getCurrentRoom();
+
+    if(enemyIn(playerRoom, false) == NO_ENTITY){
+        screen << "\nNo enemy in the room to attack" << '\n';
+        return;
+    }
+
+    // The first living enemy here with that name (or a dead one if that's all there is).
+    EntityId target = NO_ENTITY;
+    for (EntityId enemy = rooms.firstOccupant(playerRoom); enemy != NO_ENTITY; enemy = rooms.nextOccupant(enemy)) {
+        if (enemy >= firstEnemy && entities.getName(enemy) == name) {
+            target = enemy;
+            if (entities.health[enemy] > 0) {
+                break;
+            }
+        }
+    }
+    if (target == NO_ENTITY) {
+        return;
+    }
+
+    if(entities.health[target] <= 0){
+        screen << "\nNo enemy in the room to attack" << '\n';
+    }else{
+        screen << "\n""Attacking " << name << '\n';
+        Rules::Blow blow = Rules::attack(entities.health[target], entities.damage[target]);
+        if(blow.killed){
+            // Making a bag can move the others, so both are made before either is held on to.
+            entities.inventoryOf(target);
+            ItemBag &items = player.getItems();
+            ItemBag &loot = entities.inventoryOf(target);
+            for (ItemId item : loot.kinds()) {
+                for(size_t i = 0; i < (size_t) loot.count(item); i++){
+                    screen << "You killed the " << name << ", and picked up it's Items -> " << ItemCatalog::name(item) << '\n';
+                }
+            }
+//5) Binary operator overloading */
+            items = items + loot;
+        }
+        entities.setHealth(target, blow.health);
+    }
+}
+
+void Game::go(Direction direction)
+{
+    RoomId playerRoom = player.getCurrentRoom();
+    RoomId next = rooms.getExit(playerRoom, direction);
+
+    // Only a living enemy keeps you in (the ghost walks in every turn now, and used to stay
+    // there for good once killed).
+    bool guarded = enemyIn(playerRoom, true) != NO_ENTITY;
+
+    switch (Rules::go(next, world.lockedRoom, player.isItemInCharacter(lockKey), guarded)) {
+    case Rules::MOVED: {
+        player.setCurrentRoom(next);
+//3) Template */
+        player.setStamina<double>(player.getStamina() - Rules::GO_STAMINA);
+        events.post(Events::enterRoom, next);
+        break;
+    }
+    case Rules::LOCKED:
+        screen << "Cannot enter room, it is locked." << '\n';
+        break;
+    case Rules::GUARDED: {
+        EntityId hero = player.getId();
+        events.post(Events::hurt, hero);
+        screen << "You must kill the enemy before you can leave the room." << '\n';
+        break;
+    }
+    case Rules::WALL:
+        screen << "You hit a wall" << '\n';
+        break;
+    }
+}
+
+// The wandering enemies the player isn't fighting take a step (once a turn, see the patrol timer).
+void Game::patrol()
+{
+    RoomId playerRoom = player.getCurrentRoom();
+    for (EntityId enemy = firstEnemy; enemy < entities.size(); enemy++) {
+        if (entities.wanders[enemy] && entities.room[enemy] != playerRoom) {
+            wander(enemy);
+        }
+    }
+}
+
+// Walks a wandering enemy one room along its way, choosing where to go next when it
+// gets there: any landmark but the start room (in small worlds, any room).
+void Game::wander(EntityId enemy)
+{
+    RoomId here = entities.room[enemy];
+    if (here == NO_ROOM) {
+        return;
+    }
+    Direction direction = Rules::wander(router, world.start, here, entities.destination[enemy], random);
+    if (direction != NO_DIRECTION) {
+        entities.setRoom(enemy, rooms.getExit(here, direction));
+    }
+}
+
+// Goes to a room by the shortest way, one go() per room so locks, enemies and stamina work
+// just as if every step was typed. It stops early when something is in the way.
+void Game::travel(string_view name)
+{
+    RoomId to = world.findRoomIgnoringCase(name);
+    if (to == NO_ROOM) {
+        screen << "There is no room called " << name << '\n';
+        return;
+    }
+    if (player.getCurrentRoom() == to) {
+        screen << "You are already there." << '\n';
+        return;
+    }
+    if (!router.route(player.getCurrentRoom(), to, route)) {
+        screen << "You can't get to " << name << " from here." << '\n';
+        return;
+    }
+
+    for (size_t step = 1; step < route.size() && !gameOver; step++) {
+        RoomId here = player.getCurrentRoom();
+        go(rooms.directionTo(here, route[step]));
+        if (player.getCurrentRoom() == here || enemyIn(player.getCurrentRoom(), true) != NO_ENTITY) {
+            break;
+        }
+    }
+}
+
+void Game::teleport()
+{
+    Rules::Landing landing = Rules::teleport(rooms.size(), player.getStamina(), random);
+    player.setCurrentRoom(landing.room);
+//3) Template */
+    player.setStamina <int> (landing.stamina);
+    events.post(Events::enterRoom, landing.room);
+}
+
+bool Game::is_over()
+{
+    return gameOver;
+}
+
+bool Game::isGoal(RoomId room)
+{
+    return world.goal != NO_ROOM && room == world.goal;
+}
+
+Character &Game::getPlayer()
+{
+    return player;
+}
+
+EntityStore &Game::getEntities()
+{
+    return entities;
+}
+
+EventManager &Game::getEvents()
+{
+    return events;
+}
+
+void Game::setSeed(uint64_t seed)
+{
+    random.seed(seed);
+}
+
+const RoomArena &Game::getRooms() const
+{
+    return rooms;
+}
+
+Screen &Game::getScreen()
+{
+    return screen;
+}
+
+void Game::update_screen()
+{
+    if (!gameOver) {
+        RoomId currentRoom = player.getCurrentRoom();
+
+        screen << '\n';
+        screen << "You are in " << rooms.getName(currentRoom) << '\n';
+
+        screen << "Exits:";
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            if (rooms.getExit(currentRoom, (Direction) direction) != NO_ROOM) {
+                screen << ' ' << DIRECTION_NAMES[direction];
+            }
+        }
+        screen << '\n';
+
+        met.clear();
+        for (EntityId enemy = rooms.firstOccupant(currentRoom); enemy != NO_ENTITY; enemy = rooms.nextOccupant(enemy)) {
+            if (enemy >= firstEnemy && entities.health[enemy] > 0) {
+                met.push_back(enemy);
+            }
+        }
+        // In the world's order, not the order they walked in.
+        sort(met.begin(), met.end());
+
+        if(!met.empty()){
+//10) Static dispatch */
+           for (EntityId enemy : met) {
+               screen << "You have met a " << entities.getName(enemy) << " in this Room." << '\n';
+           }
+           screen << "Player: " << player.getName() << " HP: " << player.getHealth() << " ST: " << player.getStamina() << '\n';
+           for (EntityId enemy : met) {
+               screen << "Enemy: " << entities.getName(enemy) << " HP: " << entities.health[enemy] << " ST: " << entities.stamina[enemy] << '\n';
+           }
+           screen << rooms.displayItems(currentRoom) << '\n';
+       }else {
+           screen << "HP: " << player.getHealth() << " ST: " << player.getStamina() << '\n';
+           screen << rooms.displayItems(currentRoom) << '\n';
+       }
+   }else{
+//10) Dynamic dispatch */
+            Items testItem(TEST_ITEM);
+            pvc = &testItem;
+            pvc->virtualExample(screen);
+            
+            vc = &testChar;
+            vc->check(screen);
+            vc->change(screen);
+            
+            screen << "Type \"restart\" or \"exit\"." << '\n';
+   }
+}
+
+// Replay.cpp
+// Runs a command script as fast as possible with no prompt and no screen output,
+// then reports throughput and per-command latency. "repeat" plays the script that many times.
+void replay(Game &game, istream &script, int repeat)
+{
+    EventManager &eventManager = game.getEvents();
+
+    string commands((istreambuf_iterator<char>(script)), istreambuf_iterator<char>());
+    vector<unsigned long long> latencies;
+
+    game.getScreen().setOutput(-1);
+
+    unsigned long long eventsBefore = eventManager.dispatched();
+    auto start = chrono::steady_clock::now();
+    for (int pass = 0; pass < repeat; pass++) {
+        // Every pass plays the script from the start of a new game, even if the last one
+        // ended it with "exit". The restart is played as a command so a journal sees it too.
+        if (pass > 0) {
+            eventManager.resume();
+            eventManager.handle_line("restart", -1);
+        }
+        istringstream input(commands);
+        eventManager.set_input(input, false);
+        while (eventManager.is_running() && eventManager.read_input()) {
+            auto before = chrono::steady_clock::now();
+            eventManager.handle_input();
+            latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - before).count());
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    unsigned long long events = eventManager.dispatched() - eventsBefore;
+
+    eventManager.set_input(cin, true);
+
+    sort(latencies.begin(), latencies.end());
+    size_t count = latencies.size();
+    cout << "Replayed " << count << " commands in " << seconds << " s" << endl;
+    if (count > 0) {
+        cout << "  commands/s: " << count / seconds << endl;
+        cout << "  events/s:   " << events / seconds << endl;
+        cout << "  p50:        " << latencies[count / 2] << " ns" << endl;
+        cout << "  p99:        " << latencies[min(count - 1, count * 99 / 100)] << " ns" << endl;
+    }
+}
+
+// Server.h
+/** One player's game, played over one connection. */
+struct Session
+{
+    Session(const World &world, int fd, bool queued);
+
+    EventManager events;
+    Game         game;
+};
 
-// A listener for the good ending
-class AttackListener: public EventListener
+/** A game per connection, for thousands of players in one process. Connections are accepted
+ *  on the calling thread and dealt out to the worker threads in turn. Each worker has its own
+ *  poller and sessions and never touches another's: all they share is the world and the event
+ *  and item name tables, all read only (the tables are frozen before the server starts). */
+class Server : public SessionHost
 {
 public:
-    AttackListener(Game *game);
-    void run(void *args) override;
-private:
-    Game *game;
-};
+    Server(const World &world, int workers, bool queued);
+    ~Server();
 
-class Game;
+    Server(Server const& copy);            // Not Implemented (Copy constructor)
+    Server& operator=(Server const& copy); // Not Implemented (Assignment operator)
 
-class TakeListener : public EventListener
-{
+    bool listenTcp(int port, string &error);
+    bool listenUnix(const string &path, string &error);
+    int tcpPort();
+
+    // Starts the workers and accepts connections until stop(). False if they can't start.
+    bool run(string &error);
+    void stop();
+
+    // Passes a new connection on to the next worker (on the accepting thread).
+    void accepted(int fd) override;
+    void closed(EventManager *session) override;
+
+    // Sessions open right now (over every worker).
+    size_t sessions() const;
+
+    // Prints the number of sessions and the memory they take, if it changed.
+    void report();
+
+private:
+    /** A thread with its own sessions. */
+    class Worker : public SessionHost
+    {
     public:
-        TakeListener(Game *game);
-        void run(void *args) override;
+        Worker(const World &world, bool queued);
+
+        bool start(string &error);
+        void hand(int fd);      // called from the accepting thread
+        void stop();            // stops the thread and waits for it
+
+        void accepted(int fd) override;
+        void closed(EventManager *session) override;
+
+        atomic<size_t> count;   // sessions, read by report()
+
     private:
-        Game *game;
+        void run();
+
+        const World &world;
+        bool         queued;
+        bool         running;
+        Poller       poller;
+        int          handoff[2];    // accepted fds come in here
+        thread       worker;
+        unordered_map<EventManager *, unique_ptr<Session> > open;
+    };
+
+    const World &world;
+    EventManager events;            // the accepting thread's: its poller and the report timer
+    vector<unique_ptr<Worker> > workers;
+    size_t       nextWorker;
+    size_t       baseline;          // memory before any session
+    size_t       reported;          // sessions at the last report
+    size_t       peak;              // most sessions at once
 };
 
-//CPP FILES
+// ReportListener.h
+// A listener for the server's report timer
+class ReportListener final : public Listener<NoPayload>
+{
+public:
+    ReportListener(Server *server);
+    void run(NoPayload &payload) override;
+private:
+   Server *server;
+};
 
-EventManager::EventManager()
+// Server.cpp
+// Resident memory of this process, in bytes.
+static size_t residentMemory()
 {
-    running = true;
+    size_t pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm != nullptr) {
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
 }
 
-EventManager &EventManager::getInstance()
+Session::Session(const World &world, int fd, bool queued) :
+    game(world, events, fd)
 {
-    // static inside functions creates an instance of this variable for all the calls of this function, 
-    //and initializes only once.
-    static EventManager instance;
-    return instance;
+    events.setQueued(queued);
+    game.setSlotsAllowed(false);
 }
 
-void EventManager::listen(string event_name, EventListener *listener)
+Server::Worker::Worker(const World &world, bool queued) :
+    count(0),
+    world(world),
+    queued(queued),
+    running(true)
 {
-    registeredEvents[tolower(event_name)].push_back(listener);
+    handoff[0] = handoff[1] = -1;
 }
 
-void EventManager::trigger(string event_name, void *args)
+bool Server::Worker::start(string &error)
 {
-    for (auto listener : registeredEvents[tolower(event_name)]) {
-        listener->run(args);
+    if (pipe2(handoff, O_CLOEXEC) < 0) {
+        error = string("can't start a worker: ") + strerror(errno);
+        return false;
+    }
+    poller.setHost(this);
+    if (!poller.addHandoff(handoff[0], error)) {
+        return false;
     }
+    worker = thread(&Worker::run, this);
+    return true;
 }
 
-bool EventManager::is_running()
+void Server::Worker::run()
 {
-    return running;
+    while (running && poller.poll(-1)) {
+    }
 }
 
-void EventManager::stop()
+void Server::Worker::hand(int fd)
 {
-    running = false;
+    // An int is far below PIPE_BUF, so it's never written in halves.
+    if (write(handoff[1], &fd, sizeof(fd)) != sizeof(fd)) {
+        close(fd);
+    }
 }
 
-void EventManager::check_events()
+void Server::Worker::stop()
 {
-    string buffer;
-    vector<string> words;
-
-    cout << "> ";               // print prompt
-    getline(cin, buffer, '\n');	// read a line from cin to "buffer"
-    buffer = tolower(buffer);
-
-    string::size_type pos = 0, last_pos = 0;
-
-    // Break "buffer" up by spaces
-    bool finished = false;
-    while (!finished) {
-        pos = buffer.find_first_of(' ', last_pos);	// find and remember first space.
-        if (pos == string::npos ) {			// if we found the last word,
-            words.push_back(buffer.substr(last_pos));	// add it to vector "words"
-            finished = true;				// and finish searching.
-        } else {					// otherwise add to vector and move on to next word.
-            words.push_back(buffer.substr(last_pos, pos - last_pos));
-            last_pos = pos + 1;
-        }
+    if (!worker.joinable()) {
+        return;
     }
-
-    trigger("input", &words);
+    int done = -1;
+    if (write(handoff[1], &done, sizeof(done)) == sizeof(done)) {
+        worker.join();
+    } else {
+        worker.detach();
+    }
+    close(handoff[1]);      // (the read end is the poller's, which closes it)
 }
 
-void EventManager::event_loop()
+void Server::Worker::accepted(int fd)
 {
-    EventManager &eventManager = EventManager::getInstance();
+    if (fd < 0) {
+        running = false;    // told to stop
+        open.clear();
+        count = 0;
+        return;
+    }
 
-    while (eventManager.is_running()) {
-        eventManager.check_events();
+    unique_ptr<Session> session(new Session(world, fd, queued));
+    string error;
+    if (!poller.addInput(fd, fd, true, &session->events, error)) {
+        close(fd);
+        return;
     }
+    open.emplace(&session->events, move(session));
+    count = open.size();
 }
 
-InputListener::InputListener(Game *game)
+void Server::Worker::closed(EventManager *session)
 {
-    this->game = game;
+    open.erase(session);
+    count = open.size();
 }
 
-void InputListener::run(void *args_ptr)
+Server::Server(const World &world, int workers, bool queued) :
+    world(world),
+    nextWorker(0),
+    baseline(0),
+    reported(0),
+    peak(0)
 {
-    // Let's make this thing a bit safer by "translating" the pointer back to what we expect
-    // This is exactly what makes this "void *" pointer dangerous.
-    vector<string> *args = (vector<string> *) args_ptr;
-
-    EventManager &eventManager = EventManager::getInstance();
+    for (int i = 0; i < max(1, workers); i++) {
+        this->workers.emplace_back(new Worker(world, queued));
+    }
+    events.getPoller().setHost(this);
+    events.getPoller().followClock(&events);
+}
 
-    if (args->size() > 0) {
-        // If arg[0] is "input", we are going to ignore the input.
-        // If we do not ignore the input, it's an infinite loop.
-        if (args->at(0) == "input") {
-            return;
-        }
+Server::~Server()
+{
+    for (auto &worker : workers) {
+        worker->stop();
+    }
+}
 
-        eventManager.trigger(args->at(0), args);
+bool Server::listenTcp(int port, string &error)
+{
+    return events.getPoller().listenTcp(port, &events, error);
+}
 
-        if (eventManager.is_running()) {
-            game->update_screen();
-        }
-    } else {
-        eventManager.trigger("no_command", nullptr);
-    }
+bool Server::listenUnix(const string &path, string &error)
+{
+    return events.getPoller().listenUnix(path, &events, error);
 }
 
-TeleportListener::TeleportListener(Game *game)
+int Server::tcpPort()
 {
-    this->game = game;
+    return events.getPoller().tcpPort();
 }
 
-void TeleportListener::run(void *)
+bool Server::run(string &error)
 {
-    if (game->is_over()) {
-        return;
+    for (auto &worker : workers) {
+        if (!worker->start(error)) {
+            return false;
+        }
     }
 
-    this->game->teleport();
+    baseline = residentMemory();
+    events.listen(Events::report, new ReportListener(this));
+    events.schedule(Events::report, 5000, 5000, EventManager::MILLISECONDS);
+    while (events.is_running() && events.getPoller().poll(-1)) {
+    }
+    return true;
 }
 
-RestartListener::RestartListener(Game *game)
+void Server::stop()
 {
-    this->game = game;
+    events.stop();
 }
 
-void RestartListener::run(void *)
+void Server::accepted(int fd)
 {
-    game->reset(false);
+    workers[nextWorker]->hand(fd);
+    nextWorker = (nextWorker + 1) % workers.size();
 }
 
-TakeListener::TakeListener(Game *game)
+void Server::closed(EventManager *)
 {
-    this->game = game;
 }
 
-void TakeListener::run(void *args_ptr)
+size_t Server::sessions() const
 {
-    if (game->is_over()) {
-        return;
+    size_t total = 0;
+    for (const auto &worker : workers) {
+        total += worker->count;
     }
+    return total;
+}
 
-    vector<string> *args = (vector<string> *) args_ptr;
+void Server::report()
+{
+    size_t count = sessions();
+    if (count == reported) {
+        return;
+    }
+    reported = count;
 
-    if (args->size() > 1) {
-        game->take(args->at(1));
-    } else {
-        cout << "Need an Item name" << endl;
+    // Freed sessions' memory stays with the process, so per session only means something at a peak.
+    size_t memory = residentMemory();
+    cerr << "Sessions: " << count << ", memory: " << memory / (1024 * 1024) << " MB";
+    if (count > peak && memory > baseline) {
+        cerr << " (" << (memory - baseline) / count << " bytes per session)";
     }
+    cerr << endl;
+    peak = max(peak, count);
 }
 
+ReportListener::ReportListener(Server *server)
+{
+    this->server = server;
+}
 
-EnterRoomListener::EnterRoomListener(Game *game)
+void ReportListener::run(NoPayload &)
 {
-    this->game = game;
+    server->report();
 }
 
-void EnterRoomListener::run(void *args)
+// Simulator.h
+/** Plays a world over and over with nobody watching, to see how it plays: how many games are
+ *  won or lost, and how many turns a win takes. Every worker thread has one headless game of
+ *  its own (with its own EventManager) that reset() puts back to the start between games, so
+ *  nothing is shared but the World, and nothing is printed.
+ *
+ *  Game number i always plays from the same seed, whichever thread it lands on, so the same
+ *  seed gives the same totals on any number of threads. Threads take games from their own
+ *  range a few at a time; one that runs out steals half of the biggest range left. */
+class Simulator
 {
-    if (game->is_over()) {
-        return;
-    }
+public:
+    // RANDOM: any command that does something in the game. EXPLORE: attacks whoever is in the
+    // room, picks up whatever lies there, and otherwise leaves by a random exit.
+    enum Policy { RANDOM, EXPLORE };
 
-    Room *room = (Room *) args;
+    Simulator(const World &world, Policy policy, uint64_t seed, int maxTurns = 500);
 
-    if (room->getName() == "J") {
-        EventManager::getInstance().trigger("victory");
-    }
-}
+    Simulator(Simulator const& copy);            // Not Implemented (Copy constructor)
+    Simulator& operator=(Simulator const& copy); // Not Implemented (Assignment operator)
 
-CharacterDeathListener::CharacterDeathListener(Game *game)
+    // Plays that many games on that many threads and prints how they went.
+    void run(uint64_t games, int threads);
+
+    // "random" or "explore".
+    static bool parsePolicy(string_view name, Policy &policy);
+
+    enum Outcome { PLAYING, WON, LOST };
+
+private:
+    struct Totals
+    {
+        uint64_t         won;
+        uint64_t         lost;
+        uint64_t         unfinished;    // still going after maxTurns
+        uint64_t         turns;
+        vector<uint64_t> winTurns;      // [t]: games won in t turns
+    };
+
+    // A worker's games [first, last) in one word (first in the high half), so that taking
+    // from the front and stealing from the back are each a single compare-and-swap.
+    struct alignas(64) Range
+    {
+        atomic<uint64_t> games;
+    };
+
+    static constexpr uint64_t CHUNK = 16;
+
+    void work(int worker, Totals &totals);
+    bool next(int worker, uint64_t &first, uint64_t &last);
+    void choose(Game &game, Random &random, string &command);
+
+    const World       &world;
+    Policy             policy;
+    uint64_t           seed;
+    int                maxTurns;
+    vector<string>     commands;    // what RANDOM picks from
+    unique_ptr<Range[]> ranges;
+    int                threads;
+};
+
+// OutcomeListener.h
+// A listener for how a simulated game ends
+class OutcomeListener final : public Listener<NoPayload>
 {
-    this->game = game;
+public:
+    OutcomeListener(Simulator::Outcome *outcome, Simulator::Outcome value);
+    void run(NoPayload &payload) override;
+private:
+    Simulator::Outcome *outcome;
+    Simulator::Outcome  value;
+};
+
+// Simulator.cpp
+static uint64_t packRange(uint64_t first, uint64_t last)
+{
+    return first << 32 | last;
 }
 
-void CharacterDeathListener::run(void *args)
+Simulator::Simulator(const World &world, Policy policy, uint64_t seed, int maxTurns) :
+    world(world),
+    policy(policy),
+    seed(seed),
+    maxTurns(maxTurns),
+    threads(0)
 {
-    if (game->is_over()) {
-        return;
+    // Every command that can change something: moving, and taking or fighting whatever
+    // the world has (the items enemies drop included).
+    for (const char *direction : DIRECTION_NAMES) {
+        commands.push_back(string("go ") + direction);
     }
-
-    Character *character = (Character *) args;
-
-    if (character->getName() == game->getPlayer().getName()) {
-        EventManager::getInstance().trigger("defeat");
+    commands.push_back("teleport");
+    for (const ItemSpec &item : world.items) {
+        commands.push_back("take " + item.name);
+    }
+    for (const EnemySpec &enemy : world.enemies) {
+        commands.push_back("attack " + enemy.name);
+        for (const string &loot : enemy.loot) {
+            commands.push_back("take " + loot);
+        }
     }
+    sort(commands.begin(), commands.end());
+    commands.erase(unique(commands.begin(), commands.end()), commands.end());
 }
 
-GoListener::GoListener(Game *game)
+bool Simulator::parsePolicy(string_view name, Policy &policy)
 {
-    this->game = game;
-    direction  = "";
+    if (name == "random") {
+        policy = RANDOM;
+    } else if (name == "explore") {
+        policy = EXPLORE;
+    } else {
+        return false;
+    }
+    return true;
 }
 
-void GoListener::run(void *args_ptr)
+void Simulator::run(uint64_t games, int threads)
 {
-    if (game->is_over()) {
-        return;
+    games = min<uint64_t>(games, UINT32_MAX);
+    this->threads = threads;
+    ranges.reset(new Range[threads]);
+    for (int i = 0; i < threads; i++) {
+        ranges[i].games = packRange(games * i / threads, games * (i + 1) / threads);
     }
 
-    vector<string> *args = (vector<string> *) args_ptr;
+    vector<Totals> totals(threads, Totals{0, 0, 0, 0, vector<uint64_t>(maxTurns + 1)});
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(&Simulator::work, this, i, ref(totals[i]));
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    Totals all = {0, 0, 0, 0, vector<uint64_t>(maxTurns + 1)};
+    for (const Totals &each : totals) {
+        all.won        += each.won;
+        all.lost       += each.lost;
+        all.unfinished += each.unfinished;
+        all.turns      += each.turns;
+        for (int turn = 0; turn <= maxTurns; turn++) {
+            all.winTurns[turn] += each.winTurns[turn];
+        }
+    }
 
-    if (args->size() > 1) {
-        game->go(args->at(1));
-    } else {
-        cout << "Need a direction!" << endl;
+    // The turn by which that share of the wins had happened.
+    auto percentile = [&](double share) {
+        uint64_t wanted = max<uint64_t>(1, ceil(all.won * share)), seen = 0;
+        for (int turn = 0; turn <= maxTurns; turn++) {
+            seen += all.winTurns[turn];
+            if (seen >= wanted) {
+                return turn;
+            }
+        }
+        return maxTurns;
+    };
+    auto percent = [&](uint64_t count) {
+        return games > 0 ? 100.0 * count / games : 0.0;
+    };
+
+    cout << games << " games (" << (policy == RANDOM ? "random" : "explore") << ", seed " << seed << ", "
+         << threads << " thread(s), at most " << maxTurns << " turns)" << endl;
+    cout << "  won:        " << all.won << " (" << percent(all.won) << "%)" << endl;
+    cout << "  lost:       " << all.lost << " (" << percent(all.lost) << "%)" << endl;
+    cout << "  unfinished: " << all.unfinished << " (" << percent(all.unfinished) << "%)" << endl;
+    if (all.won > 0) {
+        uint64_t winning = 0;
+        for (int turn = 0; turn <= maxTurns; turn++) {
+            winning += all.winTurns[turn] * turn;
+        }
+        cout << "  turns to win: mean " << (double) winning / all.won << ", p10 " << percentile(0.1)
+             << ", p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", max " << percentile(1.0) << endl;
     }
+    cout << "  " << games / seconds << " games/s, " << all.turns / seconds << " turns/s" << endl;
 }
 
-VictoryListener::VictoryListener(Game *game)
+void Simulator::work(int worker, Totals &totals)
 {
-    this->game = game;
+    EventManager events;
+    Game game(world, events, -1);
+    Outcome outcome = PLAYING;
+    OutcomeListener won(&outcome, WON), lost(&outcome, LOST);
+    events.listen(Events::victory, &won);
+    events.listen(Events::defeat, &lost);
+
+    string command;
+    uint64_t first, last;
+    while (next(worker, first, last)) {
+        for (uint64_t index = first; index < last; index++) {
+            // The game's own numbers and the policy's come from the game's number alone.
+            Random random(seed + index);
+            game.reset(false);
+            game.setSeed(random.next());
+
+            outcome = PLAYING;
+            int turns = 0;
+            while (outcome == PLAYING && turns < maxTurns) {
+                choose(game, random, command);
+                events.handle_line(command, -1);
+                turns++;
+            }
+            totals.turns += turns;
+            if (outcome == WON) {
+                totals.won++;
+                totals.winTurns[turns]++;
+            } else if (outcome == LOST) {
+                totals.lost++;
+            } else {
+                totals.unfinished++;
+            }
+        }
+    }
 }
 
-void VictoryListener::run(void *)
+// The next few games for a worker: from the front of its own range, or else from the back
+// half of whichever range has the most left. False once every range is empty.
+bool Simulator::next(int worker, uint64_t &first, uint64_t &last)
 {
-    cout << endl;
-    cout << "Victory!" << endl;
-    game->setOver(true);
-}
+    atomic<uint64_t> &own = ranges[worker].games;
+    uint64_t games = own.load();
+    while ((games >> 32) < (uint32_t) games) {
+        first = games >> 32;
+        last  = min(first + CHUNK, games & UINT32_MAX);
+        if (own.compare_exchange_weak(games, packRange(last, games & UINT32_MAX))) {
+            return true;
+        }
+    }
 
-// DefeatListener.cpp
-DefeatListener::DefeatListener(Game *game)
-{
-    this->game = game;
+    for (;;) {
+        int victim = -1;
+        uint64_t most = 0;
+        for (int i = 0; i < threads; i++) {
+            uint64_t range = ranges[i].games.load();
+            uint64_t left = (uint32_t) range - (range >> 32);
+            if ((range >> 32) < (uint32_t) range && left > most) {
+                victim = i;
+                most   = left;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+
+        uint64_t range = ranges[victim].games.load();
+        uint64_t from = range >> 32, to = range & UINT32_MAX;
+        if (from >= to) {
+            continue;       // emptied since we looked
+        }
+        uint64_t middle = from + (to - from) / 2;
+        if (ranges[victim].games.compare_exchange_strong(range, packRange(from, middle))) {
+            // Ours is empty, so nobody else touches it: the stolen half becomes our range.
+            first = middle;
+            last  = min(middle + CHUNK, to);
+            own.store(packRange(last, to));
+            return true;
+        }
+    }
 }
 
-void DefeatListener::run(void *)
+void Simulator::choose(Game &game, Random &random, string &command)
 {
-    cout << endl;
-    cout << "Defeat!" << endl;
-    game->setOver(true);
-}
+    if (policy == RANDOM) {
+        command = commands[random.below(commands.size())];
+        return;
+    }
 
+    const RoomArena &rooms = game.getRooms();
+    EntityStore &entities = game.getEntities();
+    RoomId here = game.getPlayer().getCurrentRoom();
+    EntityId player = game.getPlayer().getId();
+    for (EntityId other = rooms.firstOccupant(here); other != NO_ENTITY; other = rooms.nextOccupant(other)) {
+        if (other != player && entities.health[other] > 0) {
+            command.assign("attack ").append(entities.getName(other));
+            return;
+        }
+    }
+    const ItemBag *items = rooms.itemsIn(here);
+    if (items != nullptr && !items->empty()) {
+        command.assign("take ").append(ItemCatalog::name(items->kinds()[0]));
+        return;
+    }
 
-MapListener::MapListener(Game *game)
-{
-    this->game = game;
+    Direction exits[DIRECTION_COUNT];
+    int count = 0;
+    for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+        if (rooms.getExit(here, (Direction) direction) != NO_ROOM) {
+            exits[count++] = (Direction) direction;
+        }
+    }
+    if (count == 0) {
+        command = "teleport";
+        return;
+    }
+    command.assign("go ").append(DIRECTION_NAMES[exits[random.below(count)]]);
 }
 
-void MapListener::run(void *)
+OutcomeListener::OutcomeListener(Simulator::Outcome *outcome, Simulator::Outcome value)
 {
-    game->map();
+    this->outcome = outcome;
+    this->value   = value;
 }
 
-InfoListener::InfoListener(Game *game)
+void OutcomeListener::run(NoPayload &)
 {
-    this->game = game;
+    *outcome = value;
 }
 
-void InfoListener::run(void *)
+// Solver.h
+/** Finds the fewest commands that win a game from the start, or shows that nothing does. It
+ *  solves one seed: wandering characters and teleport draw from the game's generator, which is
+ *  part of the state, so the answer plays out exactly the same in a game with that --seed.
+ *
+ *  A state (the player's room, health, stamina and inventory, the generator, every enemy's
+ *  health, room and destination, the items taken from rooms) is packed into a string of
+ *  words and kept in a transposition table, so each one is expanded once. The search goes
+ *  breadth-first, a turn per layer, with each layer's states shared out between threads.
+ *  A state that can't walk to the goal on the stamina it has left (and can't teleport) is
+ *  dropped, which never loses a win.
+ *
+ *  step() is a turn without a game: no printing, no events, just the Rules. Only commands that
+ *  change something are tried; waiting and dropping can't help under these rules. So every
+ *  turn uses up stamina, health, items or enemy health, and the search always ends, though
+ *  with many characters about it can take more states than fit: it gives up when they take
+ *  more memory than it was given. */
+class Solver
 {
-    game->info();
-}
+public:
+    Solver(const World &world, uint64_t seed);
 
-ExitListener::ExitListener(Game *game)
-{
-    this->game = game;
-}
+    Solver(Solver const& copy);            // Not Implemented (Copy constructor)
+    Solver& operator=(Solver const& copy); // Not Implemented (Assignment operator)
 
-void ExitListener::run(void *)
-{
-    EventManager::getInstance().stop();
-}
+    enum Answer { WINS, CANNOT_WIN, GAVE_UP };
 
-HurtListener::HurtListener(Game *game)
-{
-    this->game = game;
-}
+    // Searches on that many threads, in about "budget" bytes of states. WINS: "commands" says how.
+    Answer solve(int threads, size_t budget, vector<string> &commands);
+
+    // Plays the commands in a real game with the same seed. True if the last one wins it.
+    bool check(const vector<string> &commands) const;
+
+    size_t statesSeen() const;
+
+private:
+    struct Enemy
+    {
+        int32_t health;
+        RoomId  room;
+        RoomId  destination;
+    };
+    struct State
+    {
+        RoomId                        room;
+        int32_t                       health;
+        int32_t                       halfStamina;  // stamina only ever changes by halves
+        Random::State                 random;
+        vector<pair<ItemId, uint32_t> > inventory;  // sorted by item
+        vector<pair<RoomId, ItemId> > taken;        // picked up from rooms, sorted
+        vector<Enemy>                 enemies;      // in the world's order
+    };
+
+    // An action is its kind in the top bits and a direction, item or enemy below.
+    enum Kind : uint32_t { GO, TELEPORT, TAKE, ATTACK };
+    typedef uint32_t Action;
+    static Action action(Kind kind, uint32_t what);
+
+    enum Result { NOTHING, PLAYING, WON, LOST };
+
+    // A search thread's own routing for the wanderers (Router caches, so it isn't shared).
+    struct Walker
+    {
+        RoomArena rooms;
+        Router    router;
+    };
+
+    Result step(State &state, Action action, Walker &walker) const;
+    void   actions(const State &state, vector<Action> &list) const;
+    string command(Action action) const;
+    bool   hopeless(const State &state) const;
+    int    itemsLeft(const State &state, RoomId room, ItemId item) const;
+    static void addItem(vector<pair<ItemId, uint32_t> > &inventory, ItemId item, uint32_t count = 1);
+    static bool carries(const State &state, ItemId item);
+
+    void pack(const State &state, string &packed) const;
+    void unpack(const string &packed, State &state) const;
+
+    // The transposition table, in shards with a lock each.
+    static constexpr size_t SHARDS = 64;
+    struct alignas(64) Shard
+    {
+        mutex                 lock;
+        unordered_set<string> states;
+    };
+    bool firstTime(const string &packed);
+
+    const World     &world;
+    uint64_t         seed;
+    ItemId           lockKey, cursed, potion;
+    vector<uint32_t> distance;      // steps from each room to the goal (UINT32_MAX: can't)
+    unique_ptr<Shard[]> table;
+    atomic<size_t>   seen;
+    atomic<size_t>   bytes;         // what the states take, roughly (table, frontier and path)
+};
 
-void HurtListener::run(void *args)
+// Solver.cpp
+Solver::Solver(const World &world, uint64_t seed) :
+    world(world),
+    seed(seed),
+    table(new Shard[SHARDS]),
+    seen(0),
+    bytes(0)
 {
-    if (game->is_over()) {
+    lockKey = world.lockKey.empty() ? NO_ITEM : ItemCatalog::intern(world.lockKey);
+    cursed  = ItemCatalog::lookup(Rules::CURSED_ITEM);
+    potion  = ItemCatalog::lookup(Rules::POTION_ITEM);
+
+    // Walking distances to the goal, searching backwards from it.
+    RoomId rooms = world.roomCount();
+    distance.assign(rooms, UINT32_MAX);
+    if (world.goal == NO_ROOM) {
         return;
     }
-
-    Character *player = (Character *) args;
-    int health = player->getHealth();
-    int newHealth = health - 10;
-    player->setHealth(newHealth);
+    vector<uint32_t> start(rooms + 1, 0);
+    vector<RoomId> from;
+    for (RoomId room = 0; room < rooms; room++) {
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = world.exit(room, (Direction) direction);
+            if (next != NO_ROOM) {
+                start[next + 1]++;
+            }
+        }
+    }
+    for (RoomId room = 0; room < rooms; room++) {
+        start[room + 1] += start[room];
+    }
+    from.resize(start[rooms]);
+    vector<uint32_t> filled(start.begin(), start.end() - 1);
+    for (RoomId room = 0; room < rooms; room++) {
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = world.exit(room, (Direction) direction);
+            if (next != NO_ROOM) {
+                from[filled[next]++] = room;
+            }
+        }
+    }
+    vector<RoomId> queue = {world.goal};
+    distance[world.goal] = 0;
+    for (size_t at = 0; at < queue.size(); at++) {
+        RoomId room = queue[at];
+        for (uint32_t i = start[room]; i < start[room + 1]; i++) {
+            if (distance[from[i]] == UINT32_MAX) {
+                distance[from[i]] = distance[room] + 1;
+                queue.push_back(from[i]);
+            }
+        }
+    }
 }
 
-AttackListener::AttackListener(Game *game)
+Solver::Action Solver::action(Kind kind, uint32_t what)
 {
-    this->game = game;
+    return (uint32_t) kind << 28 | what;
 }
 
-void AttackListener::run(void *args_ptr)
+Solver::Answer Solver::solve(int threads, size_t budget, vector<string> &commands)
 {
-    if (game->is_over()) {
-        return;
+    commands.clear();
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+        table[shard].states.clear();
+    }
+    seen  = 0;
+    bytes = 0;
+    if (world.goal == NO_ROOM) {
+        return CANNOT_WIN;
     }
 
-    vector<string> *args = (vector<string> *) args_ptr;
+    State first;
+    first.room        = world.start;
+    first.health      = world.playerHealth;
+    first.halfStamina = world.playerStamina * 2;
+    first.random      = Random(seed).getState();
+    for (const EnemySpec &enemy : world.enemies) {
+        first.enemies.push_back(Enemy{enemy.health, enemy.room, NO_ROOM});
+    }
 
-    if (args->size() > 1) {
-        game->attack(args->at(1));
-    } else {
-        cout << "Enter enemy name" << endl;
+    // Every layer's states by how they were reached (to walk the winning path back), and the
+    // packed states of the newest layer, which get expanded next.
+    struct Reached
+    {
+        uint32_t parent;
+        Action   action;
+    };
+    vector<vector<Reached> > layers(1, vector<Reached>(1, Reached{0, 0}));
+    vector<string> frontier(1);
+    pack(first, frontier[0]);
+    firstTime(frontier[0]);
+
+    vector<Walker> walkers(threads);
+    for (Walker &walker : walkers) {
+        walker.rooms.build(world);
+        walker.router.attach(walker.rooms);
     }
-}
 
-Items::Items(){
-    description = "";
+    while (!frontier.empty()) {
+        atomic<size_t> nextChunk(0);
+        mutex          found;
+        Reached        win = {UINT32_MAX, 0};
+        vector<vector<pair<string, Reached> > > reached(threads);
+
+        auto expand = [&](int thread) {
+            State state, next;
+            vector<Action> list;
+            string packed;
+            const size_t chunk = 64;
+            for (size_t begin; bytes <= budget && (begin = nextChunk.fetch_add(chunk)) < frontier.size(); ) {
+                for (size_t index = begin; index < min(begin + chunk, frontier.size()); index++) {
+                    unpack(frontier[index], state);
+                    actions(state, list);
+                    for (Action action : list) {
+                        next = state;
+                        Result result = step(next, action, walkers[thread]);
+                        if (result == WON) {
+                            lock_guard<mutex> hold(found);
+                            if (index < win.parent || (index == win.parent && action < win.action)) {
+                                win = Reached{(uint32_t) index, action};
+                            }
+                        } else if (result == PLAYING && !hopeless(next)) {
+                            pack(next, packed);
+                            if (firstTime(packed)) {
+                                reached[thread].emplace_back(packed, Reached{(uint32_t) index, action});
+                            }
+                        }
+                    }
+                }
+            }
+        };
+        vector<thread> helpers;
+        for (int thread = 1; thread < threads; thread++) {
+            helpers.emplace_back(expand, thread);
+        }
+        expand(0);
+        for (thread &helper : helpers) {
+            helper.join();
+        }
+
+        if (win.parent != UINT32_MAX) {
+            // Back from the winning move to the start.
+            commands.push_back(command(win.action));
+            uint32_t at = win.parent;
+            for (size_t layer = layers.size() - 1; layer > 0; layer--) {
+                commands.push_back(command(layers[layer][at].action));
+                at = layers[layer][at].parent;
+            }
+            reverse(commands.begin(), commands.end());
+            return WINS;
+        }
+        if (bytes > budget) {
+            return GAVE_UP;
+        }
+
+        frontier.clear();
+        layers.emplace_back();
+        for (auto &part : reached) {
+            for (auto &state : part) {
+                frontier.push_back(move(state.first));
+                layers.back().push_back(state.second);
+            }
+        }
+    }
+    return CANNOT_WIN;
 }
 
-Items:: Items(string description)
+bool Solver::firstTime(const string &packed)
 {
-    this->description = description;   
+    Shard &shard = table[hash<string>()(packed) % SHARDS];
+    lock_guard<mutex> hold(shard.lock);
+    if (!shard.states.insert(packed).second) {
+        return false;
+    }
+    seen++;
+    // Twice (in the table and the frontier), each with a string's and a hash node's overhead.
+    bytes += 2 * (packed.size() + sizeof(string)) + 2 * sizeof(void *) + sizeof(uint32_t) * 2;
+    return true;
 }
 
-string Items::getDescription()
+size_t Solver::statesSeen() const
 {
-    return description;
+    return seen;
 }
 
-//8) Abstract classes and pure virtual functions */
-void Items::virtualExample() {
-        cout<< "Pure Virtual Function example from the Items class" << endl;
+// Game::go, teleport, take and attack, then the patrol timer: the same Rules the game calls,
+// but on a State, without printing or events.
+Solver::Result Solver::step(State &state, Action action, Walker &walker) const
+{
+    uint32_t what = action & 0x0FFFFFFF;
+    switch ((Kind) (action >> 28)) {
+    case GO: {
+        RoomId next = world.exit(state.room, (Direction) what);
+        bool guarded = false;
+        for (const Enemy &enemy : state.enemies) {
+            guarded = guarded || (enemy.room == state.room && enemy.health > 0);
+        }
+        switch (Rules::go(next, world.lockedRoom, carries(state, lockKey), guarded)) {
+        case Rules::MOVED:
+            state.room = next;
+            state.halfStamina -= (int) (Rules::GO_STAMINA * 2);
+            if (state.halfStamina <= 0) {
+                return LOST;
+            } else if (next == world.goal) {
+                return WON;
+            }
+            break;
+        case Rules::GUARDED:
+            state.health -= Rules::HURT;
+            if (state.health <= 0) {
+                return LOST;
+            }
+            break;
+        default:
+            return NOTHING;
+        }
+        break;
+    }
+    case TELEPORT: {
+        Random random;
+        random.setState(state.random);
+        Rules::Landing landing = Rules::teleport(world.roomCount(), state.halfStamina / 2.0, random);
+        state.random = random.getState();
+        state.room = landing.room;
+        state.halfStamina = 2 * landing.stamina;
+        if (state.halfStamina <= 0) {
+            return LOST;
+        } else if (state.room == world.goal) {
+            return WON;
+        }
+        break;
+    }
+    case TAKE: {
+        ItemId item = what;
+        state.taken.insert(upper_bound(state.taken.begin(), state.taken.end(), make_pair(state.room, item)),
+                           make_pair(state.room, item));
+        addItem(state.inventory, item);
+        state.health = Rules::take(item == cursed, carries(state, potion), state.health).health;
+        if (state.health == 0) {
+            return LOST;
+        }
+        break;
+    }
+    case ATTACK: {
+        Enemy &enemy = state.enemies[what];
+        const EnemySpec &spec = world.enemies[what];
+        Rules::Blow blow = Rules::attack(enemy.health, spec.damage);
+        enemy.health = blow.health;
+        if (blow.killed) {
+            for (const string &loot : spec.loot) {
+                addItem(state.inventory, ItemCatalog::intern(loot));
+            }
+        }
+        break;
+    }
     }
 
-
-//2) cascading constructors */
-Character::Character(){
-    name = "";
-    health = 100;
-    stamina = 100;
-    currentRoom = nullptr;
+    // The turn ends: the patrol timer walks the wanderers that aren't with the player.
+    Random random;
+    random.setState(state.random);
+    for (size_t i = 0; i < state.enemies.size(); i++) {
+        Enemy &enemy = state.enemies[i];
+        if (world.enemies[i].wanders && enemy.room != state.room && enemy.room != NO_ROOM) {
+            Direction direction = Rules::wander(walker.router, world.start, enemy.room, enemy.destination, random);
+            if (direction != NO_DIRECTION) {
+                enemy.room = world.exit(enemy.room, direction);
+            }
+        }
+    }
+    state.random = random.getState();
+    return PLAYING;
 }
 
-Character::Character(string name)
+// Commands worth trying: exits (the wall ones never do anything), teleport while it won't
+// kill, the items lying here, and each living enemy here (by name, the one the game picks).
+void Solver::actions(const State &state, vector<Action> &list) const
 {
-// We need to use "this->" to differentiate between the "name" argument and the "name" from the class.
-    this->name  = name;
-    health      = 100;
-    stamina     = 100;
-    currentRoom = nullptr;
-}
-
-//9) Initializer list */
-Character::Character(string n, int h, int s) : name(n), health(h), stamina(s){}
+    list.clear();
+    for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+        if (world.exit(state.room, (Direction) direction) != NO_ROOM) {
+            list.push_back(action(GO, direction));
+        }
+    }
+    if (state.halfStamina / 2 - Rules::TELEPORT_STAMINA >= 1) {
+        list.push_back(action(TELEPORT, 0));
+    }
 
+    const unordered_map<RoomId, ItemBag> &starting = world.startingItems();
+    auto here = starting.find(state.room);
+    if (here != starting.end()) {
+        for (ItemId item : here->second.kinds()) {
+            if (itemsLeft(state, state.room, item) > 0) {
+                list.push_back(action(TAKE, item));
+            }
+        }
+    }
 
-//1) Destructor */
-Character::~Character(){
-    cout << "Character has been destructed" << endl;
+    // With several of the same name the game hits the newest arrival; this takes the last one
+    // in the world's order, which is the same until wanderers bunch up (check() would tell).
+    for (size_t i = state.enemies.size(); i-- > 0; ) {
+        const Enemy &enemy = state.enemies[i];
+        if (enemy.room != state.room || enemy.health <= 0) {
+            continue;
+        }
+        bool named = false;
+        for (size_t later = i + 1; later < state.enemies.size() && !named; later++) {
+            named = state.enemies[later].room == state.room && state.enemies[later].health > 0 &&
+                    world.enemies[later].name == world.enemies[i].name;
+        }
+        if (!named) {
+            list.push_back(action(ATTACK, i));
+        }
+    }
 }
 
-string Character::getName()
+string Solver::command(Action action) const
 {
-    return name;
+    uint32_t what = action & 0x0FFFFFFF;
+    switch ((Kind) (action >> 28)) {
+    case GO:       return string("go ") + DIRECTION_NAMES[what];
+    case TELEPORT: return "teleport";
+    case TAKE:     return "take " + ItemCatalog::name(what);
+    case ATTACK:   return "attack " + world.enemies[what].name;
+    }
+    return "";
 }
 
-int Character::getHealth()
+// Out of reach: not enough stamina left to walk to the goal, and too little to teleport.
+bool Solver::hopeless(const State &state) const
 {
-    return health;
+    if (state.halfStamina / 2 - Rules::TELEPORT_STAMINA >= 1) {
+        return false;
+    }
+    int steps = (state.halfStamina - 1) / (int) (Rules::GO_STAMINA * 2);   // each must leave some
+    return distance[state.room] > (uint32_t) steps;
 }
 
-double Character::getStamina()
+int Solver::itemsLeft(const State &state, RoomId room, ItemId item) const
 {
-    return stamina;
+    const ItemBag &bag = world.startingItems().at(room);
+    auto taken = equal_range(state.taken.begin(), state.taken.end(), make_pair(room, item));
+    return bag.count(item) - (int) (taken.second - taken.first);
 }
 
-Room *Character::getCurrentRoom()
+void Solver::addItem(vector<pair<ItemId, uint32_t> > &inventory, ItemId item, uint32_t count)
 {
-    return currentRoom;
+    auto at = lower_bound(inventory.begin(), inventory.end(), make_pair(item, 0u));
+    if (at != inventory.end() && at->first == item) {
+        at->second += count;
+    } else {
+        inventory.insert(at, make_pair(item, count));
+    }
 }
 
-void Character::setName(string name)
+bool Solver::carries(const State &state, ItemId item)
 {
-    this->name = name;
+    auto at = lower_bound(state.inventory.begin(), state.inventory.end(), make_pair(item, 0u));
+    return item != NO_ITEM && at != state.inventory.end() && at->first == item;
 }
 
-void Character::setHealth(int health)
+// As 32-bit words: room, health, stamina, the generator (8), then the inventory and the taken
+// items (each a count and pairs), then three words per enemy.
+void Solver::pack(const State &state, string &packed) const
 {
-    if (health <= 0) {
-        health = 0;
-        EventManager::getInstance().trigger("characterDeath", this);
+    packed.clear();
+    auto put = [&](uint32_t word) {
+        packed.append((const char *) &word, sizeof(word));
+    };
+    put(state.room);
+    put(state.health);
+    put(state.halfStamina);
+    packed.append((const char *) &state.random, sizeof(state.random));
+    put(state.inventory.size());
+    for (const auto &item : state.inventory) {
+        put(item.first);
+        put(item.second);
+    }
+    put(state.taken.size());
+    for (const auto &item : state.taken) {
+        put(item.first);
+        put(item.second);
+    }
+    for (const Enemy &enemy : state.enemies) {
+        put(enemy.health);
+        put(enemy.room);
+        put(enemy.destination);
     }
-    this->health = health;
 }
 
-
-void Character::setCurrentRoom(Room *next)
+void Solver::unpack(const string &packed, State &state) const
 {
-    currentRoom = next;
+    const char *at = packed.data();
+    auto get = [&]() {
+        uint32_t word;
+        memcpy(&word, at, sizeof(word));
+        at += sizeof(word);
+        return word;
+    };
+    state.room        = get();
+    state.health      = get();
+    state.halfStamina = get();
+    memcpy(&state.random, at, sizeof(state.random));
+    at += sizeof(state.random);
+    state.inventory.resize(get());
+    for (auto &item : state.inventory) {
+        item.first  = get();
+        item.second = get();
+    }
+    state.taken.resize(get());
+    for (auto &item : state.taken) {
+        item.first  = get();
+        item.second = get();
+    }
+    state.enemies.resize(world.enemies.size());
+    for (Enemy &enemy : state.enemies) {
+        enemy.health      = get();
+        enemy.room        = get();
+        enemy.destination = get();
+    }
 }
 
-void Character::addItem(Items item)
+bool Solver::check(const vector<string> &commands) const
 {
-    cout << "Added " << item.getDescription() << " to your inventory." << endl;
-    itemsInventory.push_back(item);
+    EventManager events;
+    Game game(world, events, -1);
+    game.setSeed(seed);
+    Simulator::Outcome outcome = Simulator::PLAYING;
+    OutcomeListener won(&outcome, Simulator::WON), lost(&outcome, Simulator::LOST);
+    events.listen(Events::victory, &won);
+    events.listen(Events::defeat, &lost);
+    for (const string &command : commands) {
+        if (outcome != Simulator::PLAYING) {
+            return false;
+        }
+        events.handle_line(command, -1);
+    }
+    return outcome == Simulator::WON;
 }
 
-void Character::addItemEnemy(Items item)
-{
-    itemsInventory.push_back(item);
-}
+// Benchmarks.cpp
+// Allocations made by this thread, counted so benchmarks can show that a path doesn't allocate.
+// Only a build with -DCOUNT_ALLOCATIONS replaces the global allocator to count them; the game
+// itself keeps the library's.
+thread_local size_t allocationCount = 0;
 
-bool Character::isItemInCharacter(string description)
+#ifdef COUNT_ALLOCATIONS
+// The replacements are kept out of line: once inlined, GCC sees malloc() meet delete and warns.
+__attribute__((noinline)) void *operator new(size_t size)
 {
-    bool answer = false;
-    for(int i = 0; i < itemsInventory.size(); i++){
-        if(description.compare(itemsInventory[i].getDescription()) == 0)
-        answer = true;
+    allocationCount++;
+    if (void *memory = malloc(size ? size : 1)) {
+        return memory;
     }
-    return answer;
+    throw bad_alloc();
 }
 
-Items* Character::getItem(int loaction){
-    return &itemsInventory[loaction];
+__attribute__((noinline)) void operator delete(void *memory) noexcept
+{
+    free(memory);
 }
 
-void Character::removeItem(int location){
-    itemsInventory.erase(itemsInventory.begin()+location);
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
 }
+#endif
 
-vector<Items> Character::getItems()
+// A benchmark's allocations line, or a note that this build doesn't count them.
+static void printAllocations(size_t allocations, const char *when)
 {
-    return itemsInventory;
+#ifdef COUNT_ALLOCATIONS
+    cout << "  " << allocations << " allocations " << when;
+#else
+    (void) allocations;
+    cout << "  allocations " << when << " not counted (build with -DCOUNT_ALLOCATIONS)";
+#endif
 }
 
-//7) Virtual functions and polymorphism */
-void Character::check()
+/** Counts every dispatch it receives through the old "void *" path. */
+class UntypedCounter : public EventListener
 {
-    cout << "Printing from the Character class" << endl;
-}
+public:
+    void run(void *args) override
+    {
+        ++*(long *) args;
+    }
+};
 
-//7) Virtual functions and polymorphism */
-void Character::change()
+/** Counts every dispatch it receives through the typed path. */
+class TypedCounter final : public Listener<long>
 {
-    cout << "This is from the Character class" << endl;
-}
+public:
+    void run(long &count) override
+    {
+        ++count;
+    }
+};
 
-Room::Room(string name) :
-    name(name)
+// Time per call of one trigger with four listeners, typed vs "void *".
+void benchDispatch()
 {
-    exits["north"] = nullptr;
-    exits["east"]  = nullptr;
-    exits["south"] = nullptr;
-    exits["west"]  = nullptr;
+    const long calls = 10000000;
+    EventManager &eventManager = EventManager::getInstance();
+
+    Event<long> typed{EventManager::intern("bench_typed")};
+    EventId untyped = EventManager::intern("bench_untyped");
+    for (int i = 0; i < 4; i++) {
+        eventManager.listen(typed, new TypedCounter());
+        eventManager.listen(untyped, new UntypedCounter());
+    }
+
+    long count = 0;
+    auto start = chrono::steady_clock::now();
+    for (long i = 0; i < calls; i++) {
+        eventManager.trigger(untyped, &count);
+    }
+    double untypedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+
+    start = chrono::steady_clock::now();
+    for (long i = 0; i < calls; i++) {
+        eventManager.trigger(typed, count);
+    }
+    double typedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+
+    // Typed again, measured: a trigger is 5 spans (its own and its listeners').
+    auto measured = [&]() {
+        auto start = chrono::steady_clock::now();
+        for (long i = 0; i < calls; i++) {
+            eventManager.trigger(typed, count);
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / calls;
+    };
+    DispatchTrace::enable();
+    double tracedNs = measured();
+    DispatchTrace::enable(false);
+    DispatchProfile::enable();
+    double profiledNs = measured();
+    DispatchProfile::enable(false);
+
+    cout << "dispatch (4 listeners, " << calls << " triggers, " << count << " calls)" << endl;
+    cout << "  void *:   " << untypedNs  << " ns/trigger" << endl;
+    cout << "  typed:    " << typedNs    << " ns/trigger" << endl;
+    cout << "  traced:   " << tracedNs   << " ns/trigger, " << (tracedNs - typedNs) / 5 << " ns/span" << endl;
+    cout << "  profiled: " << profiledNs << " ns/trigger" << endl;
 }
 
-string Room::getName()
+// Timer wheel costs with tens of thousands of timers waiting: adding, cancelling, and ticks
+// with timers going off, both one-shot and periodic.
+void benchTimers()
 {
-    return name;
+    const int timers = 50000;
+    const TimerWheel::Tick ticks = 1000000;
+    TimerWheel wheel;
+    vector<TimerId> ids;
+    ids.reserve(timers);
+    srand(1);
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < timers; i++) {
+        // Mostly soon, some much later (to exercise the upper wheels).
+        TimerWheel::Tick delay = i % 10 == 0 ? rand() % (ticks * 20) : rand() % 5000;
+        ids.push_back(wheel.add(delay, i % 5 == 0 ? 1 + rand() % 1000 : 0, 0, i));
+    }
+    double addNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / timers;
+
+    start = chrono::steady_clock::now();
+    int cancelled = 0;
+    for (int i = 1; i < timers; i += 4) {
+        cancelled += wheel.cancel(ids[i]);
+    }
+    double cancelNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (timers / 4);
+    size_t waiting = wheel.pending();
+
+    // Re-adding what goes off keeps the wheel full, as a busy game would.
+    size_t allocations = allocationCount;
+    long fired = 0;
+    EventId event;
+    uint64_t value;
+    start = chrono::steady_clock::now();
+    for (TimerWheel::Tick now = 1; now <= ticks; now++) {
+        while (wheel.expire(now, event, value)) {
+            fired++;
+            if (value % 7 == 0) {
+                wheel.add(1 + value % 3000, 0, 0, value + 1);
+            }
+        }
+    }
+    double tickNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    allocations = allocationCount - allocations;
+
+    cout << "timer wheel (" << timers << " timers, " << waiting << " waiting after "
+         << cancelled << " cancelled)" << endl;
+    cout << "  add:    " << addNs << " ns" << endl;
+    cout << "  cancel: " << cancelNs << " ns" << endl;
+    cout << "  " << ticks << " ticks, " << fired << " went off: " << tickNs / ticks << " ns/tick, "
+         << tickNs / max(1L, fired) << " ns/timer" << endl;
+    printAllocations(allocations, "while ticking");
+    cout << ", " << wheel.memoryUsage() / 1024 << " KB" << endl;
 }
 
-void Room::setExits(Room *north, Room *east, Room *south, Room *west)
+// Time and allocations per line of reading and splitting a piped script, once warmed up.
+void benchTokenizer()
 {
-    exits["north"] = north;
-    exits["east"]  = east;
-    exits["south"] = south;
-    exits["west"]  = west;
+    const char *commands[] = {"GO North", "  take   Cursed_Book  ", "attack\tZOMBIE", "map",
+                              "go south please and thank you, this line is a bit longer", ""};
+    string script;
+    for (int i = 0; i < 1000; i++) {
+        script += commands[i % 6];
+        script += '\n';
+    }
+
+    istringstream input(script);
+    string line;
+    Tokenizer tokenizer;
+    size_t words = 0;
+
+    auto pass = [&]() {
+        input.clear();
+        input.seekg(0);
+        while (getline(input, line)) {
+            words += tokenizer.split(line).size();
+        }
+    };
+
+    pass();     // warm up: the buffers grow to their steady size here
+    const int passes = 1000;
+    size_t allocations = allocationCount;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < passes; i++) {
+        pass();
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    allocations = allocationCount - allocations;
+
+    cout << "tokenizer (" << passes * 1000 << " lines, " << words << " words)" << endl;
+    cout << "  " << ns / (passes * 1000) << " ns/line" << endl;
+    printAllocations(allocations, "after warm-up");
+    cout << endl;
 }
 
-Room *Room::getExit(string direction)
+// The game's generator against rand_r() % n, drawing rooms of a 1000-room world: how long a
+// number takes, and how far apart the most and least drawn rooms are (the bias).
+void benchRandom()
 {
-    return exits[direction];
+    const int draws = 10000000;
+    const uint32_t rooms = 1000;
+
+    auto measure = [&](const char *what, auto draw) {
+        vector<int> counts(rooms);
+        uint64_t sum = 0;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < draws; i++) {
+            uint32_t room = draw();
+            sum += room;
+            counts[room]++;
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        auto spread = minmax_element(counts.begin(), counts.end());
+        cout << "  " << what << ns / draws << " ns/number, counts " << *spread.first << ".."
+             << *spread.second << " (sum " << sum % 10 << ")" << endl;
+    };
+
+    cout << "random numbers (" << draws << " rooms out of " << rooms << ")" << endl;
+    unsigned int seed = 1;
+    measure("rand_r() % n:   ", [&]() { return (uint32_t) rand_r(&seed) % rooms; });
+    Random random(1);
+    measure("Random::below: ", [&]() { return random.below(rooms); });
 }
 
-void Room::addItem(Items *item)
+// Time to load a world file and look up its last room by name.
+bool benchWorld(const char *path)
 {
-    itemList.push_back(*item);
+    World world;
+    string error;
+    auto start = chrono::steady_clock::now();
+    if (!world.load(path, error)) {
+        cerr << path << ": " << error << endl;
+        return false;
+    }
+    double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    RoomId last = world.findRoom(world.roomName(world.roomCount() - 1));
+    double indexMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    RoomArena rooms;
+    start = chrono::steady_clock::now();
+    rooms.build(world);
+    double arenaMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    cout << path << ": " << world.roomCount() << " rooms" << endl;
+    cout << "  load:            " << loadMs << " ms" << endl;
+    cout << "  first name find: " << indexMs << " ms (room " << last << ")" << endl;
+    cout << "  room arena:      " << arenaMs << " ms, " << rooms.memoryUsage() / 1024 << " KB" << endl;
+    return true;
 }
 
-string Room::displayItems()
+// Shortest path queries on a world: next hops to landmarks (table lookups), routes to random
+// rooms (A* the first time, the cache after that) and re-routing after an exit changes.
+bool benchRouting(const char *path)
 {
-    string message = "";
-    int size = (itemList.size());
-    if(size < 1){
-        message = message + "There are no items in this room.";
-    }else{
-        message = "The items in this room are: ";
-        int a = 0;
-        for(int i = size; i > 0; i--){
-            message = message + itemList[a].getDescription() + " ";
-            a++;
+    World world;
+    string error;
+    if (!world.load(path, error)) {
+        cerr << path << ": " << error << endl;
+        return false;
+    }
+    RoomArena rooms;
+    rooms.build(world);
+    Router router;
+    router.attach(rooms);
+
+    auto start = chrono::steady_clock::now();
+    RoomId landmarks = router.landmarkCount();
+    double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    size_t sharedBytes = world.routes().memoryUsage(), gameBytes = router.memoryUsage();
+
+    auto report = [](const char *what, vector<long long> &latencies) {
+        sort(latencies.begin(), latencies.end());
+        size_t count = latencies.size();
+        cout << "  " << what << "p50 " << latencies[count / 2] << " ns, p99 "
+             << latencies[min(count - 1, count * 99 / 100)] << " ns" << endl;
+    };
+    auto timed = [](auto query) {
+        auto before = chrono::steady_clock::now();
+        query();
+        return (long long) chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - before).count();
+    };
+
+    srand(1);
+    RoomId count = rooms.size();
+    vector<long long> hops, searches, cached, rerouted;
+    vector<RoomId> route;
+    size_t routeSteps = 0, found = 0;
+
+    for (int i = 0; i < 10000; i++) {
+        RoomId from = rand() % count, to = router.landmark(rand() % landmarks);
+        hops.push_back(timed([&]() { router.nextHop(from, to); }));
+    }
+    for (int i = 0; i < 200; i++) {
+        RoomId from = rand() % count, to = rand() % count;
+        bool ok = false;
+        searches.push_back(timed([&]() { ok = router.route(from, to, route); }));
+        if (!ok || route.size() < 2) {
+            continue;
         }
+        found++;
+        routeSteps += route.size() - 1;
+        RoomId middle = route[route.size() / 2];
+        cached.push_back(timed([&]() { router.nextHop(middle, to); }));
+
+        // Wall off the route's first exit, ask again, then put it back.
+        RoomId next = route[1];
+        Direction direction = rooms.directionTo(from, next);
+        rooms.setExit(from, direction, NO_ROOM);
+        router.exitChanged(from, direction, next);
+        rerouted.push_back(timed([&]() { router.route(from, to, route); }));
+        rooms.setExit(from, direction, next);
+        router.exitChanged(from, direction, NO_ROOM);
     }
-    return message;
-} 
 
-int Room::amountOfItems()
-{
-    return itemList.size();
+    cout << path << ": " << count << " rooms, " << landmarks << " landmarks" << endl;
+    cout << "  build:           " << buildMs << " ms, " << sharedBytes / 1024 << " KB shared, "
+         << gameBytes << " bytes per game" << endl;
+    report("next hop:        ", hops);
+    report("route (search):  ", searches);
+    cout << "  routes found:    " << found << " of 200, " << (found ? routeSteps / found : 0) << " steps on average" << endl;
+    if (found > 0) {
+        report("next hop (cache):", cached);
+        report("after exit change:", rerouted);
+    }
+    return true;
 }
 
-bool Room::isItemInRoom(string str) 
+// Saving and loading a game after it has been played a little (so characters have moved and
+// rooms changed): how big the file is and how long each takes, flushing to disk included.
+bool benchSave(const char *path)
 {
-    int size = itemList.size();
-    if(size > 0){
-        for(int i = 0; i < size; i++){
-            if(str.compare(itemList.at(i).getDescription()) == 0) {
-                return true;
-            }
-        }
+    World world;
+    string error;
+    if (!world.load(path, error)) {
+        cerr << path << ": " << error << endl;
+        return false;
+    }
+    EventManager events;
+    Game game(world, events, -1);
+    for (const char *command : {"take", "map", "map", "map", "map"}) {
+        events.handle_line(command, -1);
     }
-    return false;
-}
 
-void Room::removeItem(Items *item)
-{
-    for(int i = 0; i < itemList.size(); i++){
-        if(item->getDescription().compare(itemList.at(i).getDescription()) == 0){
-            itemList.erase(itemList.begin() + i);
+    mkdir(saveDirectory().c_str(), 0755);
+    string file = Game::slotPath("bench");
+    vector<long long> saves, loads;
+    for (int i = 0; i < 50; i++) {
+        auto before = chrono::steady_clock::now();
+        bool saved = game.save(file, error);
+        auto middle = chrono::steady_clock::now();
+        bool loaded = saved && game.load(file, error);
+        auto after = chrono::steady_clock::now();
+        if (!loaded) {
+            cerr << error << endl;
+            remove(file.c_str());
+            return false;
         }
+        saves.push_back(chrono::duration_cast<chrono::microseconds>(middle - before).count());
+        loads.push_back(chrono::duration_cast<chrono::microseconds>(after - middle).count());
     }
+    struct stat info;
+    stat(file.c_str(), &info);
+    remove(file.c_str());
+
+    auto report = [](const char *what, vector<long long> &latencies) {
+        sort(latencies.begin(), latencies.end());
+        size_t count = latencies.size();
+        cout << "  " << what << "p50 " << latencies[count / 2] << " us, p99 "
+             << latencies[min(count - 1, count * 99 / 100)] << " us" << endl;
+    };
+    cout << path << ": " << world.roomCount() << " rooms, " << world.enemies.size() + 1 << " characters" << endl;
+    cout << "  file:  " << info.st_size << " bytes" << endl;
+    report("save:  ", saves);
+    report("load:  ", loads);
+    return true;
 }
 
-vector<Items> Room::getItems()
+/** Counts lines, for the poller benchmark. */
+class LineCounter final : public Listener<Words>
 {
-    return itemList;
-}
+public:
+    long lines = 0;
 
-Game::Game() :
-    player("Hero"),
-//9) Initializer list */
-    enemy1("zombie", 20, 100),
-    testChar("testChar"),
-    enemy2("ghost")
+    void run(Words &) override
+    {
+        lines++;
+    }
+};
 
+// Thousands of loopback connections typing at once: every round each one sends a line, and
+// the round is over when the poller has turned all of them into turns.
+bool benchPoll(int connections)
 {
-    srand(time(nullptr));
+    // One fd per connection on each end.
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if ((rlim_t) connections * 2 + 64 > limit.rlim_cur) {
+        connections = (limit.rlim_cur - 64) / 2;
+        cout << "(only " << connections << " connections fit in the open file limit)" << endl;
+    }
 
-    // Commands 
-    EventManager::getInstance().listen("go",        new GoListener(this));
-    EventManager::getInstance().listen("map",       new MapListener(this));
-    EventManager::getInstance().listen("info",      new InfoListener(this));
-    EventManager::getInstance().listen("restart",   new RestartListener(this));
-    EventManager::getInstance().listen("teleport",  new TeleportListener(this));
-    EventManager::getInstance().listen("take",      new TakeListener(this));
-    EventManager::getInstance().listen("attack",    new AttackListener(this));
-    EventManager::getInstance().listen("exit",      new ExitListener(this));
+    EventManager &eventManager = EventManager::getInstance();
+    LineCounter *counter = new LineCounter();
+    eventManager.listen(Events::input, counter);
+
+    Poller &poller = eventManager.getPoller();
+    string error;
+    if (!poller.listenTcp(0, &eventManager, error)) {
+        cerr << error << endl;
+        return false;
+    }
 
-    // State changes
-    EventManager::getInstance().listen("characterDeath", new CharacterDeathListener(this));
-    EventManager::getInstance().listen("enterRoom",      new EnterRoomListener(this));
-    EventManager::getInstance().listen("hurt",           new HurtListener(this));
-    EventManager::getInstance().listen("victory",        new VictoryListener(this));
-    EventManager::getInstance().listen("defeat",         new DefeatListener(this));
-
-    rooms.push_back(new Room("A")); // 0
-    rooms.push_back(new Room("B")); // 1
-    rooms.push_back(new Room("C")); // 2
-    rooms.push_back(new Room("D")); // 3
-    rooms.push_back(new Room("E")); // 4
-    rooms.push_back(new Room("F")); // 5
-    rooms.push_back(new Room("G")); // 6
-    rooms.push_back(new Room("H")); // 7
-    rooms.push_back(new Room("I")); // 8
-    rooms.push_back(new Room("J")); // 9
-
-    //                 N         E         S         W
-    rooms[0]->setExits(rooms[4], rooms[2], rooms[7], rooms[1]);
-    rooms[1]->setExits(nullptr,  rooms[0], nullptr,  nullptr);
-    rooms[2]->setExits(nullptr,  nullptr,  nullptr,  rooms[0]);
-    rooms[3]->setExits(nullptr,  rooms[4], nullptr,  nullptr);
-    rooms[4]->setExits(nullptr,  rooms[5], rooms[0], rooms[3]);
-    rooms[5]->setExits(nullptr,  nullptr,  nullptr,  rooms[4]);
-    rooms[6]->setExits(nullptr,  rooms[7], nullptr,  nullptr);
-    rooms[7]->setExits(rooms[0], rooms[8], rooms[9], rooms[6]);
-    rooms[8]->setExits(nullptr,  nullptr,  nullptr,  rooms[7]);
-    rooms[9]->setExits(rooms[7], nullptr,  nullptr,  nullptr);
+    vector<int> clients;
+    sockaddr_in address{};
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(poller.tcpPort());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < connections; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+            cerr << "connection " << i << ": " << strerror(errno) << endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        clients.push_back(fd);
+        if (i % 64 == 63) {
+            poller.poll(0);     // accept as we go, the backlog isn't endless
+        }
+    }
+    while (poller.inputs() < clients.size()) {
+        poller.poll(10);
+    }
 
-    reset();
+    // Read the prompts (and later the replies) so the clients' buffers never fill up.
+    vector<char> drain(4096);
+    auto drainClients = [&]() {
+        for (int fd : clients) {
+            while (recv(fd, drain.data(), drain.size(), MSG_DONTWAIT) > 0) {
+            }
+        }
+    };
+
+    const int rounds = 20;
+    const char line[] = "go north\n";
+    vector<long long> latencies;
+    auto start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        auto roundStart = chrono::steady_clock::now();
+        long target = counter->lines + clients.size();
+        for (int fd : clients) {
+            ssize_t written = send(fd, line, sizeof(line) - 1, MSG_NOSIGNAL);
+            (void) written;
+        }
+        while (counter->lines < target) {
+            poller.poll(100);
+        }
+        latencies.push_back(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - roundStart).count());
+        drainClients();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    sort(latencies.begin(), latencies.end());
+    cout << "poller (" << clients.size() << " loopback connections, " << rounds << " rounds)" << endl;
+    cout << "  " << counter->lines / seconds << " lines/s (including the clients' side)" << endl;
+    cout << "  round (every connection one line): p50 " << latencies[rounds / 2] << " us, max "
+         << latencies.back() << " us" << endl;
+
+    for (int fd : clients) {
+        close(fd);
+    }
+    return true;
 }
- 
-void Game::reset(bool show_update)
-{
-    gameOver = false;
 
-    rooms[0]->itemList.clear();
-    rooms[2]->itemList.clear();
+// A load generator for the server: "connections" players at once over TCP (an address that's
+// a number is a port on localhost) or a Unix socket, each typing its next command as soon as
+// it sees its prompt, for "seconds". Reports commands/s and the time from a command to the
+// prompt after it.
+bool loadTest(const char *address, int connections, int seconds)
+{
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    signal(SIGPIPE, SIG_IGN);
+
+    bool tcp = strspn(address, "0123456789") == strlen(address);
+    sockaddr_in inet{};
+    sockaddr_un local{};
+    if (tcp) {
+        inet.sin_family      = AF_INET;
+        inet.sin_port        = htons(atoi(address));
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    } else {
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, address, sizeof(local.sun_path) - 1);
+    }
 
-    rooms[0]->addItem(new Items("cursed_book"));
-    rooms[2]->addItem(new Items("potion"));
+    const char *commands[] = {"map", "go north", "go south", "info", "take cursed_book", "drop cursed_book",
+                              "go east", "travel b", "travel a", "attack ghost", "go west", "restart"};
+    const size_t commandCount = sizeof(commands) / sizeof(commands[0]);
 
-    player.itemsInventory.clear();
+    struct Player
+    {
+        int    fd;
+        size_t next;        // command to send next
+        char   last[2];     // the last two characters received, to spot the prompt
+        bool   started;     // the first prompt (after the welcome screen) came
+        chrono::steady_clock::time_point sent;
+    };
+    vector<Player> players;
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    for (int i = 0; i < connections; i++) {
+        int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool connected = fd >= 0 && (tcp ? connect(fd, (sockaddr *) &inet, sizeof(inet))
+                                         : connect(fd, (sockaddr *) &local, sizeof(local))) == 0;
+        if (!connected) {
+            cerr << "connection " << i << ": " << strerror(errno) << endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        epoll_event event{};
+        event.events   = EPOLLIN;
+        event.data.u32 = players.size();
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        players.push_back(Player{fd, (size_t) i % commandCount, {0, 0}, false, chrono::steady_clock::now()});
+    }
 
-    player.setCurrentRoom(rooms[0]);
-    player.setHealth(100);
-    player.setStamina<int>(100);
+    vector<long long> latencies;
+    latencies.reserve(1 << 20);
+    vector<epoll_event> ready(1024);
+    vector<char> buffer(64 * 1024);
+    auto start    = chrono::steady_clock::now();
+    auto deadline = start + chrono::seconds(seconds);
+    long commandsDone = 0;
+    size_t hungUp = 0;
+
+    while (chrono::steady_clock::now() < deadline && hungUp < players.size()) {
+        int count = epoll_wait(epollFd, ready.data(), ready.size(), 100);
+        for (int i = 0; i < count; i++) {
+            Player &player = players[ready[i].data.u32];
+            ssize_t got;
+            bool prompted = false;
+            while ((got = recv(player.fd, buffer.data(), buffer.size(), 0)) > 0) {
+                player.last[0] = got > 1 ? buffer[got - 2] : player.last[1];
+                player.last[1] = buffer[got - 1];
+                prompted = player.last[0] == '>' && player.last[1] == ' ';
+            }
+            if (got == 0) {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, player.fd, nullptr);
+                hungUp++;
+                continue;
+            }
+            if (!prompted) {
+                continue;
+            }
 
-    enemy1.setCurrentRoom(rooms[7]);
-    Items *key = new Items("key");
-    enemy1.addItemEnemy(*key);
-    enemy1.setHealth(100);
-    enemy1.setStamina<int>(100);
+            auto now = chrono::steady_clock::now();
+            if (player.started) {
+                latencies.push_back(chrono::duration_cast<chrono::microseconds>(now - player.sent).count());
+                commandsDone++;
+            }
+            player.started = true;
+            string line = string(commands[player.next % commandCount]) + "\n";
+            player.next = (player.next + 1) % commandCount;
+            player.sent = now;
+            if (send(player.fd, line.data(), line.size(), MSG_NOSIGNAL) < 0) {
+                hungUp++;
+            }
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-    enemy2.setCurrentRoom(rooms[3]);
-    enemy2.setHealth(100);
-    enemy2.setStamina<int>(100);
+    for (Player &player : players) {
+        close(player.fd);
+    }
+    close(epollFd);
+
+    sort(latencies.begin(), latencies.end());
+    cout << "load: " << players.size() << " players over " << (tcp ? "TCP" : "a Unix socket")
+         << " for " << elapsed << " s" << endl;
+    cout << "  commands/s: " << commandsDone / elapsed << " (" << commandsDone << " commands)" << endl;
+    if (!latencies.empty()) {
+        size_t count = latencies.size();
+        cout << "  p50:        " << latencies[count / 2] << " us" << endl;
+        cout << "  p99:        " << latencies[min(count - 1, count * 99 / 100)] << " us" << endl;
+    }
+    if (hungUp > 0) {
+        cout << "  " << hungUp << " connections closed by the server" << endl;
+    }
+    return true;
+}
 
-    cout << "Welcome to Zork!" << endl;
-    if (show_update) {
-        update_screen();
+// One check of --self-test: says how it went, and what went wrong if it failed.
+static bool selfCheck(const char *what, bool held, const string &detail)
+{
+    cout << (held ? "  ok      " : "  FAILED  ") << what;
+    if (!held && !detail.empty()) {
+        cout << ": " << detail;
     }
+    cout << endl;
+    return held;
 }
 
-void Game::setOver(bool over)
+// How many lines of a file are exactly "line".
+static int countLines(int fd, const char *line)
 {
-    this->gameOver = over;
+    string text(lseek(fd, 0, SEEK_END), '\0');
+    if (pread(fd, &text[0], text.size(), 0) != (ssize_t) text.size()) {
+        return -1;
+    }
+    int count = 0;
+    istringstream lines(text);
+    string each;
+    while (getline(lines, each)) {
+        count += each == line;
+    }
+    return count;
 }
 
-void Game::map()
+// The same seeded commands played with events queued and with them run straight away: after
+// every turn both games must be in the same state, and both must show the same one ending.
+static bool testQueuedMatchesDirect(const World &world)
 {
-    Room *playerRoom = player.getCurrentRoom();
-    Room *enemy1Room = enemy1.getCurrentRoom();
-    Room *enemy2Room = enemy2.getCurrentRoom();
-
-    string A = "A";
-    string B = "B";
-    string C = "C";
-    string D = "D";
-    string E = "E";
-    string F = "F";
-    string G = "G";
-    string H = "H";
-    string I = "I";
-    string J = "J";
+    vector<string> commands;
+    for (const char *direction : DIRECTION_NAMES) {
+        commands.push_back(string("go ") + direction);
+    }
+    commands.push_back("teleport");
+    for (const ItemSpec &item : world.items) {
+        commands.push_back("take " + item.name);
+    }
+    for (const EnemySpec &enemy : world.enemies) {
+        commands.push_back("attack " + enemy.name);
+        for (const string &loot : enemy.loot) {
+            commands.push_back("take " + loot);
+        }
+    }
 
-    
-    if(playerRoom == rooms[0]){
-        A = "[A]";
-    }else if(playerRoom == rooms[1]){
-        B = "[B]";
-    }else if(playerRoom == rooms[2]){
-        C = "[C]";
-    }else if(playerRoom == rooms[3]){
-        D = "[D]";
-    }else if(playerRoom == rooms[4]){
-        E = "[E]";
-    }else if(playerRoom == rooms[5]){
-        F = "[F]";
-    }else if(playerRoom == rooms[6]){
-        G = "[G]";
-    }else if(playerRoom == rooms[7]){
-        H = "[H]";
-    }else if(playerRoom == rooms[8]){
-        I = "[I]";
-    }else if (playerRoom == rooms[9]){
-        J = "[J]";
+    // The screens go to files in memory, to count the endings they showed.
+    int directFd = memfd_create("direct", MFD_CLOEXEC), queuedFd = memfd_create("queued", MFD_CLOEXEC);
+    if (directFd < 0 || queuedFd < 0) {
+        return selfCheck("queued events play like direct ones", false, string("memfd_create: ") + strerror(errno));
     }
-    
-    if(enemy1Room == rooms[0]){
-       A = "!A!";
-   }else if(enemy1Room == rooms[1] && enemy1.getHealth() > 0){
-       B = "!B!";
-   }else if(enemy1Room == rooms[2] && enemy1.getHealth() > 0){
-       C = "!C!";
-   }else if(enemy1Room == rooms[3] && enemy1.getHealth() > 0){
-       D = "!D!";
-   }else if(enemy1Room == rooms[4] && enemy1.getHealth() > 0){
-       E = "!E!";
-   }else if(enemy1Room == rooms[5] && enemy1.getHealth() > 0){
-       F = "!F!";
-   }else if(enemy1Room == rooms[6] && enemy1.getHealth() > 0){
-       G = "!G!";
-   }else if(enemy1Room == rooms[7] && enemy1.getHealth() > 0){
-       H = "!H!";
-   }else if(enemy1Room == rooms[8] && enemy1.getHealth() > 0){
-       I = "!I!";
-   }else if (enemy1Room == rooms[9] && enemy1.getHealth() > 0){
-       J = "!J!";
-   }
- 
-      if(enemy2Room == rooms[0] && enemy2.getHealth() > 0){
-       A = "!A!";
-   }else if(enemy2Room == rooms[1] && enemy2.getHealth() > 0){
-       B = "!B!";
-   }else if(enemy2Room == rooms[2] && enemy2.getHealth() > 0){
-       C = "!C!";
-   }else if(enemy2Room == rooms[3] && enemy2.getHealth() > 0){
-       D = "!D!";
-   }else if(enemy2Room == rooms[4] && enemy2.getHealth() > 0){
-       E = "!E!";
-   }else if(enemy2Room == rooms[5] && enemy2.getHealth() > 0){
-       F = "!F!";
-   }else if(enemy2Room == rooms[6] && enemy2.getHealth() > 0){
-       G = "!G!";
-   }else if(enemy2Room == rooms[7] && enemy2.getHealth() > 0){
-       H = "!H!";
-   }else if(enemy2Room == rooms[8] && enemy2.getHealth() > 0){
-       I = "!I!";
-   }else if (enemy2Room == rooms[9] && enemy2.getHealth() > 0){
-       J = "!J!";
-   }
 
-    cout << "\n" << endl;
-    cout << D << " -- " << E << " -- " << F << endl;
-    cout << "     |    " << endl;
-    cout << B << " -- " << A << " -- " << C << endl;
-    cout << "     |    " << endl;
-    cout << G << " -- " << H << " -- " << I << endl;
-    cout << "     |    " << endl;
-    cout << "     " << J <<  endl;
-}
+    EventManager directEvents, queuedEvents;
+    queuedEvents.setQueued(true);
+    Game direct(world, directEvents, -1), queued(world, queuedEvents, -1);
+    Snapshot directState, queuedState;
+    ostringstream detail;
+    for (uint64_t seed = 1; seed <= 1000 && detail.tellp() == 0; seed++) {
+        Random random(seed);
+        direct.reset(false);
+        queued.reset(false);
+        direct.setSeed(seed);
+        queued.setSeed(seed);
+        if (ftruncate(directFd, 0) < 0 || ftruncate(queuedFd, 0) < 0) {
+            detail << "ftruncate: " << strerror(errno);
+            break;
+        }
+        lseek(directFd, 0, SEEK_SET);
+        lseek(queuedFd, 0, SEEK_SET);
+
+        int turn = 1;
+        for (; turn <= 300 && !direct.is_over(); turn++) {
+            const string &command = commands[random.below(commands.size())];
+            directEvents.handle_line(command, directFd);
+            queuedEvents.handle_line(command, queuedFd);
+            direct.snapshot(directState);
+            queued.snapshot(queuedState);
+            if (directState.size() != queuedState.size() ||
+                memcmp(directState.data(), queuedState.data(), directState.size()) != 0) {
+                detail << "seed " << seed << ", turn " << turn << " (" << command << "): the games differ";
+                break;
+            }
+        }
 
-void Game::info()
-{
-    cout << "Available commands:" << endl;
-    cout << " - take <Item name>" << endl;
-    cout << " - attack          " << endl;
-    cout << " - go <direction>"   << endl;
-    cout << " - teleport"         << endl;
-    cout << " - map"              << endl;
-    cout << " - info"             << endl;
+        int directWins = countLines(directFd, "Victory!"), directLosses = countLines(directFd, "Defeat!");
+        int queuedWins = countLines(queuedFd, "Victory!"), queuedLosses = countLines(queuedFd, "Defeat!");
+        if (detail.tellp() == 0 && (queuedWins != directWins || queuedLosses != directLosses ||
+                                    directWins + directLosses > 1)) {
+            detail << "seed " << seed << ", " << turn - 1 << " turns: direct showed " << directWins << " victory and "
+                   << directLosses << " defeat, queued " << queuedWins << " and " << queuedLosses;
+        }
+    }
+    close(directFd);
+    close(queuedFd);
+    return selfCheck("queued events play like direct ones (1000 seeded games)", detail.tellp() == 0, detail.str());
 }
 
-void Game::take(string item)
+// Steps from "from" to every room by the rooms' exits as they are now (UINT32_MAX: can't).
+static void distancesFrom(const RoomArena &rooms, RoomId from, vector<uint32_t> &distance)
 {
-    Room *currentRoom = player.getCurrentRoom();
-    bool isItem = currentRoom->isItemInRoom(item);
-
-    if(isItem == false){
-        cout << "Item is not in this Room" << endl;
-    }else if(isItem){
-        Items *newItem = new Items(item);
-        player.addItem(*newItem);
-        currentRoom->removeItem(newItem);
-        cout << "Item " << item << " has been picked up" << endl;
-        if(newItem->getDescription() == "cursed_book"){
-            cout<< "You have opened a cursed book, you lose 10 health." << endl;
-            EventManager::getInstance().trigger("hurt", &player);
-        }
-
-        if(player.isItemInCharacter("potion")){
-            int health = player.getHealth();
-            if(health == 100){
-                cout << "Health is Full" << endl;
-            }else if(health > 90){
-                cout << "Health is too high" << endl;
-            }else{
-//4) Unary operator overloading */
-                ++player;
+    distance.assign(rooms.size(), UINT32_MAX);
+    vector<RoomId> queue = {from};
+    distance[from] = 0;
+    for (size_t at = 0; at < queue.size(); at++) {
+        RoomId room = queue[at];
+        for (int direction = 0; direction < DIRECTION_COUNT; direction++) {
+            RoomId next = rooms.getExit(room, (Direction) direction);
+            if (next != NO_ROOM && distance[next] == UINT32_MAX) {
+                distance[next] = distance[room] + 1;
+                queue.push_back(next);
             }
         }
     }
 }
 
-void Game::attack(string name)
+// Routes and next hops on a generated grid, checked against a breadth-first search after each
+// of a few hundred random exit changes (walls, and one-way shortcuts anywhere): a route has to
+// follow the exits, be as short as the search says, and exist exactly when the search finds one.
+static bool testRouter(int roomCount)
 {
-    Room *playerRoom = player.getCurrentRoom();
-    Room *enemy2Room = enemy2.getCurrentRoom();
-    Room *enemy1Room = enemy1.getCurrentRoom();
-
-    if(playerRoom != enemy1Room && playerRoom != enemy2Room){
-        cout << "\nNo enemy in the room to attack" << endl;
+    string what = "routes match a breadth-first search (" + to_string(roomCount) + " rooms, random exit changes)";
+    char path[] = "/tmp/zork-self-test-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return selfCheck(what.c_str(), false, string("mkstemp: ") + strerror(errno));
     }
-    if(playerRoom == enemy1Room && name == enemy1.getName()){
-            if(enemy1.getHealth() <= 0){
-                cout << "\nNo enemy in the room to attack" << endl;
-         }else{
-              cout << "\n""Attacking " << enemy1.getName() <<endl;
-              int health = enemy1.getHealth();
-              int newHealth = health - 20;
-//5) Binary operator overloading */
-                if(newHealth == 0){
-                    player.itemsInventory = player + enemy1;
-                }
-                enemy1.setHealth(newHealth);
+    ::close(fd);
+    World world;
+    string error;
+    bool made = makeWorld(roomCount, path, 0) && world.load(path, error);
+    remove(path);
+    if (!made) {
+        return selfCheck(what.c_str(), false, error.empty() ? "can't write a world" : error);
+    }
+
+    RoomArena rooms;
+    rooms.build(world);
+    Router router;
+    router.attach(rooms);
+    Random random(roomCount);
+    vector<uint32_t> distance;
+    vector<RoomId> route;
+    ostringstream detail;
+
+    for (int change = 0; change < 300 && detail.tellp() == 0; change++) {
+        for (int query = 0; query < 20 && detail.tellp() == 0; query++) {
+            // Landmarks are what wanderers ask for, so half the queries go to one.
+            RoomId from = random.below(roomCount);
+            RoomId to = query % 2 ? router.landmark(random.below(router.landmarkCount())) : random.below(roomCount);
+            distancesFrom(rooms, from, distance);
+            bool found = router.route(from, to, route);
+
+            bool follows = found && !route.empty() && route.front() == from && route.back() == to;
+            for (size_t step = 1; follows && step < route.size(); step++) {
+                follows = rooms.directionTo(route[step - 1], route[step]) != NO_DIRECTION;
+            }
+            Direction hop = router.nextHop(from, to);
+            RoomId next = hop == NO_DIRECTION ? NO_ROOM : rooms.getExit(from, hop);
+            vector<uint32_t> nextDistance;
+            if (next != NO_ROOM) {
+                distancesFrom(rooms, next, nextDistance);
             }
-        }
 
-    if(playerRoom == enemy2Room && name == enemy2.getName()){
-        if(enemy2.getHealth() <= 0){
-            cout << "\nNo enemy in the room to attack" << endl;
-        }else{
-            int health = enemy2.getHealth();
-            cout << "Attacking " << enemy2.getName() <<endl;
-            int newHealth = health - 10;
-            enemy2.setHealth(newHealth);
+            detail << "change " << change << ", from " << from << " to " << to << ": ";
+            if (found != (distance[to] != UINT32_MAX)) {
+                detail << (found ? "a route where there is none" : "no route where there is one");
+            } else if (found && !follows) {
+                detail << "the route doesn't follow the exits";
+            } else if (found && route.size() - 1 != distance[to]) {
+                detail << "a route of " << route.size() - 1 << " steps, the shortest is " << distance[to];
+            } else if (found && from != to && (next == NO_ROOM || nextDistance[to] + 1 != distance[to])) {
+                detail << "the next hop doesn't lead one step closer";
+            } else if (!found && hop != NO_DIRECTION) {
+                detail << "a next hop where there is no route";
+            } else {
+                detail.str("");
+            }
         }
+
+        // An exit anywhere becomes a wall, or leads to a random room.
+        RoomId room = random.below(roomCount);
+        Direction direction = (Direction) random.below(DIRECTION_COUNT);
+        RoomId before = rooms.getExit(room, direction);
+        rooms.setExit(room, direction, random.below(3) == 0 ? NO_ROOM : random.below(roomCount));
+        router.exitChanged(room, direction, before);
     }
+    return selfCheck(what.c_str(), detail.tellp() == 0, detail.str());
 }
 
-void Game::go(string direction)
+// The timer wheel against a plain ordered set of the same timers: random adds (from the next
+// tick to past the top wheel, some periodic), cancels and jumps of time, timers added while
+// others go off included. Every timer has to go off on exactly its tick, and nothing else.
+static bool testTimerWheel()
 {
-    Room *playerRoom = player.getCurrentRoom();
-    Room *enemy1Room = enemy1.getCurrentRoom();
-    Room *enemy2Room = enemy2.getCurrentRoom();
-    Room *next = player.getCurrentRoom()->getExit(direction);
+    struct Expected
+    {
+        TimerWheel::Tick expires;
+        TimerWheel::Tick period;
+    };
+    TimerWheel wheel;
+    unordered_map<uint64_t, Expected> live;                  // by value (each timer's own)
+    set<pair<TimerWheel::Tick, uint64_t> > due;              // (tick, value)
+    vector<TimerId> ids;                                     // [value]
+    Random random(14);
+    ostringstream detail;
+    uint64_t fired = 0;
+
+    // At most this many waiting at once, and periodic ones, so time can go far in few firings.
+    const size_t most = 5000, mostPeriodic = 50;
+    size_t periodic = 0;
+    auto add = [&]() {
+        if (live.size() >= most) {
+            return;
+        }
+        // Mostly within the first wheel or two, now and then far past all four.
+        static const TimerWheel::Tick ranges[] = {64, 4096, 1 << 18, 1 << 24, (TimerWheel::Tick) 1 << 30};
+        TimerWheel::Tick delay = 1 + random.below(ranges[min<uint32_t>(random.below(16), 4)]);
+        TimerWheel::Tick period = periodic < mostPeriodic && random.below(16) == 0 ? 1 + random.below(4096) : 0;
+        periodic += period > 0;
+        uint64_t value = ids.size();
+        ids.push_back(wheel.add(delay, period, 0, value));
+        live[value] = Expected{wheel.now() + delay, period};
+        due.emplace(wheel.now() + delay, value);
+    };
+    auto cancel = [&]() {
+        uint64_t value = random.below(ids.size());
+        auto timer = live.find(value);
+        bool waiting = timer != live.end();
+        if (wheel.cancel(ids[value]) != waiting) {
+            detail << "cancelling timer " << value << " said " << !waiting;
+        } else if (waiting) {
+            due.erase(make_pair(timer->second.expires, value));
+            periodic -= timer->second.period > 0;
+            live.erase(timer);
+        }
+    };
 
-    if(playerRoom != enemy2Room){
-        int random = rand() % 9 + 1;
-        enemy2.setCurrentRoom(rooms[random]);
+    for (size_t i = 0; i < most / 2; i++) {
+        add();
     }
+    for (int step = 0; step < 100000 && detail.tellp() == 0; step++) {
+        for (uint32_t adds = random.below(3); adds > 0; adds--) {
+            add();
+        }
+        if (random.below(2) == 0) {
+            cancel();
+        }
 
-    if (next != nullptr) {
-        if(player.isItemInCharacter("key")) {
-            player.setCurrentRoom(next);
-            player.setStamina<double>(player.getStamina() - 1.5);
-            EventManager::getInstance().trigger("enterRoom", next);
-        }else if(next->getName() == "J") {
-            cout << "Cannot enter room, it is locked." << endl;
-        }else if(playerRoom == enemy1Room || playerRoom == enemy2Room){
-            EventManager::getInstance().trigger("hurt", &player);
-            cout << "You must kill the enemy before you can leave the room." << endl;
-        }else {
-            player.setCurrentRoom(next);
-//3) Template */
-            player.setStamina<double>(player.getStamina() - 1.5);
-            EventManager::getInstance().trigger("enterRoom", next);
+        // Mostly a tick at a time, sometimes a jump across slots, now and then across whole
+        // wheels, so in all time gets past the top one.
+        uint32_t jump = 1;
+        if (random.below(8) == 0) {
+            jump = random.below(128) == 0 ? 1000000 : random.below(16) == 0 ? 10000 : 100;
+        }
+        TimerWheel::Tick target = wheel.now() + 1 + random.below(jump);
+        EventId event;
+        uint64_t value;
+        while (detail.tellp() == 0 && wheel.expire(target, event, value)) {
+            fired++;
+            auto timer = live.find(value);
+            if (timer == live.end() || timer->second.expires != wheel.now()) {
+                detail << "tick " << wheel.now() << ": timer " << value << " went off, "
+                       << (timer == live.end() ? "it wasn't waiting" : "it was due on tick " + to_string(timer->second.expires));
+                break;
+            }
+            if (due.begin()->first != wheel.now()) {
+                detail << "tick " << wheel.now() << ": timer " << due.begin()->second << " was due on tick "
+                       << due.begin()->first << " and didn't go off";
+                break;
+            }
+            due.erase(make_pair(timer->second.expires, value));
+            if (timer->second.period > 0) {
+                timer->second.expires += timer->second.period;
+                due.emplace(timer->second.expires, value);
+            } else {
+                live.erase(timer);
+            }
+            if (random.below(8) == 0) {
+                add();      // while time is going on
+            }
+        }
+        if (detail.tellp() == 0 && !due.empty() && due.begin()->first <= target) {
+            detail << "tick " << target << ": timer " << due.begin()->second << " was due on tick "
+                   << due.begin()->first << " and didn't go off";
+        } else if (detail.tellp() == 0 && wheel.pending() != live.size()) {
+            detail << "tick " << target << ": " << wheel.pending() << " timers waiting, not " << live.size();
         }
-    } else {
-            cout << "You hit a wall" << endl;
     }
-}
 
-void Game::teleport()
-{
-    int selected = rand() % rooms.size();
-    player.setCurrentRoom(rooms[selected]);
-//3) Template */
-    player.setStamina <int> (player.getStamina() - 50);
-    EventManager::getInstance().trigger("enterRoom", rooms[selected]);
+    string what = "the timer wheel matches an ordered set (" + to_string(fired) + " timers went off)";
+    return selfCheck(what.c_str(), detail.tellp() == 0, detail.str());
 }
 
-bool Game::is_over()
+// Checks that each do something two ways that must agree (two dispatch modes, or a fast
+// structure against a plain one) and print how it went. False if any of them failed.
+bool selfTest()
 {
-    return gameOver;
+    World world;
+    string error;
+    if (!world.parse(CLASSIC_WORLD, error)) {
+        cerr << "classic world: " << error << endl;
+        return false;
+    }
+    Game::prepareNames(world);
+
+    cout << "self-test" << endl;
+    bool passed = true;
+    passed &= testQueuedMatchesDirect(world);
+    passed &= testRouter(100);       // every room a landmark: the all-pairs tables
+    passed &= testRouter(1000);      // a few landmarks, and A* for the rest
+    passed &= testTimerWheel();
+    cout << (passed ? "all passed" : "some checks FAILED") << endl;
+    return passed;
 }
 
-Character &Game::getPlayer()
+// Where --profile writes the dispatch profile at exit.
+static const char *profileFile = nullptr;
+
+static void writeProfile()
 {
-    return player;
+    string error;
+    if (!DispatchProfile::get().writeJson(profileFile, error)) {
+        cerr << error << endl;
+    }
 }
 
-void Game::update_screen()
+// Where --trace writes the dispatch trace at exit.
+static const char *traceFile = nullptr;
+
+static void writeTrace()
 {
-    if (!gameOver) {
-        Room *enemy1Room = enemy1.getCurrentRoom();
-        Room *enemy2Room = enemy2.getCurrentRoom();
-        Room *currentRoom = player.getCurrentRoom();
-
-        cout << endl;
-        cout << "You are in " << currentRoom->getName() << endl;
-
-        cout << "Exits:";
-        if (currentRoom->getExit("north") != nullptr) { cout << " north"; }
-        if (currentRoom->getExit("east")  != nullptr) { cout << " east";  }
-        if (currentRoom->getExit("south") != nullptr) { cout << " south"; }
-        if (currentRoom->getExit("west")  != nullptr) { cout << " west";  }
-        cout << endl;
-
-        
-        if(enemy1Room == currentRoom && enemy1.getHealth() > 0){
-//10) Static dispatch */
-           cout << "You have met a " << enemy1.getName() << " in this Room." << endl;
-           cout << "Player: " << player.getName() << " HP: " << player.getHealth() << " ST: " << player.getStamina() << endl;
-           cout << "Enemy: " << enemy1.getName() << " HP: " << enemy1.getHealth() << " ST: " << enemy1.getStamina() << endl;
-           cout << currentRoom->displayItems() << endl;
-       }else if(enemy2Room == currentRoom && enemy2.getHealth() > 0){
-           cout << "You have met a " << enemy2.getName() << " in this Room." << endl;
-           cout << "Player: " << player.getName() << " HP: " << player.getHealth() << " ST: " << player.getStamina() << endl;
-           cout << "Enemy: " << enemy2.getName() << " HP: " << enemy2.getHealth() << " ST: " << enemy2.getStamina() << endl;
-           cout << currentRoom->displayItems() << endl;
-       }else if( enemy1Room == enemy2Room && enemy1Room == currentRoom && enemy1.getHealth() > 0 && enemy2.getHealth() > 0){
-           cout << "You have met a " << enemy1.getName() << " in this Room." << endl;
-           cout << "You have met a " << enemy2.getName() << " in this Room." << endl;
-           cout << "Player: " << player.getName() << " HP: " << player.getHealth() << " ST: " << player.getStamina() << endl;
-           cout << "Enemy: " << enemy1.getName() << " HP: " << enemy1.getHealth() << " ST: " << enemy1.getStamina() << endl;
-           cout << "Enemy: " << enemy2.getName() << " HP: " << enemy2.getHealth() << " ST: " << enemy2.getStamina() << endl;
-           cout << currentRoom->displayItems() << endl;
-       }else {
-           cout << "HP: " << player.getHealth() << " ST: " << player.getStamina() << endl;
-           cout << currentRoom->displayItems() << endl;
-       }
-   }else{
-//10) Dynamic dispatch */
-            Items *newItem = new Items("testItem");
-            pvc = newItem;
-            pvc->virtualExample();
-            
-            vc = &testChar;
-            vc->check();
-            vc->change();
-            
-            cout << "Type \"restart\" or \"exit\"." << endl;
-   }
+    string error;
+    if (!DispatchTrace::writeJson(traceFile, error)) {
+        cerr << error << endl;
+    }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    Game game;
-    EventManager::getInstance().listen("input", new InputListener(&game));
+    // --bench-dispatch, --bench-tokenizer, --bench-random, --bench-timers, --bench-poll <n>:
+    // micro benchmarks. Their allocation counts need a build with -DCOUNT_ALLOCATIONS.
+    if (argc > 1 && strcmp(argv[1], "--bench-dispatch") == 0) {
+        benchDispatch();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-tokenizer") == 0) {
+        benchTokenizer();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-random") == 0) {
+        benchRandom();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-timers") == 0) {
+        benchTimers();
+        return EXIT_SUCCESS;
+    }
+    if (argc > 2 && strcmp(argv[1], "--bench-poll") == 0) {
+        return benchPoll(max(1, atoi(argv[2]))) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // --self-test: plays things two ways that must agree, and says which didn't.
+    if (argc > 1 && strcmp(argv[1], "--self-test") == 0) {
+        return selfTest() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // --queued:            events raised during a turn wait in a queue instead of running recursively.
+    // --replay <file|->:   runs a command script headless and reports throughput.
+    // --repeat <n>:        plays the replay script n times.
+    // --diff:              only redraws the lines of the screen that changed.
+    // --world <file>:      plays a world file (text or binary) instead of the classic one.
+    // --listen <port>, --listen-unix <path>: also takes commands from local connections.
+    // --serve [--workers <n>]: with --listen*, a game per connection instead (no local game).
+    // --load <port|path> <players> [seconds]: plays a server with that many connections.
+    // --make-world <n> <file> [npcs], --compile-world <text> <binary>, --bench-world <file>,
+    // --bench-routing <file>, --bench-save <file>: world tools.
+    // --saves <dir>:       where "save <slot>" and "load <slot>" keep their files (default "saves";
+    //                      --serve sessions have no slots).
+    // --journal <file>:    journals every turn (and first replays it) for the local or replayed game.
+    // --seed <n>:          the local or replayed game's random numbers start from this seed.
+    // --simulate <games> [random|explore]: plays that many games headless on --workers threads
+    //                      (from --seed, or the clock) and prints how they went.
+    // --solve [MB]:        the fewest commands that win the game from --seed (or that there are none),
+    //                      in about that much memory (1024 MB).
+    // --profile [file]:    times every event and listener (the "stats" command shows it) and
+    //                      writes it to the file as JSON when the program ends.
+    // --trace <file>:      writes a span for every trigger and listener call to the file when the
+    //                      program ends, in Chrome's trace event format.
+    const char *script = nullptr;
+    const char *worldFile = nullptr;
+    const char *journalFile = nullptr;
+    const char *seed = nullptr;
+    int tcpPort = -1;
+    const char *unixPath = nullptr;
+    bool serve = false;
+    bool queued = false;
+    int workers = max(1u, thread::hardware_concurrency());
+    bool diff = false;
+    int repeat = 1;
+    uint64_t simulateGames = 0;
+    bool solve = false;
+    size_t solveMegabytes = 1024;
+    Simulator::Policy policy = Simulator::RANDOM;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--queued") == 0) {
+            EventManager::getInstance().setQueued(true);
+            queued = true;
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            diff = true;
+        } else if (strcmp(argv[i], "--world") == 0 && i + 1 < argc) {
+            worldFile = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journalFile = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = argv[++i];
+        } else if (strcmp(argv[i], "--solve") == 0) {
+            solve = true;
+            if (i + 1 < argc && isdigit((unsigned char) argv[i + 1][0])) {
+                solveMegabytes = strtoull(argv[++i], nullptr, 10);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            DispatchProfile::enable();
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                profileFile = argv[++i];
+                atexit(writeProfile);
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            DispatchTrace::enable();
+            traceFile = argv[++i];
+            atexit(writeTrace);
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            simulateGames = strtoull(argv[++i], nullptr, 10);
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !Simulator::parsePolicy(argv[++i], policy)) {
+                cerr << "--simulate: the policy is random or explore" << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            tcpPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--listen-unix") == 0 && i + 1 < argc) {
+            unixPath = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve = true;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--load") == 0 && i + 2 < argc) {
+            int seconds = i + 3 < argc ? max(1, atoi(argv[i + 3])) : 10;
+            return loadTest(argv[i + 1], max(1, atoi(argv[i + 2])), seconds) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--make-world") == 0 && i + 2 < argc) {
+            int npcs = i + 3 < argc && argv[i + 3][0] != '-' ? atoi(argv[i + 3]) : 0;
+            return makeWorld(max(1, atoi(argv[i + 1])), argv[i + 2], npcs) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--compile-world") == 0 && i + 2 < argc) {
+            World world;
+            string error;
+            if (!world.load(argv[i + 1], error) || !world.save(argv[i + 2], error)) {
+                cerr << error << endl;
+                return EXIT_FAILURE;
+            }
+            return EXIT_SUCCESS;
+        } else if (strcmp(argv[i], "--bench-world") == 0 && i + 1 < argc) {
+            return benchWorld(argv[i + 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--bench-routing") == 0 && i + 1 < argc) {
+            return benchRouting(argv[i + 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--saves") == 0 && i + 1 < argc) {
+            Game::setSaveDirectory(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-save") == 0 && i + 1 < argc) {
+            return benchSave(argv[i + 1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    World world;
+    string error;
+    if (worldFile != nullptr ? !world.load(worldFile, error) : !world.parse(CLASSIC_WORLD, error)) {
+        cerr << (worldFile != nullptr ? worldFile : "classic world") << ": " << error << endl;
+        return EXIT_FAILURE;
+    }
+    // From here on the name tables are read only: games on any thread read them without a lock.
+    Game::prepareNames(world);
+
+    if (solve) {
+        uint64_t from = seed != nullptr ? strtoull(seed, nullptr, 10) : time(nullptr);
+        Solver solver(world, from);
+        vector<string> commands;
+        auto start = chrono::steady_clock::now();
+        Solver::Answer answer = solver.solve(workers, solveMegabytes << 20, commands);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (answer != Solver::WINS) {
+            cout << (answer == Solver::CANNOT_WIN ? "No way to win" : "Gave up looking for a way to win")
+                 << " with seed " << from << " (" << solver.statesSeen() << " states, " << seconds << " s)" << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "Won in " << commands.size() << " turns with seed " << from << " (" << solver.statesSeen()
+             << " states, " << seconds << " s):" << endl;
+        for (const string &command : commands) {
+            cout << "  " << command << endl;
+        }
+        if (!solver.check(commands)) {
+            cout << "...but playing it in a game with that seed doesn't win." << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (simulateGames > 0) {
+        Simulator simulator(world, policy, seed != nullptr ? strtoull(seed, nullptr, 10) : time(nullptr));
+        simulator.run(simulateGames, workers);
+        return EXIT_SUCCESS;
+    }
+
+    if (script != nullptr) {
+        ifstream file;
+        if (strcmp(script, "-") != 0) {
+            file.open(script);
+            if (!file) {
+                cerr << "Can't open " << script << endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        // No screen at all, not even the welcome screen.
+        Game game(world, EventManager::getInstance(), -1);
+        if (seed != nullptr) {
+            game.setSeed(strtoull(seed, nullptr, 10));
+        }
+        if (journalFile != nullptr && !game.openJournal(journalFile, error)) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+        replay(game, file.is_open() ? file : cin, repeat);
+        return EXIT_SUCCESS;
+    }
+
+    if (serve) {
+        // Thousands of sessions want thousands of fds.
+        rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+
+        Server server(world, workers, queued);
+        if ((tcpPort < 0 && unixPath == nullptr) ||
+            (tcpPort >= 0 && !server.listenTcp(tcpPort, error)) ||
+            (unixPath != nullptr && !server.listenUnix(unixPath, error))) {
+            cerr << (error.empty() ? "--serve needs --listen <port> or --listen-unix <path>" : error) << endl;
+            return EXIT_FAILURE;
+        }
+        if (tcpPort >= 0) {
+            cerr << "Listening on 127.0.0.1:" << server.tcpPort() << endl;
+        }
+        cerr << "Serving with " << workers << " worker thread(s)" << endl;
+        if (!server.run(error)) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    Game game(world, EventManager::getInstance());
+    game.getScreen().setDiff(diff);
+    if (seed != nullptr) {
+        game.setSeed(strtoull(seed, nullptr, 10));
+    }
+    if (journalFile != nullptr) {
+        if (!game.openJournal(journalFile, error)) {
+            cerr << error << endl;
+            return EXIT_FAILURE;
+        }
+        if (game.getJournal()->replayed() > 0) {
+            game.getScreen() << "Replayed " << (int) game.getJournal()->replayed() << " turns from the journal." << '\n';
+            game.update_screen();
+            game.getScreen().flush();
+        }
+    }
+
+    Poller &poller = EventManager::getInstance().getPoller();
+    if ((tcpPort >= 0 && !poller.listenTcp(tcpPort, &EventManager::getInstance(), error)) ||
+        (unixPath != nullptr && !poller.listenUnix(unixPath, &EventManager::getInstance(), error))) {
+        cerr << error << endl;
+        return EXIT_FAILURE;
+    }
+    if (tcpPort >= 0) {
+        cerr << "Listening on 127.0.0.1:" << poller.tcpPort() << endl;
+    }
+
     EventManager::getInstance().event_loop();
     return EXIT_SUCCESS;
 }